@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+/* We #define MONOCULAR to nothing here because we're using bits of
+ * Monocle as a statically linked component. */
+#define MONOCULAR
+#include "../src/json.c"
+
+/* Compiles a JSON data file, such as a resource map, into the binary
+ * form that mncl_data_load_binary reads:
+ *
+ *    datacompile input.json output.mdat
+ */
+
+int
+main(int argc, char **argv)
+{
+    FILE *f;
+    char *text = NULL;
+    size_t size = 0, capacity = 0, n;
+    MNCL_DATA *data;
+    void *image;
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s input.json output.mdat\n", argv[0]);
+        return 1;
+    }
+    f = fopen(argv[1], "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return 1;
+    }
+    do {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 65536;
+            text = (char *)realloc(text, capacity);
+            if (!text) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+        n = fread(text + size, 1, capacity - size, f);
+        size += n;
+    } while (n > 0);
+    fclose(f);
+    data = mncl_parse_data_arena(text, size);
+    free(text);
+    if (!data) {
+        fprintf(stderr, "%s:%s\n", argv[1], mncl_data_error());
+        return 1;
+    }
+    image = mncl_data_save_binary(data, &size);
+    mncl_free_data(data);
+    if (!image) {
+        fprintf(stderr, "%s\n", mncl_data_error());
+        return 1;
+    }
+    f = fopen(argv[2], "wb");
+    if (!f || fwrite(image, 1, size, f) != size) {
+        fprintf(stderr, "Could not write %s\n", argv[2]);
+        return 1;
+    }
+    fclose(f);
+    free(image);
+    mncl_uninit_atoms();
+    return 0;
+}
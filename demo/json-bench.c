@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* We #define MONOCULAR to nothing here because we're using bits of
+ * Monocle as a statically linked component. */
+#define MONOCULAR
+#include "../src/json.c"
+
+/* Parser throughput benchmark. Each line of output is one document
+ * shape at one size and nesting depth, as tab-separated fields:
+ *
+ *    mode  shape  depth  bytes  runs  ns_per_byte  mb_per_s
+ *
+ * Each document is parsed and freed again, either as individual heap
+ * nodes (mode "heap", mncl_parse_data) or as one arena (mode "arena",
+ * mncl_parse_data_arena), or is only parsed and reported to event
+ * handlers that do nothing (mode "events", mncl_parse_data_events).
+ * Mode "push" builds arena documents too, but feeds them to a push
+ * parser PUSH_PIECE bytes at a time, as resource maps are read. Mode
+ * "binary" saves each document with mncl_data_save_binary first and
+ * then times mncl_data_load_binary on the image, counting the bytes
+ * of the text rather than of the image. Mode "write" parses each
+ * document once and times mncl_write_data writing it back out as
+ * compact text, again counting the bytes of the original text. "flat"
+ * is one long array of
+ * numbers and strings, "frames" is a map of sprite-like objects with
+ * arrays of frame rectangles, "resmap" is much the same but indented
+ * and spread over lines like the demo resource maps, "earthball" is
+ * the demo's own resource map as it is on disk, and "nested" is the
+ * elements of "flat" spread evenly over arrays nested "depth" levels
+ * deep. The first group of lines grows the documents at a fixed
+ * depth; the second holds the size fixed and grows the depth. A
+ * linear-time parser gives the same ns_per_byte throughout each
+ * group. Small documents are parsed enough times that every line
+ * covers at least MIN_BYTES of input. Name a shape (or any substring
+ * of "mode/shape/depth/bytes") on the command line to run only
+ * matching cases. */
+
+#define MIN_BYTES (64L * 1024 * 1024)
+#define PUSH_PIECE 16384
+#define EARTHBALL "demo/resources/earthball.json"
+
+typedef struct {
+    char *s;
+    size_t size, capacity;
+} BUFFER;
+
+static void
+append(BUFFER *b, const char *s)
+{
+    size_t n = strlen(s);
+    if (b->size + n + 1 > b->capacity) {
+        b->capacity = (b->size + n + 1) * 2;
+        b->s = (char *)realloc(b->s, b->capacity);
+        if (!b->s) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(b->s + b->size, s, n + 1);
+    b->size += n;
+}
+
+static unsigned int rng_state = 12345;
+
+static unsigned int
+rng(void)
+{
+    rng_state = rng_state * 1103515245u + 12345u;
+    return (rng_state >> 8) & 0xffffff;
+}
+
+/* Appends one array element, with its trailing comma */
+static void
+element(BUFFER *b)
+{
+    char item[64];
+    if (rng() % 2) {
+        snprintf(item, sizeof(item), "%u.%u,", rng() % 10000, rng() % 100);
+    } else {
+        snprintf(item, sizeof(item), "\"item%u\\n\",", rng() % 10000);
+    }
+    append(b, item);
+}
+
+static void
+make_nested(BUFFER *b, int depth, size_t bytes)
+{
+    int level;
+    size_t per_level = bytes / depth;
+    for (level = 0; level < depth; ++level) {
+        size_t start = b->size;
+        append(b, "[");
+        while (b->size - start < per_level) {
+            element(b);
+        }
+    }
+    append(b, "0");
+    for (level = 0; level < depth; ++level) {
+        append(b, "]");
+    }
+}
+
+static void
+make_frames(BUFFER *b, size_t bytes)
+{
+    char item[128];
+    int sprite = 0;
+    append(b, "{");
+    while (b->size < bytes) {
+        int i, frames = 1 + rng() % 16;
+        snprintf(item, sizeof(item), "%s\"sprite%d\": { \"image\": \"image%u\", \"size\": [%u, %u], \"frames\": [",
+                 sprite ? ",\n" : "\n", sprite, rng() % 100, rng() % 64, rng() % 64);
+        append(b, item);
+        for (i = 0; i < frames; ++i) {
+            snprintf(item, sizeof(item), "%s[%u, %u]", i ? ", " : "", rng() % 1024, rng() % 1024);
+            append(b, item);
+        }
+        append(b, "] }");
+        ++sprite;
+    }
+    append(b, "\n}");
+}
+
+/* Hand-formatted sprite definitions, laid out as in earthball.json */
+static void
+make_resmap(BUFFER *b, size_t bytes)
+{
+    char item[256];
+    int sprite = 0;
+    append(b, "{\n    \"sprite\": {");
+    while (b->size < bytes) {
+        int i, frames = 1 + rng() % 16;
+        snprintf(item, sizeof(item), "%s\n        \"sprite%d\": { \"width\": %u,\n                   \"height\": %u,\n                   \"frames\": [",
+                 sprite ? "," : "", sprite, rng() % 64, rng() % 64);
+        append(b, item);
+        for (i = 0; i < frames; ++i) {
+            snprintf(item, sizeof(item), "%s{\"spritesheet\": \"sheet%u\", \"x\": %3u, \"y\": %3u}",
+                     i ? ",\n                              " : "", rng() % 100, rng() % 512, rng() % 512);
+            append(b, item);
+        }
+        append(b, "] }");
+        ++sprite;
+    }
+    append(b, "\n    }\n}\n");
+}
+
+/* Reads a whole file, returning 0 if it can't be read */
+static int
+load_file(BUFFER *b, const char *path)
+{
+    char chunk[4096];
+    size_t n;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    append(b, "");
+    while ((n = fread(chunk, 1, sizeof(chunk) - 1, f)) > 0) {
+        chunk[n] = '\0';
+        append(b, chunk);
+    }
+    fclose(f);
+    return 1;
+}
+
+static const char *filter = NULL;
+
+static void
+bench(const char *shape, int depth, size_t bytes)
+{
+    static const char *modes[] = { "heap", "arena", "events", "push", "binary", "write", NULL };
+    static MNCL_DATA_EVENTS no_events;
+    BUFFER b = { NULL, 0, 0 };
+    void *image = NULL;
+    size_t image_size = 0;
+    MNCL_DATA *doc = NULL;
+    MNCL_DATA_BUFFER out = { NULL, 0, 0 };
+    char name[128];
+    long runs, r;
+    clock_t begin;
+    double ns;
+    int m;
+    for (m = 0; modes[m]; ++m) {
+        snprintf(name, sizeof(name), "%s/%s/%d/%lu", modes[m], shape, depth, (unsigned long)bytes);
+        if (filter && !strstr(name, filter)) {
+            continue;
+        }
+        if (!b.s && !strcmp(shape, "earthball")) {
+            if (!load_file(&b, EARTHBALL)) {
+                fprintf(stderr, "%s: can't read %s\n", name, EARTHBALL);
+                return;
+            }
+        } else if (!b.s && !strcmp(shape, "frames")) {
+            make_frames(&b, bytes);
+        } else if (!b.s && !strcmp(shape, "resmap")) {
+            make_resmap(&b, bytes);
+        } else if (!b.s) {
+            make_nested(&b, depth, bytes);
+        }
+        if (m == 4 && !image) {
+            MNCL_DATA *d = mncl_parse_data_arena(b.s, b.size);
+            image = d ? mncl_data_save_binary(d, &image_size) : NULL;
+            mncl_free_data(d);
+            if (!image) {
+                fprintf(stderr, "%s: %s\n", name, mncl_data_error());
+                exit(1);
+            }
+        }
+        if (m == 5 && !doc) {
+            doc = mncl_parse_data_arena(b.s, b.size);
+            if (!doc) {
+                fprintf(stderr, "%s: %s\n", name, mncl_data_error());
+                exit(1);
+            }
+        }
+        runs = (MIN_BYTES + b.size - 1) / b.size;
+        begin = clock();
+        for (r = 0; r < runs; ++r) {
+            MNCL_DATA *d;
+            if (m == 2) {
+                if (!mncl_parse_data_events(b.s, b.size, &no_events, NULL)) {
+                    fprintf(stderr, "%s: %s\n", name, mncl_data_error());
+                    exit(1);
+                }
+                continue;
+            } else if (m == 5) {
+                out.size = 0;
+                if (!mncl_write_data(doc, &out, 0)) {
+                    fprintf(stderr, "%s: %s\n", name, mncl_data_error());
+                    exit(1);
+                }
+                continue;
+            } else if (m == 3) {
+                MNCL_DATA_PARSER *parser = mncl_data_parser_new_arena(b.size);
+                size_t done;
+                for (done = 0; done < b.size; done += PUSH_PIECE) {
+                    mncl_data_parser_feed(parser, b.s + done, done + PUSH_PIECE < b.size ? PUSH_PIECE : b.size - done);
+                }
+                d = mncl_data_parser_finish(parser);
+            } else if (m == 4) {
+                d = mncl_data_load_binary(image, image_size);
+            } else {
+                d = m ? mncl_parse_data_arena(b.s, b.size) : mncl_parse_data(b.s, b.size);
+            }
+            if (!d) {
+                fprintf(stderr, "%s: %s\n", name, mncl_data_error());
+                exit(1);
+            }
+            mncl_free_data(d);
+        }
+        ns = ((double)(clock() - begin) / CLOCKS_PER_SEC) * 1e9 / ((double)runs * b.size);
+        printf("%s\t%s\t%d\t%lu\t%ld\t%.2f\t%.1f\n", modes[m], shape, depth, (unsigned long)b.size, runs, ns, 1000.0 / ns);
+        fflush(stdout);
+    }
+    mncl_free_data(doc);
+    free(out.data);
+    free(image);
+    free(b.s);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 1024, 16384, 262144, 4194304, 0 };
+    static const int depths[] = { 1, 4, 16, 64, 256, 1024, 4096, 0 };
+    int i;
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    printf("mode\tshape\tdepth\tbytes\truns\tns_per_byte\tmb_per_s\n");
+    bench("earthball", 5, 0);
+    for (i = 0; sizes[i]; ++i) {
+        bench("flat", 1, sizes[i]);
+        bench("frames", 4, sizes[i]);
+        bench("resmap", 5, sizes[i]);
+        bench("nested", 16, sizes[i]);
+    }
+    for (i = 0; depths[i]; ++i) {
+        bench("nested", depths[i], 1048576);
+    }
+    mncl_uninit_atoms();
+    return 0;
+}
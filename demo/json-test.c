@@ -55,21 +55,471 @@ mncl_data_dump(MNCL_DATA *v)
     }
 }
 
+typedef struct {
+    MNCL_DATA *other;
+    int equal;
+} DATA_EQUAL_CTX;
+
+static int data_equal(MNCL_DATA *a, MNCL_DATA *b);
+
+static void
+data_equal_node(const char *key, void *value, void *user) {
+    DATA_EQUAL_CTX *ctx = (DATA_EQUAL_CTX *)user;
+    ctx->equal = ctx->equal && data_equal((MNCL_DATA *)value, mncl_data_lookup(ctx->other, key));
+}
+
+static int
+data_equal(MNCL_DATA *a, MNCL_DATA *b)
+{
+    int i;
+    if (!a || !b || a->tag != b->tag) {
+        return 0;
+    }
+    switch (a->tag) {
+    case MNCL_DATA_BOOLEAN:
+        return a->value.boolean == b->value.boolean;
+    case MNCL_DATA_NUMBER:
+        return a->value.number == b->value.number;
+    case MNCL_DATA_STRING:
+        return !strcmp(a->value.string, b->value.string);
+    case MNCL_DATA_ARRAY:
+        if (a->value.array.size != b->value.array.size) {
+            return 0;
+        }
+        for (i = 0; i < a->value.array.size; ++i) {
+            if (!data_equal(a->value.array.data[i], b->value.array.data[i])) {
+                return 0;
+            }
+        }
+        return 1;
+    case MNCL_DATA_OBJECT:
+    {
+        DATA_EQUAL_CTX ctx;
+        ctx.other = b;
+        ctx.equal = mncl_kv_count(a->value.object) == mncl_kv_count(b->value.object);
+        mncl_kv_foreach(a->value.object, data_equal_node, &ctx);
+        return ctx.equal;
+    }
+    default:
+        return 1;
+    }
+}
+
+/* Tallies of what a document holds, gathered both from events and
+ * from a parsed tree so the two can be compared */
+typedef struct {
+    int objects, arrays, keys, scalars;
+} DATA_COUNTS;
+
+static int count_begin_object(void *user) { ++((DATA_COUNTS *)user)->objects; return 1; }
+static int count_begin_array(void *user) { ++((DATA_COUNTS *)user)->arrays; return 1; }
+static int count_key(void *user, const char *key, size_t size) { ++((DATA_COUNTS *)user)->keys; return 1; }
+static int count_scalar(void *user) { ++((DATA_COUNTS *)user)->scalars; return 1; }
+static int count_boolean(void *user, int value) { return count_scalar(user); }
+static int count_number(void *user, double value) { return count_scalar(user); }
+static int count_string(void *user, const char *s, size_t size) { return count_scalar(user); }
+static int stop_number(void *user, double value) { return 0; }
+
+static void count_data(MNCL_DATA *v, DATA_COUNTS *counts);
+
+static void
+count_data_node(const char *key, void *value, void *user) {
+    ++((DATA_COUNTS *)user)->keys;
+    count_data((MNCL_DATA *)value, (DATA_COUNTS *)user);
+}
+
+static void
+count_data(MNCL_DATA *v, DATA_COUNTS *counts)
+{
+    int i;
+    switch (v->tag) {
+    case MNCL_DATA_ARRAY:
+        ++counts->arrays;
+        for (i = 0; i < v->value.array.size; ++i) {
+            count_data(v->value.array.data[i], counts);
+        }
+        break;
+    case MNCL_DATA_OBJECT:
+        ++counts->objects;
+        mncl_kv_foreach(v->value.object, count_data_node, counts);
+        break;
+    default:
+        ++counts->scalars;
+    }
+}
+
+static int
+test_events(const char *s, MNCL_DATA *v)
+{
+    MNCL_DATA_EVENTS events;
+    DATA_COUNTS expected, actual;
+    memset(&events, 0, sizeof(events));
+    memset(&expected, 0, sizeof(expected));
+    memset(&actual, 0, sizeof(actual));
+    count_data(v, &expected);
+    events.begin_object = count_begin_object;
+    events.begin_array = count_begin_array;
+    events.key = count_key;
+    events.boolean = count_boolean;
+    events.number = count_number;
+    events.string = count_string;
+    events.null_value = count_scalar;
+    if (!mncl_parse_data_events(s, strlen(s), &events, &actual) || memcmp(&expected, &actual, sizeof(expected))) {
+        return 0;
+    }
+    /* Any handler may stop the parse */
+    events.number = stop_number;
+    return !mncl_parse_data_events("[true, 1]", 9, &events, &actual) &&
+        !strcmp(mncl_data_error(), "0:8: Parsing stopped by event handler");
+}
+
+/* Feeds s to a push parser in pieces of each of several sizes and
+ * checks that the result always matches v */
+static int
+test_push(const char *s, MNCL_DATA *v)
+{
+    static const size_t pieces[] = { 1, 7, 64, 4096, 0 };
+    size_t size = strlen(s);
+    int i, ok = 1;
+    for (i = 0; pieces[i]; ++i) {
+        MNCL_DATA_PARSER *parser = i % 2 ? mncl_data_parser_new_arena(size) : mncl_data_parser_new();
+        MNCL_DATA *d;
+        size_t done;
+        for (done = 0; done < size; done += pieces[i]) {
+            mncl_data_parser_feed(parser, s + done, done + pieces[i] < size ? pieces[i] : size - done);
+        }
+        d = mncl_data_parser_finish(parser);
+        ok = ok && data_equal(v, d);
+        mncl_free_data(d);
+    }
+    return ok;
+}
+
+/* Checks that mncl_parse_data_ex reports the error that
+ * mncl_data_error does, and clears it on success */
+static int
+test_errors(void)
+{
+    static const char bad[] = "[1, 2,\n  tru]";
+    MNCL_DATA_ERROR error;
+    MNCL_DATA *d;
+    int flags, ok = 1;
+    for (flags = 0; ok && flags <= MNCL_DATA_PARSE_ARENA; flags += MNCL_DATA_PARSE_ARENA) {
+        d = mncl_parse_data_ex(bad, strlen(bad), flags, &error);
+        ok = !d && error.line == 1 && error.column == 3 &&
+            !strcmp(error.message, "1:3: Expected value") && !strcmp(mncl_data_error(), error.message);
+        d = mncl_parse_data_ex("[]", 2, flags, &error);
+        ok = ok && d && !error.message[0] && !mncl_data_error()[0];
+        mncl_free_data(d);
+    }
+    return ok;
+}
+
+/* Round-trips v through the binary form, and checks that damaged
+ * images are turned away rather than loaded */
+static int
+test_binary(MNCL_DATA *v)
+{
+    size_t size, i;
+    unsigned char *image = (unsigned char *)mncl_data_save_binary(v, &size);
+    MNCL_DATA *d;
+    int ok;
+    if (!image) {
+        return 0;
+    }
+    d = mncl_data_load_binary(image, size);
+    ok = data_equal(v, d);
+    mncl_free_data(d);
+    for (i = 0; ok && i < size; ++i) {
+        d = mncl_data_load_binary(image, i);
+        ok = (d == NULL);
+    }
+    /* Any byte may change without harm, though not every change is
+     * caught */
+    for (i = 0; ok && i < size; ++i) {
+        image[i] ^= 0x5a;
+        mncl_free_data(mncl_data_load_binary(image, size));
+        image[i] ^= 0x5a;
+    }
+    free(image);
+    return ok;
+}
+
+/* A resmap fragment for the tests below that need particular paths
+ * to exist, whatever file was named on the command line */
+static const char sprite_doc[] =
+    "{\"sprite\": {\"earth\": {\"width\": 32, \"frames\": ["
+    "{\"spritesheet\": \"earth\", \"x\": 0, \"y\": 0}, "
+    "{\"spritesheet\": \"earth\", \"x\": 32, \"y\": 0}, "
+    "{\"spritesheet\": \"earth\", \"x\": 64, \"y\": 32}]}, "
+    "\"moon\": {\"width\": 16, \"frames\": []}}, \"music\": \"march.it\"}";
+
+/* Checks compiled paths against chains of ordinary lookups, in both
+ * heap and arena documents */
+static int
+test_paths(void)
+{
+    static const char *paths[] = {
+        "sprite", "sprite/earth/width", "sprite/earth/frames/0/x",
+        "sprite/earth/frames/1/spritesheet", "sprite/earth/frames/99/x",
+        "sprite/earth/frames/x", "sprite/earth/width/0", "sprite/moon/frames/0",
+        "music", "music/0", "nothing", "", NULL
+    };
+    MNCL_DATA *v = mncl_parse_data(sprite_doc, strlen(sprite_doc));
+    MNCL_DATA *a = mncl_data_clone_arena(v), *sprites;
+    MNCL_DATA_PATH *x = mncl_data_path_new("x");
+    int i, ok = (v != NULL && a != NULL && x != NULL);
+    for (i = 0; ok && paths[i]; ++i) {
+        MNCL_DATA_PATH *path = mncl_data_path_new(paths[i]);
+        MNCL_DATA *expected = v;
+        const char *p = paths[i];
+        while (expected) {
+            char step[64];
+            size_t len = strcspn(p, "/");
+            memcpy(step, p, len);
+            step[len] = '\0';
+            if (expected->tag == MNCL_DATA_ARRAY) {
+                int n = (len && strspn(step, "0123456789") == len) ? atoi(step) : -1;
+                expected = (n >= 0 && n < expected->value.array.size) ? expected->value.array.data[n] : NULL;
+            } else {
+                expected = mncl_data_lookup(expected, step);
+            }
+            if (!p[len]) {
+                break;
+            }
+            p += len + 1;
+        }
+        ok = path && mncl_data_path_lookup(v, path) == expected &&
+            (expected ? data_equal(mncl_data_path_lookup(a, path), expected) : !mncl_data_path_lookup(a, path));
+        mncl_free_data_path(path);
+    }
+    /* One path used on many similar maps, as the sprite loader does */
+    sprites = mncl_data_lookup(a, "sprite");
+    if (ok && sprites) {
+        MNCL_DATA *frames = mncl_data_lookup(mncl_data_lookup(sprites, "earth"), "frames");
+        for (i = 0; ok && frames && i < frames->value.array.size; ++i) {
+            MNCL_DATA *frame = frames->value.array.data[i];
+            ok = mncl_data_path_lookup(frame, x) == mncl_data_lookup(frame, "x");
+        }
+    }
+    mncl_free_data_path(x);
+    mncl_free_data(a);
+    mncl_free_data(v);
+    return ok;
+}
+
+static MNCL_DATA *
+data_at(MNCL_DATA *doc, const char *path)
+{
+    MNCL_DATA_PATH *compiled = mncl_data_path_new(path);
+    MNCL_DATA *result = compiled ? mncl_data_path_lookup(doc, compiled) : NULL;
+    mncl_free_data_path(compiled);
+    return result;
+}
+
+/* Checks that shared copies see their own writes and nobody else's,
+ * and that whatever they didn't write is still the arena's */
+static int
+test_sharing(void)
+{
+    MNCL_DATA *v = mncl_parse_data(sprite_doc, strlen(sprite_doc));
+    MNCL_DATA *a = mncl_data_clone_arena(v), *s1, *s2, *part, *sprite, *heap, *n;
+    MNCL_DATA mine = { MNCL_DATA_NUMBER };
+    int ok;
+    if (!v || !a) {
+        mncl_free_data(v);
+        mncl_free_data(a);
+        return 0;
+    }
+    s1 = mncl_data_share(a);
+    s2 = mncl_data_share(s1);
+    heap = mncl_data_share(v);
+    ok = s1 && s2 && heap && data_equal(s1, v) && data_equal(s2, v) && data_equal(heap, v);
+    ok = ok && mncl_data_writable(a, "") == NULL;
+    n = ok ? mncl_data_writable(s1, "sprite/earth/width") : NULL;
+    if (n && n->tag == MNCL_DATA_NUMBER) {
+        n->value.number = 999;
+    } else {
+        ok = 0;
+    }
+    ok = ok && data_at(s1, "sprite/earth/width")->value.number == 999 &&
+        data_equal(a, v) && data_equal(s2, v) &&
+        data_at(s1, "sprite/earth/frames") == data_at(a, "sprite/earth/frames");
+    n = ok ? mncl_data_writable(s2, "sprite/earth/frames/0/x") : NULL;
+    if (n && n->tag == MNCL_DATA_NUMBER) {
+        n->value.number = -1;
+    } else {
+        ok = 0;
+    }
+    ok = ok && data_at(s2, "sprite/earth/frames/0/x")->value.number == -1 &&
+        data_at(s2, "sprite/earth/frames/1") == data_at(a, "sprite/earth/frames/1") &&
+        data_at(s1, "sprite/earth/frames/0/x")->value.number == data_at(v, "sprite/earth/frames/0/x")->value.number;
+    /* Parts of the arena share; parts already written copy */
+    sprite = data_at(a, "sprite");
+    part = ok ? mncl_data_share_part(a, sprite) : NULL;
+    ok = ok && part && data_at(part, "earth") == data_at(sprite, "earth");
+    mncl_free_data(a);
+    mncl_free_data(part);
+    part = ok ? mncl_data_share_part(s1, data_at(s1, "sprite/earth")) : NULL;
+    mncl_free_data(s1);
+    ok = ok && part && data_at(part, "width")->value.number == 999;
+    mncl_free_data(part);
+    ok = ok && data_equal(data_at(s2, "sprite/earth/frames/1"), data_at(v, "sprite/earth/frames/1"));
+    mncl_free_data(s2);
+    mncl_free_data(heap);
+    mncl_free_data(v);
+    /* Nodes a client fills in itself are plain heap nodes */
+    mine.value.number = 5;
+    part = ok ? mncl_data_share(&mine) : NULL;
+    ok = ok && part && part != &mine && part->value.number == 5 &&
+        mncl_data_writable(&mine, "") == &mine;
+    mncl_free_data(part);
+    return ok;
+}
+
+/* Checks that numbers convert to exactly what strtod gives, for a
+ * few awkward cases and a spread of random ones */
+static int
+test_numbers(void)
+{
+    static const char *cases[] = {
+        "0", "-0", "-0.0", "0e400", "1", "-17", "9007199254740992",
+        "9007199254740993", "18446744073709551615", "123456789012345678901234",
+        "0.1", "0.3", "3.14159", "-2.5e-3", "1e22", "1e23", "123e30",
+        "4.9406564584124654e-324", "2.2250738585072014e-308",
+        "1.7976931348623157e308", "1e309", "1e-400", "0.000001234",
+        "1.00000000000000011102230246251565404236316680908203125", NULL
+    };
+    char text[64];
+    int i, ok = 1;
+    for (i = 0; ok && i < 100000 + 24; ++i) {
+        MNCL_DATA *d;
+        double expected;
+        if (i < 24 && cases[i]) {
+            strcpy(text, cases[i]);
+        } else {
+            int digits = rand() % 20, e = rand() % 80 - 40;
+            snprintf(text, sizeof(text), "%s%d.%0*de%d", rand() % 2 ? "-" : "", rand() % 100000,
+                     digits % 10, rand() % 1000000000, e);
+        }
+        expected = strtod(text, NULL);
+        d = mncl_parse_data(text, strlen(text));
+        if (!d || d->tag != MNCL_DATA_NUMBER || memcmp(&d->value.number, &expected, sizeof(double))) {
+            printf("%s: FAILURE: expected %.17g\n", text, expected);
+            ok = 0;
+        }
+        mncl_free_data(d);
+    }
+    return ok;
+}
+
+/* Whether text parses back to exactly v */
+static int
+reads_back(const char *text, size_t size, MNCL_DATA *v)
+{
+    MNCL_DATA *d = mncl_parse_data(text, size);
+    int ok = data_equal(v, d);
+    mncl_free_data(d);
+    return ok;
+}
+
+/* Checks that written documents read back as they were, that numbers
+ * come out short and exact, and that the output is as expected in
+ * detail for a small document */
+static int
+test_writing(MNCL_DATA *v)
+{
+    static const char *numbers[] = {
+        "0.1", "1.5", "100", "-0", "0.3", "-2.5", "0.005", "9007199254740991",
+        "1e+22", "0.30000000000000004", "5e-324", "1.7976931348623157e+308", NULL
+    };
+    static const char small[] = "{\"b\": [1, 2.25, \"a\\\"b\\\\c\\nd\\u0001\"], \"a\": {}, \"c\": [], \"d\": null, \"e\": true}";
+    static const char compact[] = "{\"a\":{},\"b\":[1,2.25,\"a\\\"b\\\\c\\nd\\u0001\"],\"c\":[],\"d\":null,\"e\":true}";
+    static const char pretty[] = "{\n    \"a\": {},\n    \"b\": [\n        1,\n        2.25,\n        \"a\\\"b\\\\c\\nd\\u0001\"\n    ],\n    \"c\": [],\n    \"d\": null,\n    \"e\": true\n}\n";
+    MNCL_DATA_BUFFER b = { NULL, 0, 0 };
+    MNCL_DATA *d, *a = mncl_data_clone_arena(v);
+    FILE *f;
+    int i, ok;
+    ok = mncl_write_data(v, &b, 0) && reads_back(b.data, b.size, v);
+    b.size = 0;
+    ok = ok && mncl_write_data(a, &b, MNCL_DATA_WRITE_PRETTY) && reads_back(b.data, b.size, v);
+    b.size = 0;
+    ok = ok && mncl_write_data(v, &b, MNCL_DATA_WRITE_BINARY);
+    d = ok ? mncl_data_load_binary(b.data, b.size) : NULL;
+    ok = ok && data_equal(v, d);
+    mncl_free_data(d);
+    mncl_free_data(a);
+    /* Output goes after whatever the buffer already holds */
+    d = mncl_parse_data(small, strlen(small));
+    b.size = 0;
+    ok = ok && mncl_write_data(d, &b, 0) && mncl_write_data(d, &b, MNCL_DATA_WRITE_PRETTY) &&
+        b.size == strlen(compact) + strlen(pretty) && !memcmp(b.data, compact, strlen(compact)) &&
+        !strcmp(b.data + strlen(compact), pretty);
+    f = tmpfile();
+    if (ok && f) {
+        char text[sizeof(pretty)];
+        ok = mncl_write_data_file(d, f, MNCL_DATA_WRITE_PRETTY);
+        rewind(f);
+        ok = ok && fread(text, 1, sizeof(text), f) == strlen(pretty) && !memcmp(text, pretty, strlen(pretty));
+    }
+    if (f) {
+        fclose(f);
+    }
+    mncl_free_data(d);
+    for (i = 0; ok && numbers[i]; ++i) {
+        d = mncl_parse_data(numbers[i], strlen(numbers[i]));
+        b.size = 0;
+        ok = d && mncl_write_data(d, &b, 0) && !strcmp(b.data, numbers[i]);
+        if (!ok) {
+            printf("%s: FAILURE: written as %s\n", numbers[i], b.data);
+        }
+        mncl_free_data(d);
+    }
+    /* Any bits at all, bar infinities and NaNs */
+    for (i = 0; ok && i < 100000; ++i) {
+        uint64_t bits = ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+        double x;
+        if (i % 2) {
+            bits = (uint64_t)rand() % 100000;
+            x = (double)bits / exact_tens[1 + i % 8];
+        } else {
+            memcpy(&x, &bits, sizeof(x));
+        }
+        if (x != x || x - x != 0) {
+            continue;
+        }
+        d = data_node(NULL, MNCL_DATA_NUMBER, sizeof(MNCL_DATA));
+        d->value.number = x;
+        b.size = 0;
+        ok = mncl_write_data(d, &b, 0) && reads_back(b.data, b.size, d) && b.size < 25;
+        if (!ok) {
+            printf("%.17g: FAILURE: written as %s\n", x, b.data);
+        }
+        mncl_free_data(d);
+    }
+    free(b.data);
+    return ok;
+}
+
 static void
 test_size(const char *s, int expected) {
     int actual;
+    const char *text;
     MNCL_DATA_PARSE_CTX ctx;
     ctx.s = s;
     ctx.size = strlen(s);
     ctx.i = 0;
-    ctx.line = ctx.col = 0;
-    error_str[0] = error_str[511] = '\0';
-    actual = mncl_data_str_size(&ctx, 0);
-    if (ctx.i || ctx.line || ctx.col) {
-        printf("%s: FAILURE: mncl_data_str_size advanced our context\n", s);
+    ctx.base = ctx.mark = ctx.mark_line = ctx.mark_nl = 0;
+    ctx.scratch = NULL;
+    ctx.top = ctx.capacity = 0;
+    ctx.error.message[0] = '\0';
+    actual = mncl_data_str_decode(&ctx, &text);
+    free(ctx.scratch);
+    if (ctx.top) {
+        printf("%s: FAILURE: mncl_data_str_decode pushed onto the scratch stack\n", s);
     }
     if (actual < 0) {
-        printf("%s: %s: Error message \"%s\"\n", s, (expected < 0) ? "SUCCESS" : "FAILURE", error_str);
+        printf("%s: %s: Error message \"%s\"\n", s, (expected < 0) ? "SUCCESS" : "FAILURE", ctx.error.message);
     } else if (actual != expected) {
         printf("%s: FAILURE: Expected %d, got %d\n", s, expected, actual);
     } else {
@@ -79,7 +529,7 @@ test_size(const char *s, int expected) {
 
 int main (int argc, char **argv) {
     char *s;
-    MNCL_DATA *v, *d;
+    MNCL_DATA *v, *d, *a, *c;
     s = calloc(65535, 1);
     if (argc > 1) {
         FILE *f = fopen(argv[1], "r");
@@ -96,6 +546,19 @@ int main (int argc, char **argv) {
         return 1;
     }
     v = mncl_parse_data(s, strlen(s));
+    a = mncl_parse_data_arena(s, strlen(s));
+    c = mncl_data_clone_arena(a);
+    printf("Arena documents: %s\n", (data_equal(v, a) && data_equal(v, c)) ? "SUCCESS" : "FAILURE");
+    printf("Data events: %s\n", test_events(s, v) ? "SUCCESS" : "FAILURE");
+    printf("Push parsing: %s\n", test_push(s, v) ? "SUCCESS" : "FAILURE");
+    printf("Error reports: %s\n", test_errors() ? "SUCCESS" : "FAILURE");
+    printf("Binary documents: %s\n", test_binary(v) ? "SUCCESS" : "FAILURE");
+    printf("Numbers: %s\n", test_numbers() ? "SUCCESS" : "FAILURE");
+    printf("Compiled paths: %s\n", test_paths() ? "SUCCESS" : "FAILURE");
+    printf("Shared documents: %s\n", test_sharing() ? "SUCCESS" : "FAILURE");
+    printf("Writing: %s\n", test_writing(v) ? "SUCCESS" : "FAILURE");
+    mncl_free_data(a);
+    mncl_free_data(c);
     d = mncl_data_clone(v);
     mncl_free_data(v);
     mncl_data_dump(d); printf("\n");
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+/* We #define MONOCULAR to nothing here because we're using bits of
+ * Monocle as a statically linked component. */
+#define MONOCULAR
+#include "../src/raw_data.c"
+
+/* Asset loading benchmark. Fills ASSET_DIR with FILES files of
+ * random bytes, as many megabytes in all as the first argument says
+ * (256 if there isn't one), and packs the same files uncompressed
+ * into ASSET_ZIP, as texture and audio packs are. Files of the right
+ * size are reused rather than written again, so the page cache can
+ * be dropped between runs to time the disk rather than memory. Then
+ * every file is loaded once in each mode, and the results come out
+ * after the loaders' own chatter as tab-separated fields:
+ *
+ *    mode  files  bytes  ms  mb_per_s
+ *
+ * Mode "fread" reads each file whole into a heap buffer with plain
+ * stdio, which is as fast as loading can hope to be. "directory"
+ * loads them with mncl_acquire_raw from a resource directory, and
+ * "zipfile" from the zip. Each loaded file is released again at
+ * once. Name a mode as the second argument to run only that one. */
+
+#define FILES 64
+#define NAME_LENGTH 12 /* Of "asset000.bin" */
+#define ASSET_DIR "bin/rawbench-assets"
+#define ASSET_ZIP "bin/rawbench-assets.zip"
+
+/* Loading waits on the disk, so this is wall time, not CPU time */
+static double
+now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static long
+file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) ? -1 : (long)st.st_size;
+}
+
+static void
+put_u16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void
+put_u32(unsigned char *p, unsigned int v)
+{
+    put_u16(p, v & 0xffff);
+    put_u16(p + 2, v >> 16);
+}
+
+/* Writes the assets and the zipfile, unless they are already there */
+static int
+make_assets(long each)
+{
+    unsigned char *data = (unsigned char *)malloc(each), *dir;
+    unsigned int rng = 12345, crc, offset = 0;
+    char name[64], path[128];
+    long i, j, dirsize = 0;
+    FILE *zip;
+    dir = (unsigned char *)malloc(FILES * (46 + sizeof(name)));
+    if (!data || !dir) {
+        return 0;
+    }
+    mkdir(ASSET_DIR, 0755);
+    zip = (file_size(ASSET_ZIP) == FILES * (each + 30 + 46 + 2 * NAME_LENGTH) + 22) ? NULL : fopen(ASSET_ZIP, "wb");
+    for (i = 0; i < FILES; ++i) {
+        FILE *f;
+        snprintf(name, sizeof(name), "asset%03ld.bin", i);
+        snprintf(path, sizeof(path), "%s/%s", ASSET_DIR, name);
+        for (j = 0; j < each; ++j) {
+            rng = rng * 1103515245u + 12345u;
+            data[j] = rng >> 24;
+        }
+        if (file_size(path) != each) {
+            f = fopen(path, "wb");
+            if (!f || fwrite(data, 1, each, f) != (size_t)each) {
+                fprintf(stderr, "Can't write %s\n", path);
+                return 0;
+            }
+            fclose(f);
+        }
+        if (!zip) {
+            continue;
+        }
+        crc = crc32(crc32(0L, Z_NULL, 0), data, each);
+        memset(dir + dirsize, 0, 46);
+        put_u32(dir + dirsize, 0x02014b50);
+        put_u16(dir + dirsize + 4, 20);
+        put_u16(dir + dirsize + 6, 20);
+        put_u32(dir + dirsize + 16, crc);
+        put_u32(dir + dirsize + 20, each);
+        put_u32(dir + dirsize + 24, each);
+        put_u16(dir + dirsize + 28, NAME_LENGTH);
+        put_u32(dir + dirsize + 42, offset);
+        memcpy(dir + dirsize + 46, name, NAME_LENGTH);
+        /* A local header is laid out like the rest of a central one
+         * after "version made by", so the same bytes do for both */
+        put_u32(dir + dirsize + 2, 0x04034b50);
+        fwrite(dir + dirsize + 2, 1, 30, zip);
+        fwrite(name, 1, NAME_LENGTH, zip);
+        fwrite(data, 1, each, zip);
+        put_u32(dir + dirsize, 0x02014b50);
+        put_u16(dir + dirsize + 4, 20);
+        offset += 30 + NAME_LENGTH + each;
+        dirsize += 46 + NAME_LENGTH;
+    }
+    if (zip) {
+        unsigned char end[22];
+        memset(end, 0, sizeof(end));
+        put_u32(end, 0x06054b50);
+        put_u16(end + 8, FILES);
+        put_u16(end + 10, FILES);
+        put_u32(end + 12, dirsize);
+        put_u32(end + 16, offset);
+        fwrite(dir, 1, dirsize, zip);
+        fwrite(end, 1, sizeof(end), zip);
+        fclose(zip);
+    }
+    free(data);
+    free(dir);
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *modes[] = { "fread", "directory", "zipfile", NULL };
+    double ms[3];
+    long megabytes = (argc > 1) ? atol(argv[1]) : 256, each, total = 0;
+    int m, i;
+    if (megabytes <= 0) {
+        fprintf(stderr, "Usage: %s [megabytes [mode]]\n", argv[0]);
+        return 1;
+    }
+    each = megabytes * 1024 * 1024 / FILES;
+    if (!make_assets(each)) {
+        return 1;
+    }
+    mncl_add_resource_directory(ASSET_DIR);
+    for (m = 0; modes[m]; ++m) {
+        double begin;
+        ms[m] = -1;
+        if (argc > 2 && strcmp(argv[2], modes[m])) {
+            continue;
+        }
+        if (m == 2) {
+            /* In front of the directory, so it is searched first */
+            if (!mncl_add_resource_zipfile(ASSET_ZIP)) {
+                fprintf(stderr, "Can't mount %s\n", ASSET_ZIP);
+                return 1;
+            }
+        }
+        begin = now();
+        for (i = 0; i < FILES; ++i) {
+            char name[64];
+            snprintf(name, sizeof(name), "asset%03d.bin", i);
+            if (m == 0) {
+                char path[128];
+                unsigned char *data = (unsigned char *)malloc(each);
+                FILE *f;
+                snprintf(path, sizeof(path), "%s/%s", ASSET_DIR, name);
+                f = fopen(path, "rb");
+                if (!f || !data || fread(data, 1, each, f) != (size_t)each) {
+                    fprintf(stderr, "Can't read %s\n", path);
+                    return 1;
+                }
+                fclose(f);
+                total += data[each - 1];
+                free(data);
+            } else {
+                MNCL_RAW *raw = mncl_acquire_raw(name);
+                if (!raw || raw->size != each) {
+                    fprintf(stderr, "Can't load %s\n", name);
+                    return 1;
+                }
+                total += raw->data[each - 1];
+                mncl_release_raw(raw);
+            }
+        }
+        ms[m] = (now() - begin) * 1000.0;
+    }
+    printf("\nmode\tfiles\tbytes\tms\tmb_per_s\n");
+    for (m = 0; modes[m]; ++m) {
+        if (ms[m] >= 0) {
+            printf("%s\t%d\t%ld\t%.1f\t%.1f\n", modes[m], FILES, each * FILES, ms[m], each * FILES / (1048576.0 * ms[m] / 1000.0));
+        }
+    }
+    mncl_uninit_raw_system();
+    mncl_uninit_atoms();
+    return total < 0;
+}
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+/* We #define MONOCULAR to nothing here because we're using bits of
+ * Monocle as a statically linked component. */
+#define MONOCULAR
+#include "monocle.h"
+#include "../src/monocle_internal.h"
+#include "../src/tree.h"
+#include "../src/atom.h"
+#include "../src/epoch.h"
+
+/* Runs the parts of Monocle that other threads may use at the same
+ * time as the main one, and checks that the readers never see
+ * anything freed or half-built. The first argument is the resource
+ * directory (demo/resources if there isn't one). Run it under a
+ * sanitizer to catch what the checks themselves can't.
+ *
+ * Only the SDL-free parts are linked in, so the graphics and sound
+ * allocators are stubbed out here; the resource maps used don't
+ * load any. */
+
+#define READERS 4
+#define RELOADS 50
+#define KEYS 64
+#define REPUBLISHES 2000
+#define NEW_ATOMS 20000
+#define PARSES 2000
+
+MNCL_SPRITESHEET *mncl_alloc_spritesheet(const char *resource_name) { return NULL; }
+void mncl_free_spritesheet(MNCL_SPRITESHEET *spritesheet) { }
+void mncl_normalize_spritesheet(MNCL_SPRITESHEET *spritesheet) { }
+int mncl_spritesheet_width(MNCL_SPRITESHEET *spritesheet) { return 0; }
+MNCL_SPRITE *mncl_alloc_sprite(int nframes) { return NULL; }
+void mncl_free_sprite(MNCL_SPRITE *sprite) { }
+void mncl_draw_sprite(MNCL_SPRITE *s, int x, int y, int frame) { }
+MNCL_SFX *mncl_alloc_sfx(const char *resource_name) { return NULL; }
+void mncl_free_sfx(MNCL_SFX *chunk) { }
+void mncl_play_music_file(const char *pathname, int fade_in_ms) { }
+
+static int stop;
+
+static void
+run_threads(void *(*fn)(void *), void *user, pthread_t *threads)
+{
+    int i;
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < READERS; ++i) {
+        if (pthread_create(&threads[i], NULL, fn, user)) {
+            printf("Could not start a thread\n");
+            exit(1);
+        }
+    }
+}
+
+/* Stops the threads started by run_threads, returning how many of
+ * them saw something wrong */
+static int
+join_threads(pthread_t *threads)
+{
+    int i, failed = 0;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < READERS; ++i) {
+        void *result;
+        pthread_join(threads[i], &result);
+        failed += (result != NULL);
+    }
+    return failed;
+}
+
+/* Looks the resources of threadtest.json up over and over while the
+ * main thread loads it again, replacing every one of them */
+static void *
+read_resources(void *user)
+{
+    long bad = 0;
+    (void)user;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        MNCL_DATA *counter, *values;
+        MNCL_RAW *shadow;
+        mncl_epoch_enter();
+        counter = mncl_data_resource("counter");
+        values = counter ? mncl_data_lookup(counter, "values") : NULL;
+        shadow = mncl_raw_resource("shadow");
+        if (!values || values->tag != MNCL_DATA_ARRAY || values->value.array.size != 3 ||
+            values->value.array.data[2]->value.number != 3 || !shadow || !shadow->size ||
+            shadow->data[0] != 'R') {
+            ++bad;
+        }
+        mncl_epoch_exit();
+    }
+    return (void *)bad;
+}
+
+static int
+test_reloading(void)
+{
+    pthread_t threads[READERS];
+    int i, failed;
+    mncl_load_resmap("threadtest.json");
+    run_threads(read_resources, NULL, threads);
+    for (i = 0; i < RELOADS; ++i) {
+        mncl_load_resmap("threadtest.json");
+    }
+    failed = join_threads(threads);
+    mncl_unload_all_resources();
+    return !failed;
+}
+
+/* Entries of the published map. Retired ones are marked dead before
+ * they are freed, so a reader that got hold of one too early can
+ * tell even without a sanitizer. */
+typedef struct {
+    int live, key;
+} ENTRY;
+
+static MNCL_KV_PUBLISHED published = MNCL_KV_PUBLISHED_INITIALIZER;
+static char key_names[KEYS][8];
+
+static void
+retire_entry(void *value)
+{
+    ((ENTRY *)value)->live = 0;
+    free(value);
+}
+
+static void
+free_entry(const char *key, void *value, void *user)
+{
+    (void)key;
+    (void)user;
+    retire_entry(value);
+}
+
+static void *
+read_published(void *user)
+{
+    unsigned int seed = (unsigned int)(size_t)&seed;
+    long bad = 0;
+    (void)user;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        int k;
+        ENTRY *e;
+        seed = seed * 1103515245u + 12345u;
+        k = (seed >> 16) % KEYS;
+        mncl_epoch_enter();
+        e = (ENTRY *)mncl_kv_find_published(&published, key_names[k]);
+        if (!e || !e->live || e->key != k) {
+            ++bad;
+        }
+        mncl_epoch_exit();
+    }
+    return (void *)bad;
+}
+
+/* Replaces one value at a time and republishes, retiring what was
+ * replaced, while readers look every key up */
+static int
+test_publishing(void)
+{
+    pthread_t threads[READERS];
+    MNCL_KV *kv = mncl_alloc_kv(NULL);
+    int i, started = 0, failed = 0, ok = (kv != NULL);
+    for (i = 0; ok && i < KEYS * 2 + REPUBLISHES; ++i) {
+        int k = i % KEYS;
+        ENTRY *e = (ENTRY *)malloc(sizeof(ENTRY)), *old;
+        if (!e) {
+            ok = 0;
+            break;
+        }
+        e->live = 1;
+        e->key = k;
+        if (i < KEYS) {
+            snprintf(key_names[k], sizeof(key_names[k]), "key%d", k);
+        }
+        old = (ENTRY *)mncl_kv_find(kv, key_names[k]);
+        ok = mncl_kv_insert(kv, key_names[k], e) && (i < KEYS - 1 || mncl_kv_publish(&published, kv));
+        if (old) {
+            mncl_epoch_retire(old, retire_entry);
+        }
+        if (ok && i == KEYS * 2) {
+            run_threads(read_published, NULL, threads);
+            started = 1;
+        }
+    }
+    if (started) {
+        failed = join_threads(threads);
+    }
+    mncl_kv_unpublish(&published);
+    mncl_kv_foreach(kv, free_entry, NULL);
+    mncl_free_kv(kv);
+    return ok && !failed;
+}
+
+/* Every thread interns a run of new atoms of its own, so the table
+ * grows (and old tables are retired) on all of them, while checking
+ * that atoms made earlier can still be found */
+static MNCL_ATOM *known_atoms[KEYS];
+static int next_thread;
+
+static void *
+intern_atoms(void *user)
+{
+    int id = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED), i;
+    long bad = 0;
+    char name[32];
+    (void)user;
+    for (i = 0; i < NEW_ATOMS; ++i) {
+        MNCL_ATOM *a;
+        snprintf(name, sizeof(name), "thread%d-%d", id, i);
+        a = mncl_atom(name);
+        if (!a || mncl_atom_find(name) != a || strcmp(mncl_atom_name(a), name) ||
+            mncl_atom_find(key_names[i % KEYS]) != known_atoms[i % KEYS]) {
+            ++bad;
+        }
+    }
+    return (void *)bad;
+}
+
+static int
+test_atoms(void)
+{
+    pthread_t threads[READERS];
+    int i;
+    for (i = 0; i < KEYS; ++i) {
+        known_atoms[i] = mncl_atom(key_names[i]);
+    }
+    next_thread = 0;
+    run_threads(intern_atoms, NULL, threads);
+    return !join_threads(threads);
+}
+
+/* Every thread parses a bad document of its own, with the error on a
+ * different line, and a good one in between. Each should only ever
+ * see its own error, both in the report and from mncl_data_error. */
+static void *
+parse_documents(void *user)
+{
+    int id = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED), i;
+    long bad = 0;
+    char text[64], message[32];
+    (void)user;
+    snprintf(text, sizeof(text), "%.*s{\"thread\": [1, 2,\n  tru]}", id, "\n\n\n\n\n\n\n\n");
+    snprintf(message, sizeof(message), "%d:3: Expected value", id + 1);
+    for (i = 0; i < PARSES; ++i) {
+        MNCL_DATA_ERROR error;
+        int flags = i % 2 ? MNCL_DATA_PARSE_ARENA : 0;
+        MNCL_DATA *d = mncl_parse_data_ex(text, strlen(text), flags, &error);
+        /* Give the others a chance to parse before checking */
+        sched_yield();
+        if (d || error.line != id + 1 || error.column != 3 || strcmp(error.message, message) ||
+            strcmp(mncl_data_error(), message)) {
+            ++bad;
+        }
+        mncl_free_data(d);
+        d = mncl_parse_data_ex("{\"thread\": [1, 2, true]}", 24, flags, &error);
+        if (!d || error.message[0] || mncl_data_error()[0]) {
+            ++bad;
+        }
+        mncl_free_data(d);
+    }
+    return (void *)bad;
+}
+
+static int
+test_parsing(void)
+{
+    pthread_t threads[READERS];
+    next_thread = 0;
+    run_threads(parse_documents, NULL, threads);
+    return !join_threads(threads);
+}
+
+int
+main(int argc, char **argv)
+{
+    int ok, all;
+    mncl_add_resource_directory(argc > 1 ? argv[1] : "demo/resources");
+    ok = test_reloading();
+    printf("Resource reloading: %s\n", ok ? "SUCCESS" : "FAILURE");
+    all = ok;
+    ok = test_publishing();
+    printf("Published maps: %s\n", ok ? "SUCCESS" : "FAILURE");
+    all = all && ok;
+    ok = test_atoms();
+    printf("Atoms: %s\n", ok ? "SUCCESS" : "FAILURE");
+    all = all && ok;
+    ok = test_parsing();
+    printf("Parse errors: %s\n", ok ? "SUCCESS" : "FAILURE");
+    all = all && ok;
+    mncl_uninit_raw_system();
+    mncl_uninit_epochs();
+    mncl_uninit_atoms();
+    return !all;
+}
@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+/* We #define MONOCULAR to nothing here because we're using bits of
+ * Monocle as a statically linked component. */
+#define MONOCULAR
+#include "../src/tree.h"
+#include "../src/btree.h"
+
+/* Microbenchmarks for tree.c, btree.c and MNCL_KV. Each line of
+ * output is one operation on one structure, as tab-separated fields:
+ *
+ *    bench  keys  n  ops  ns_per_op  allocs_per_op  peak_rss_kb
+ *
+ * "keys" is the key distribution: seqptr is nodes compared by
+ * address and inserted in address order (as objcmp sees objects
+ * coming out of their pool), randptr is the same nodes inserted in
+ * random order, and names and seqnames are random resource-like and
+ * sequential object-like strings. Small trees are rebuilt enough
+ * times that every line covers at least MIN_OPS operations.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at
+ * link time (see the Makefile). Peak RSS is the process high-water
+ * mark so far, so to see the peak for a single case, name it (or
+ * any substring of "bench/keys/n") on the command line to run only
+ * matching cases. */
+
+#define MIN_OPS 1000000
+
+static long allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    ++allocs;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+    ++allocs;
+    return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *p, size_t size)
+{
+    ++allocs;
+    return __real_realloc(p, size);
+}
+
+static long
+peak_rss_kb(void)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#endif
+}
+
+static unsigned int rng_state = 12345;
+
+static unsigned int
+rng(void)
+{
+    rng_state = rng_state * 1103515245u + 12345u;
+    return (rng_state >> 8) & 0xffffff;
+}
+
+static void
+shuffle(void **items, int n)
+{
+    int i;
+    for (i = n - 1; i > 0; --i) {
+        int j = rng() % (i + 1);
+        void *tmp = items[i];
+        items[i] = items[j];
+        items[j] = tmp;
+    }
+}
+
+/* A running measurement */
+static const char *filter = NULL;
+static clock_t timer_start;
+static long timer_allocs;
+
+static int
+wanted(const char *bench, const char *keys, int n)
+{
+    char name[128];
+    if (!filter) {
+        return 1;
+    }
+    snprintf(name, sizeof(name), "%s/%s/%d", bench, keys, n);
+    return strstr(name, filter) != NULL;
+}
+
+static void
+start(void)
+{
+    timer_allocs = allocs;
+    timer_start = clock();
+}
+
+/* Leaves setup work between runs out of the measurement */
+static clock_t pause_start;
+static long pause_allocs;
+
+static void
+pause_timer(void)
+{
+    pause_allocs = allocs;
+    pause_start = clock();
+}
+
+static void
+resume_timer(void)
+{
+    timer_start += clock() - pause_start;
+    timer_allocs += allocs - pause_allocs;
+}
+
+static void
+report(const char *bench, const char *keys, int n, long ops)
+{
+    clock_t end = clock();
+    long used = allocs - timer_allocs;
+    double ns = ((double)(end - timer_start) / CLOCKS_PER_SEC) * 1e9 / ops;
+    printf("%s\t%s\t%d\t%ld\t%.1f\t%.3f\t%ld\n", bench, keys, n, ops, ns, (double)used / ops, peak_rss_kb());
+    fflush(stdout);
+}
+
+/* Red-black trees and B-trees of address-ordered nodes */
+
+static int
+ptrcmp(TREE_NODE *a, TREE_NODE *b)
+{
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+}
+
+static int
+btree_ptrcmp(const void *a, const void *b)
+{
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+}
+
+static void
+bench_ptr_trees(int n, int random_order)
+{
+    const char *keys = random_order ? "randptr" : "seqptr";
+    TREE_NODE *nodes = (TREE_NODE *)malloc(sizeof(TREE_NODE) * n);
+    void **order = (void **)malloc(sizeof(void *) * n);
+    void **probes = (void **)malloc(sizeof(void *) * n);
+    int reps = (MIN_OPS + n - 1) / n, r, i;
+    long ops = (long)reps * n, sum = 0;
+    TREE t = { NULL, 0 };
+    BTREE bt;
+    for (i = 0; i < n; ++i) {
+        order[i] = probes[i] = &nodes[i];
+    }
+    if (random_order) {
+        shuffle(order, n);
+    }
+    shuffle(probes, n);
+
+    if (wanted("tree_insert", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            t.root = NULL;
+            for (i = 0; i < n; ++i) {
+                tree_insert(&t, (TREE_NODE *)order[i], ptrcmp);
+            }
+        }
+        report("tree_insert", keys, n, ops);
+    }
+    t.root = NULL;
+    for (i = 0; i < n; ++i) {
+        tree_insert(&t, (TREE_NODE *)order[i], ptrcmp);
+    }
+    if (wanted("tree_find", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            for (i = 0; i < n; ++i) {
+                sum += tree_find(&t, (TREE_NODE *)probes[i], ptrcmp) != NULL;
+            }
+        }
+        report("tree_find", keys, n, ops);
+    }
+    if (wanted("tree_next", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            TREE_NODE *node;
+            for (node = tree_minimum(&t); node; node = tree_next(node)) {
+                ++sum;
+            }
+        }
+        report("tree_next", keys, n, ops);
+    }
+    if (wanted("tree_delete", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            pause_timer();
+            if (r) {
+                for (i = 0; i < n; ++i) {
+                    tree_insert(&t, (TREE_NODE *)order[i], ptrcmp);
+                }
+            }
+            resume_timer();
+            for (i = 0; i < n; ++i) {
+                tree_delete(&t, (TREE_NODE *)probes[i]);
+            }
+        }
+        report("tree_delete", keys, n, ops);
+    }
+
+    btree_init(&bt);
+    if (wanted("btree_insert", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            for (i = 0; i < n; ++i) {
+                btree_insert(&bt, order[i], btree_ptrcmp);
+            }
+            if (r + 1 < reps) {
+                pause_timer();
+                btree_clear(&bt);
+                resume_timer();
+            }
+        }
+        report("btree_insert", keys, n, ops);
+    }
+    btree_clear(&bt);
+    for (i = 0; i < n; ++i) {
+        btree_insert(&bt, order[i], btree_ptrcmp);
+    }
+    if (wanted("btree_find", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            for (i = 0; i < n; ++i) {
+                sum += btree_find(&bt, probes[i], btree_ptrcmp) != NULL;
+            }
+        }
+        report("btree_find", keys, n, ops);
+    }
+    if (wanted("btree_next", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            BTREE_CURSOR c;
+            void *item;
+            for (item = btree_minimum(&bt, &c); item; item = btree_next(&c)) {
+                ++sum;
+            }
+        }
+        report("btree_next", keys, n, ops);
+    }
+    if (wanted("btree_delete", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            pause_timer();
+            if (r) {
+                for (i = 0; i < n; ++i) {
+                    btree_insert(&bt, order[i], btree_ptrcmp);
+                }
+            }
+            resume_timer();
+            for (i = 0; i < n; ++i) {
+                btree_delete(&bt, probes[i], btree_ptrcmp);
+            }
+        }
+        report("btree_delete", keys, n, ops);
+    }
+    btree_clear(&bt);
+
+    if (sum < 0) {
+        printf("impossible\n");
+    }
+    free(nodes);
+    free(order);
+    free(probes);
+}
+
+/* Key-value maps, and red-black trees of the same strings */
+
+static char **
+make_names(int n, int sequential)
+{
+    char **names = (char **)malloc(sizeof(char *) * n);
+    int i;
+    for (i = 0; i < n; ++i) {
+        names[i] = (char *)malloc(32);
+        if (sequential) {
+            snprintf(names[i], 32, "object-%07d", i);
+        } else {
+            snprintf(names[i], 32, "resource-%06x-%d", rng(), i);
+        }
+        /* Interning is a one-time cost, so leave it out of the runs */
+        mncl_atom(names[i]);
+    }
+    return names;
+}
+
+static void
+bench_kv(int n, int sequential)
+{
+    const char *keys = sequential ? "seqnames" : "names";
+    char **names = make_names(n, sequential);
+    char **probes = (char **)malloc(sizeof(char *) * n);
+    KEY_SEARCH_NODE *nodes = (KEY_SEARCH_NODE *)malloc(sizeof(KEY_SEARCH_NODE) * n);
+    int reps = (MIN_OPS + n - 1) / n, r, i;
+    long ops = (long)reps * n, sum = 0;
+    MNCL_KV *kv = NULL;
+    TREE t = { NULL, 0 };
+    memcpy(probes, names, sizeof(char *) * n);
+    shuffle((void **)probes, n);
+    for (i = 0; i < n; ++i) {
+        nodes[i].key = names[i];
+    }
+
+    if (wanted("strtree_insert", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            t.root = NULL;
+            for (i = 0; i < n; ++i) {
+                tree_insert(&t, (TREE_NODE *)&nodes[i], key_value_node_cmp);
+            }
+        }
+        report("strtree_insert", keys, n, ops);
+    }
+    t.root = NULL;
+    for (i = 0; i < n; ++i) {
+        tree_insert(&t, (TREE_NODE *)&nodes[i], key_value_node_cmp);
+    }
+    if (wanted("strtree_find", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            for (i = 0; i < n; ++i) {
+                KEY_SEARCH_NODE seek;
+                seek.key = probes[i];
+                sum += tree_find(&t, (TREE_NODE *)&seek, key_value_node_cmp) != NULL;
+            }
+        }
+        report("strtree_find", keys, n, ops);
+    }
+
+    if (wanted("kv_insert", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            pause_timer();
+            mncl_free_kv(kv);
+            kv = mncl_alloc_kv(NULL);
+            resume_timer();
+            for (i = 0; i < n; ++i) {
+                mncl_kv_insert(kv, names[i], names[i]);
+            }
+        }
+        report("kv_insert", keys, n, ops);
+    }
+    mncl_free_kv(kv);
+    kv = mncl_alloc_kv(NULL);
+    for (i = 0; i < n; ++i) {
+        mncl_kv_insert(kv, names[i], names[i]);
+    }
+    if (wanted("kv_find", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            for (i = 0; i < n; ++i) {
+                sum += mncl_kv_find(kv, probes[i]) != NULL;
+            }
+        }
+        report("kv_find", keys, n, ops);
+    }
+    if (wanted("kv_foreach", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            TREE_NODE *node;
+            /* What mncl_kv_foreach does, minus the callback */
+            for (node = tree_minimum(&kv->tree); node; node = tree_next(node)) {
+                sum += ((KEY_VALUE_NODE *)node)->value != NULL;
+            }
+        }
+        report("kv_foreach", keys, n, ops);
+    }
+    if (wanted("kv_delete", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            pause_timer();
+            if (r) {
+                for (i = 0; i < n; ++i) {
+                    mncl_kv_insert(kv, names[i], names[i]);
+                }
+            }
+            resume_timer();
+            for (i = 0; i < n; ++i) {
+                mncl_kv_delete(kv, probes[i]);
+            }
+        }
+        report("kv_delete", keys, n, ops);
+    }
+    for (i = 0; i < n; ++i) {
+        mncl_kv_insert(kv, names[i], names[i]);
+    }
+    mncl_kv_freeze(kv);
+    if (wanted("kv_frozen_find", keys, n)) {
+        start();
+        for (r = 0; r < reps; ++r) {
+            for (i = 0; i < n; ++i) {
+                sum += mncl_kv_find(kv, probes[i]) != NULL;
+            }
+        }
+        report("kv_frozen_find", keys, n, ops);
+    }
+
+    if (sum < 0) {
+        printf("impossible\n");
+    }
+    mncl_free_kv(kv);
+    for (i = 0; i < n; ++i) {
+        free(names[i]);
+    }
+    free(names);
+    free(probes);
+    free(nodes);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int sizes[] = { 10, 1000, 10000, 100000, 0 };
+    int i;
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    printf("bench\tkeys\tn\tops\tns_per_op\tallocs_per_op\tpeak_rss_kb\n");
+    for (i = 0; sizes[i]; ++i) {
+        bench_ptr_trees(sizes[i], 0);
+        bench_ptr_trees(sizes[i], 1);
+        bench_kv(sizes[i], 0);
+        bench_kv(sizes[i], 1);
+    }
+    return 0;
+}
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <string.h>
+/* We #define MONOCULAR to nothing here because we're using bits of
+ * Monocle as a statically linked component. */
+#define MONOCULAR
+#include "../src/tree.h"
+#include "../src/btree.h"
+
+/* Exercises the red-black and order-statistic invariants of tree.c
+ * with bulk construction and a long run of random inserts and
+ * deletes, puts btree.c through the same paces, and then checks bulk
+ * merging, freezing and publishing of key-value maps. */
+
+#define NUM_NODES 2000
+#define NUM_OPS 200000
+
+typedef struct {
+    TREE_NODE header;
+    int key;
+    int in_tree;
+} INT_NODE;
+
+static int errors = 0;
+
+static int
+intcmp(TREE_NODE *a, TREE_NODE *b)
+{
+    return ((INT_NODE *)a)->key - ((INT_NODE *)b)->key;
+}
+
+static unsigned int rng_state = 1;
+
+static unsigned int
+rng(void)
+{
+    rng_state = rng_state * 1103515245u + 12345u;
+    return (rng_state >> 8) & 0xffffff;
+}
+
+/* Returns the black height of n, checking colors, parent links and
+ * subtree sizes along the way. */
+static int
+check_node(TREE_NODE *n, TREE_NODE *parent, unsigned int *size)
+{
+    unsigned int left_size = 0, right_size = 0;
+    int left_height, right_height;
+    if (!n) {
+        *size = 0;
+        return 1;
+    }
+    if (n->parent != parent) {
+        ++errors;
+    }
+    if (n->color == 0 && ((n->left && n->left->color == 0) || (n->right && n->right->color == 0))) {
+        ++errors;
+    }
+    left_height = check_node(n->left, n, &left_size);
+    right_height = check_node(n->right, n, &right_size);
+    if (left_height != right_height) {
+        ++errors;
+    }
+    *size = left_size + right_size + 1;
+    if (n->size != *size) {
+        ++errors;
+    }
+    return left_height + (n->color ? 1 : 0);
+}
+
+static void
+check_tree(TREE *t, int expected_size)
+{
+    unsigned int size, k;
+    TREE_NODE *n;
+    check_node(t->root, NULL, &size);
+    if (size != expected_size || tree_size(t) != expected_size) {
+        ++errors;
+    }
+    for (n = tree_minimum(t), k = 0; n; n = tree_next(n), ++k) {
+        if (tree_select(t, k) != n || tree_rank(t, n) != k) {
+            ++errors;
+        }
+    }
+    if (tree_select(t, k)) {
+        ++errors;
+    }
+}
+
+static int
+btree_intcmp(const void *a, const void *b)
+{
+    return ((const INT_NODE *)a)->key - ((const INT_NODE *)b)->key;
+}
+
+/* Checks item counts, parent links and sizes, and that every leaf is
+ * at the same depth. Returns that depth. */
+static int
+check_btree_node(BTREE_NODE *n, BTREE_NODE *parent)
+{
+    int i, depth = 0;
+    unsigned int size = n->count;
+    if (n->parent != parent || n->count > BTREE_MAX_ITEMS ||
+            (parent && n->count < BTREE_MIN_DEGREE - 1) || n->count == 0) {
+        ++errors;
+    }
+    if (!n->leaf) {
+        for (i = 0; i <= n->count; ++i) {
+            int child_depth = check_btree_node(n->children[i], n);
+            if (i > 0 && child_depth != depth) {
+                ++errors;
+            }
+            depth = child_depth;
+            size += n->children[i]->size;
+        }
+    }
+    if (n->size != size) {
+        ++errors;
+    }
+    return depth + 1;
+}
+
+static void
+check_btree(BTREE *t, INT_NODE *nodes, int expected_size)
+{
+    BTREE_CURSOR c;
+    INT_NODE *item, *prev = NULL;
+    unsigned int k = 0;
+    if (t->root) {
+        check_btree_node(t->root, NULL);
+    }
+    if (btree_size(t) != expected_size) {
+        ++errors;
+    }
+    for (item = btree_minimum(t, &c); item; item = btree_next(&c), ++k) {
+        if (!item->in_tree || (prev && prev->key >= item->key) || btree_select(t, k, NULL) != item) {
+            ++errors;
+        }
+        prev = item;
+    }
+    if (k != expected_size) {
+        ++errors;
+    }
+    for (item = btree_maximum(t, &c); item; item = btree_prev(&c)) {
+        --k;
+        if (btree_select(t, k, NULL) != item) {
+            ++errors;
+        }
+    }
+    if (k != 0) {
+        ++errors;
+    }
+}
+
+static void
+check_btree_ops(INT_NODE *nodes)
+{
+    BTREE t;
+    int i, count = 0;
+    btree_init(&t);
+    for (i = 0; i < NUM_NODES; ++i) {
+        nodes[i].in_tree = 0;
+    }
+    for (i = 0; i < NUM_OPS; ++i) {
+        INT_NODE *n = &nodes[rng() % NUM_NODES];
+        if (n->in_tree) {
+            if (!btree_delete(&t, n, btree_intcmp)) {
+                ++errors;
+            }
+            --count;
+        } else {
+            if (btree_find(&t, n, btree_intcmp) || !btree_insert(&t, n, btree_intcmp)) {
+                ++errors;
+            }
+            ++count;
+        }
+        n->in_tree = !n->in_tree;
+        if (i % 10000 == 0) {
+            check_btree(&t, nodes, count);
+        }
+    }
+    check_btree(&t, nodes, count);
+    /* Drain it completely */
+    for (i = 0; i < NUM_NODES; ++i) {
+        if (nodes[i].in_tree) {
+            btree_delete(&t, &nodes[i], btree_intcmp);
+            nodes[i].in_tree = 0;
+        }
+    }
+    if (t.root) {
+        ++errors;
+    }
+    btree_clear(&t);
+}
+
+static void
+check_kv_entry(const char *key, void *value, void *user)
+{
+    const char ***expected = (const char ***)user;
+    if (strcmp(key, (*expected)[0]) || strcmp((const char *)value, (*expected)[1])) {
+        ++errors;
+    }
+    *expected += 2;
+}
+
+static void
+check_kv_merge(void)
+{
+    const char *keys_a[] = { "apple", "cherry", "grape", "kiwi" };
+    void *values_a[] = { "a1", "c1", "g1", "k1" };
+    const char *keys_b[] = { "banana", "grape", "zucchini", "cherry" };
+    void *values_b[] = { "b2", "g2", "z2", "c2" };
+    const char *expected[] = { "apple", "a1", "banana", "b2", "cherry", "c2",
+                               "grape", "g2", "kiwi", "k1", "zucchini", "z2" };
+    const char **cursor = expected;
+    MNCL_KV_PUBLISHED pub = MNCL_KV_PUBLISHED_INITIALIZER;
+    MNCL_KV *a = mncl_kv_from_sorted(NULL, keys_a, values_a, 4);
+    MNCL_KV *b = mncl_kv_from_sorted(NULL, keys_b, values_b, 4);
+    if (!a || !b || !mncl_kv_merge(a, b)) {
+        ++errors;
+        return;
+    }
+    if (mncl_kv_count(a) != 6 || mncl_kv_count(b) != 0 || mncl_kv_find(b, "banana")) {
+        ++errors;
+    }
+    mncl_kv_foreach(a, check_kv_entry, &cursor);
+    if (cursor != expected + 12 || strcmp((const char *)mncl_kv_find(a, "cherry"), "c2")) {
+        ++errors;
+    }
+    check_tree(&a->tree, 6);
+    /* Frozen maps should look the same from outside, and thaw back
+     * into a valid tree when changed */
+    cursor = expected;
+    if (!mncl_kv_freeze(a) || strcmp((const char *)mncl_kv_find(a, "kiwi"), "k1") || mncl_kv_find(a, "lemon")) {
+        ++errors;
+    }
+    mncl_kv_foreach(a, check_kv_entry, &cursor);
+    if (cursor != expected + 12) {
+        ++errors;
+    }
+    mncl_kv_delete(a, "lemon");
+    mncl_kv_insert(a, "lemon", "l3");
+    if (mncl_kv_count(a) != 7 || strcmp((const char *)mncl_kv_find(a, "lemon"), "l3")) {
+        ++errors;
+    }
+    check_tree(&a->tree, 7);
+    /* Published snapshots should reflect the map as of publication */
+    if (!mncl_kv_publish(&pub, a)) {
+        ++errors;
+    }
+    mncl_kv_delete(a, "kiwi");
+    if (!mncl_kv_find_published(&pub, "kiwi") || mncl_kv_find_published(&pub, "mango")) {
+        ++errors;
+    }
+    mncl_kv_publish(&pub, a);
+    if (mncl_kv_find_published(&pub, "kiwi") || strcmp((const char *)mncl_kv_find_published(&pub, "lemon"), "l3")) {
+        ++errors;
+    }
+    mncl_kv_unpublish(&pub);
+    if (mncl_kv_find_published(&pub, "lemon")) {
+        ++errors;
+    }
+    mncl_free_kv(a);
+    mncl_free_kv(b);
+}
+
+int
+main(int argc, char **argv)
+{
+    static INT_NODE nodes[NUM_NODES];
+    static TREE_NODE *sorted[NUM_NODES];
+    TREE t = { NULL, TREE_ORDER_STATISTICS };
+    int i, count = 0;
+    for (i = 0; i < NUM_NODES; ++i) {
+        nodes[i].key = i;
+        nodes[i].in_tree = 0;
+        sorted[i] = (TREE_NODE *)&nodes[i];
+    }
+    for (i = 0; i <= 300; ++i) {
+        tree_build_sorted(&t, sorted, i);
+        check_tree(&t, i);
+    }
+    /* Start the random run from a bulk-built tree of every other node */
+    for (i = 0; i < NUM_NODES / 2; ++i) {
+        sorted[i] = (TREE_NODE *)&nodes[i * 2];
+        nodes[i * 2].in_tree = 1;
+    }
+    count = NUM_NODES / 2;
+    tree_build_sorted(&t, sorted, count);
+    check_tree(&t, count);
+    for (i = 0; i < NUM_OPS; ++i) {
+        INT_NODE *n = &nodes[rng() % NUM_NODES];
+        if (n->in_tree) {
+            tree_delete(&t, (TREE_NODE *)n);
+            --count;
+        } else {
+            tree_insert(&t, (TREE_NODE *)n, intcmp);
+            ++count;
+        }
+        n->in_tree = !n->in_tree;
+        if (i % 10000 == 0) {
+            check_tree(&t, count);
+        }
+    }
+    check_tree(&t, count);
+    check_btree_ops(nodes);
+    check_kv_merge();
+    printf("Order-statistic trees: %s\n", errors ? "FAILURE" : "SUCCESS");
+    return errors ? 1 : 0;
+}
@@ -1,6 +1,7 @@
 #ifndef MONOCLE_H_
 #define MONOCLE_H_
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -68,6 +69,14 @@ extern MONOCULAR float mncl_raw_f32be(MNCL_RAW *raw, int offset);
 extern MONOCULAR double mncl_raw_f64le(MNCL_RAW *raw, int offset);
 extern MONOCULAR double mncl_raw_f64be(MNCL_RAW *raw, int offset);
 
+/* Atoms (interned strings) */
+
+struct struct_MNCL_ATOM;
+typedef struct struct_MNCL_ATOM MNCL_ATOM;
+
+extern MONOCULAR MNCL_ATOM *mncl_atom(const char *name);
+extern MONOCULAR const char *mncl_atom_name(MNCL_ATOM *atom);
+
 /* Key-value map component */
 
 struct struct_MNCL_KV;
@@ -82,7 +91,16 @@ extern MONOCULAR int mncl_kv_insert(MNCL_KV *kv, const char *key, void *value);
 extern MONOCULAR void *mncl_kv_find(MNCL_KV *kv, const char *key);
 extern MONOCULAR void mncl_kv_delete(MNCL_KV *kv, const char *key);
 
+extern MONOCULAR int mncl_kv_insert_atom(MNCL_KV *kv, MNCL_ATOM *key, void *value);
+extern MONOCULAR void *mncl_kv_find_atom(MNCL_KV *kv, MNCL_ATOM *key);
+
+extern MONOCULAR MNCL_KV *mncl_kv_from_sorted(MNCL_KV_DELETER deleter, const char **keys, void **values, unsigned int n);
+extern MONOCULAR int mncl_kv_merge(MNCL_KV *dest, MNCL_KV *src);
+extern MONOCULAR int mncl_kv_freeze(MNCL_KV *kv);
+
 extern MONOCULAR void mncl_kv_foreach(MNCL_KV *kv, MNCL_KV_VALUE_FN fn, void *user);
+extern MONOCULAR unsigned int mncl_kv_count(MNCL_KV *kv);
+extern MONOCULAR void mncl_kv_foreach_range(MNCL_KV *kv, unsigned int first, unsigned int count, MNCL_KV_VALUE_FN fn, void *user);
 
 /* Semi-structured data component */
 
@@ -104,17 +122,74 @@ typedef struct mncl_data_value_ {
         struct { int size; struct mncl_data_value_ **data; } array;
         MNCL_KV *object;
     } value;
+    int flags; /* Private to Monocle; leave zero */
 } MNCL_DATA;
 
 extern MONOCULAR MNCL_DATA *mncl_data_resource(const char *resource);
 
 extern MONOCULAR MNCL_DATA *mncl_parse_data(const char *data, size_t size);
 extern MONOCULAR MNCL_DATA *mncl_data_clone (MNCL_DATA *src);
+extern MONOCULAR MNCL_DATA *mncl_parse_data_arena(const char *data, size_t size);
+
+typedef struct {
+    int line, column;
+    char message[512];
+} MNCL_DATA_ERROR;
+
+#define MNCL_DATA_PARSE_ARENA 1
+
+extern MONOCULAR MNCL_DATA *mncl_parse_data_ex(const char *data, size_t size, int flags, MNCL_DATA_ERROR *error);
+extern MONOCULAR MNCL_DATA *mncl_data_clone_arena (MNCL_DATA *src);
 extern MONOCULAR void mncl_free_data (MNCL_DATA *mncl_data);
 
+typedef struct {
+    int (*begin_object)(void *user);
+    int (*key)(void *user, const char *key, size_t size);
+    int (*end_object)(void *user);
+    int (*begin_array)(void *user);
+    int (*end_array)(void *user);
+    int (*null_value)(void *user);
+    int (*boolean)(void *user, int value);
+    int (*number)(void *user, double value);
+    int (*string)(void *user, const char *s, size_t size);
+} MNCL_DATA_EVENTS;
+
+extern MONOCULAR int mncl_parse_data_events(const char *data, size_t size, const MNCL_DATA_EVENTS *events, void *user);
+
+typedef struct mncl_data_parser MNCL_DATA_PARSER;
+
+extern MONOCULAR MNCL_DATA_PARSER *mncl_data_parser_new(void);
+extern MONOCULAR MNCL_DATA_PARSER *mncl_data_parser_new_arena(size_t size);
+extern MONOCULAR int mncl_data_parser_feed(MNCL_DATA_PARSER *parser, const char *data, size_t size);
+extern MONOCULAR MNCL_DATA *mncl_data_parser_finish(MNCL_DATA_PARSER *parser);
+
+extern MONOCULAR void *mncl_data_save_binary(MNCL_DATA *data, size_t *size);
+extern MONOCULAR MNCL_DATA *mncl_data_load_binary(const void *image, size_t size);
+
+typedef struct {
+    char *data;
+    size_t size, capacity;
+} MNCL_DATA_BUFFER;
+
+#define MNCL_DATA_WRITE_PRETTY 1
+#define MNCL_DATA_WRITE_BINARY 2
+
+extern MONOCULAR int mncl_write_data(MNCL_DATA *data, MNCL_DATA_BUFFER *buffer, int flags);
+extern MONOCULAR int mncl_write_data_file(MNCL_DATA *data, FILE *f, int flags);
+
 extern MONOCULAR const char *mncl_data_error();
 extern MONOCULAR MNCL_DATA *mncl_data_lookup(MNCL_DATA *map, const char *key);
 
+typedef struct mncl_data_path MNCL_DATA_PATH;
+
+extern MONOCULAR MNCL_DATA_PATH *mncl_data_path_new(const char *path);
+extern MONOCULAR MNCL_DATA *mncl_data_path_lookup(MNCL_DATA *data, MNCL_DATA_PATH *path);
+extern MONOCULAR void mncl_free_data_path(MNCL_DATA_PATH *path);
+
+extern MONOCULAR MNCL_DATA *mncl_data_share(MNCL_DATA *doc);
+extern MONOCULAR MNCL_DATA *mncl_data_share_part(MNCL_DATA *doc, MNCL_DATA *part);
+extern MONOCULAR MNCL_DATA *mncl_data_writable(MNCL_DATA *doc, const char *path);
+
 /* Framebuffer component */
 
 extern MONOCULAR int mncl_config_video (const char *title, int width, int height, int fullscreen, int flags);
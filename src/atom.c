@@ -0,0 +1,252 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "atom.h"
+#include "epoch.h"
+
+/**********************************************************************
+ * atom.c - interned strings implementation
+ *
+ * The atom table is an open-addressed hash table of atom pointers,
+ * kept at most half full. The atoms themselves are carved out of
+ * large blocks, since they are never freed individually; long strings
+ * get a block of their own.
+ *
+ * Atoms are looked up on every map lookup, from any number of threads,
+ * so finding one takes no lock. The table is published through an
+ * atomic pointer, and its slots are only ever filled in, never
+ * changed, so a reader sees either an empty slot or a whole atom.
+ * Interning a new atom takes a spin lock, which is only ever held
+ * for one probe of the table (and, rarely, a resize). A resize builds
+ * a whole new table, publishes it, and retires the old one through
+ * epoch.h, so interning must not happen inside a reader section.
+ **********************************************************************/
+
+#define ATOM_BLOCK_SIZE 8192
+
+typedef struct atom_block {
+    struct atom_block *next;
+    size_t used;
+    char data[ATOM_BLOCK_SIZE];
+} ATOM_BLOCK;
+
+typedef struct {
+    unsigned int size;
+    MNCL_ATOM *slots[0];
+} ATOM_TABLE;
+
+static ATOM_TABLE *atom_table = NULL;
+static unsigned int atom_count = 0;
+static ATOM_BLOCK *atom_blocks = NULL;
+static ATOM_BLOCK *atom_big_blocks = NULL;
+static char atom_locked = 0;
+
+static void
+atom_lock(void)
+{
+    while (__atomic_test_and_set(&atom_locked, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&atom_locked, __ATOMIC_RELAXED)) {
+            /* Wait for it to look free before trying again */
+            MNCL_SPIN_PAUSE();
+        }
+    }
+}
+
+static void
+atom_unlock(void)
+{
+    __atomic_clear(&atom_locked, __ATOMIC_RELEASE);
+}
+
+/* 32-bit FNV-1a. This also measures the key as it goes, since every
+ * caller needs the length for the final comparison anyway. */
+unsigned int
+atom_hash(const char *key, size_t *len)
+{
+    const unsigned char *s = (const unsigned char *)key;
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h = (h ^ *s++) * 16777619u;
+    }
+    if (len) {
+        *len = (const char *)s - key;
+    }
+    return h;
+}
+
+static unsigned int
+atom_hash_n(const char *key, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)key;
+    unsigned int h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        h = (h ^ s[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Slots are loaded with acquire ordering to pair with the release
+ * store that fills them in, so that an atom is never seen before its
+ * name is */
+static MNCL_ATOM **
+atom_slot(ATOM_TABLE *table, const char *name, size_t len, unsigned int hash)
+{
+    unsigned int mask = table->size - 1;
+    unsigned int i = hash & mask;
+    MNCL_ATOM *a;
+    while ((a = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE)) != NULL) {
+        if (a->hash == hash && a->len == len && !memcmp(a->name, name, len)) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+/* Looks the name up without taking the lock */
+static MNCL_ATOM *
+atom_lookup(const char *name, size_t len, unsigned int hash)
+{
+    ATOM_TABLE *table;
+    MNCL_ATOM *result = NULL;
+    mncl_epoch_enter();
+    table = __atomic_load_n(&atom_table, __ATOMIC_ACQUIRE);
+    if (table) {
+        result = __atomic_load_n(atom_slot(table, name, len, hash), __ATOMIC_ACQUIRE);
+    }
+    mncl_epoch_exit();
+    return result;
+}
+
+static int
+atom_table_grow(void)
+{
+    ATOM_TABLE *old_table = atom_table, *new_table;
+    unsigned int i, old_size = old_table ? old_table->size : 0;
+    unsigned int new_size = old_size ? old_size * 2 : 256;
+    new_table = (ATOM_TABLE *)calloc(1, sizeof(ATOM_TABLE) + new_size * sizeof(MNCL_ATOM *));
+    if (!new_table) {
+        return 0;
+    }
+    new_table->size = new_size;
+    for (i = 0; i < old_size; ++i) {
+        MNCL_ATOM *a = old_table->slots[i];
+        if (a) {
+            *atom_slot(new_table, a->name, a->len, a->hash) = a;
+        }
+    }
+    __atomic_store_n(&atom_table, new_table, __ATOMIC_RELEASE);
+    if (old_table) {
+        mncl_epoch_retire(old_table, free);
+    }
+    return 1;
+}
+
+static MNCL_ATOM *
+atom_alloc(size_t len)
+{
+    /* Round up so every atom stays pointer-aligned */
+    size_t size = (offsetof(MNCL_ATOM, name) + len + 1 + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    ATOM_BLOCK *block;
+    if (size > ATOM_BLOCK_SIZE / 4) {
+        block = (ATOM_BLOCK *)malloc(offsetof(ATOM_BLOCK, data) + size);
+        if (!block) {
+            return NULL;
+        }
+        block->next = atom_big_blocks;
+        block->used = size;
+        atom_big_blocks = block;
+        return (MNCL_ATOM *)block->data;
+    }
+    block = atom_blocks;
+    if (!block || block->used + size > ATOM_BLOCK_SIZE) {
+        block = (ATOM_BLOCK *)malloc(sizeof(ATOM_BLOCK));
+        if (!block) {
+            return NULL;
+        }
+        block->next = atom_blocks;
+        block->used = 0;
+        atom_blocks = block;
+    }
+    block->used += size;
+    return (MNCL_ATOM *)(block->data + block->used - size);
+}
+
+MNCL_ATOM *
+mncl_atom_n(const char *name, size_t len)
+{
+    unsigned int hash = atom_hash_n(name, len);
+    MNCL_ATOM **slot, *result = atom_lookup(name, len, hash);
+    if (result) {
+        return result;
+    }
+    atom_lock();
+    if ((!atom_table || (atom_count + 1) * 2 > atom_table->size) && !atom_table_grow()) {
+        atom_unlock();
+        return NULL;
+    }
+    /* Someone else may have interned it since the lookup */
+    slot = atom_slot(atom_table, name, len, hash);
+    result = *slot;
+    if (!result) {
+        result = atom_alloc(len);
+        if (result) {
+            result->hash = hash;
+            result->len = len;
+            memcpy(result->name, name, len);
+            result->name[len] = '\0';
+            __atomic_store_n(slot, result, __ATOMIC_RELEASE);
+            ++atom_count;
+        }
+    }
+    atom_unlock();
+    return result;
+}
+
+MNCL_ATOM *
+mncl_atom(const char *name)
+{
+    if (!name) {
+        return NULL;
+    }
+    return mncl_atom_n(name, strlen(name));
+}
+
+MNCL_ATOM *
+mncl_atom_find(const char *name)
+{
+    size_t len;
+    unsigned int hash;
+    if (!name) {
+        return NULL;
+    }
+    hash = atom_hash(name, &len);
+    return atom_lookup(name, len, hash);
+}
+
+const char *
+mncl_atom_name(MNCL_ATOM *atom)
+{
+    return atom ? atom->name : NULL;
+}
+
+void
+mncl_uninit_atoms(void)
+{
+    ATOM_BLOCK *lists[2];
+    int i;
+    lists[0] = atom_blocks;
+    lists[1] = atom_big_blocks;
+    for (i = 0; i < 2; ++i) {
+        while (lists[i]) {
+            ATOM_BLOCK *next = lists[i]->next;
+            free(lists[i]);
+            lists[i] = next;
+        }
+    }
+    free(atom_table);
+    atom_table = NULL;
+    atom_count = 0;
+    atom_blocks = atom_big_blocks = NULL;
+}
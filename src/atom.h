@@ -0,0 +1,50 @@
+#ifndef ATOM_H_
+#define ATOM_H_
+
+#include "monocle.h"
+
+/**********************************************************************
+ * atom.h - interned strings
+ *
+ * An atom is the single, immortal copy of a string that the library
+ * hands out for every request to intern that string. Two atoms are
+ * equal if and only if they are the same pointer, so anything keyed
+ * on atoms can compare keys without looking at their characters.
+ *
+ * Atoms may be interned and found from any thread, and finding one
+ * never waits on a lock. Interning may resize the table, which
+ * retires the old one through epoch.h, so it must not be done inside
+ * an epoch reader section. Atoms live until mncl_uninit_atoms is
+ * called, which should only happen once nothing that refers to them
+ * (key-value maps, parsed data, traits) is still alive, and no other
+ * thread is using them.
+ **********************************************************************/
+
+struct struct_MNCL_ATOM {
+    unsigned int hash;
+    size_t len;
+    char name[0];
+};
+
+/**********************************************************************
+ * The hash function used for atoms (and thus for anything indexed by
+ * atoms). If len is non-NULL, the length of the key is stored there.
+ **********************************************************************/
+unsigned int atom_hash(const char *key, size_t *len);
+
+/**********************************************************************
+ * Interning with an explicit length, for callers (like the data
+ * parser) whose strings are not null-terminated where they sit. The
+ * string must not contain embedded NULs.
+ **********************************************************************/
+MNCL_ATOM *mncl_atom_n(const char *name, size_t len);
+
+/**********************************************************************
+ * Finds the atom for a string without creating it. If this returns
+ * NULL, no map anywhere can have the string as a key.
+ **********************************************************************/
+MNCL_ATOM *mncl_atom_find(const char *name);
+
+void mncl_uninit_atoms(void);
+
+#endif
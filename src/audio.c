@@ -42,7 +42,7 @@ mncl_play_music_file(const char *pathname, int fade_in_ms)
     }
     strncpy(current_bgm_name, pathname, name_size);
 
-    bgm_rw = SDL_RWFromMem(current_bgm_raw->data, current_bgm_raw->size);
+    bgm_rw = SDL_RWFromConstMem(current_bgm_raw->data, current_bgm_raw->size);
     if (!bgm_rw) {
         mncl_stop_music();
         return;
@@ -116,7 +116,7 @@ mncl_alloc_sfx(const char *resource_name)
         return NULL;
     }
 
-    rwops = SDL_RWFromMem(raw->data, raw->size);
+    rwops = SDL_RWFromConstMem(raw->data, raw->size);
     if (!rwops) {
         mncl_release_raw(raw);
         return NULL;
@@ -0,0 +1,413 @@
+#include <stddef.h>
+#include <string.h>
+#include "btree.h"
+/**********************************************************************
+ * btree.c - B-tree implementation
+ *
+ * Insertion follows CLRS, splitting full nodes on the way down so
+ * that there is always room for an item to move up. Deletion works
+ * bottom-up instead: an item in an internal node trades places with
+ * its predecessor, which is always in a leaf, and then any node left
+ * with fewer than BTREE_MIN_DEGREE - 1 items borrows from a sibling
+ * or merges with one, working back up towards the root.
+ **********************************************************************/
+
+#define BTREE_T BTREE_MIN_DEGREE
+
+void
+btree_init(BTREE *t)
+{
+    t->root = NULL;
+    tree_pool_init(&t->leaves, offsetof(BTREE_NODE, children));
+    tree_pool_init(&t->branches, sizeof(BTREE_NODE));
+}
+
+void
+btree_clear(BTREE *t)
+{
+    tree_pool_release(&t->leaves);
+    tree_pool_release(&t->branches);
+    t->root = NULL;
+}
+
+static BTREE_NODE *
+btree_node_alloc(BTREE *t, int leaf)
+{
+    BTREE_NODE *n = (BTREE_NODE *)tree_pool_alloc(leaf ? &t->leaves : &t->branches);
+    if (n) {
+        n->parent = NULL;
+        n->size = 0;
+        n->count = 0;
+        n->leaf = leaf;
+    }
+    return n;
+}
+
+static void
+btree_node_free(BTREE *t, BTREE_NODE *n)
+{
+    tree_pool_free(n->leaf ? &t->leaves : &t->branches, n);
+}
+
+/* Where child sits in its parent's children array. Nodes are small,
+ * so a scan is cheaper than keeping the index up to date. */
+static int
+child_index(BTREE_NODE *parent, BTREE_NODE *child)
+{
+    int i = 0;
+    while (parent->children[i] != child) {
+        ++i;
+    }
+    return i;
+}
+
+/* Moves the children of n in [first, last) into place and points
+ * them back at n. */
+static void
+adopt_children(BTREE_NODE *n, int first, int last)
+{
+    int i;
+    for (i = first; i < last; ++i) {
+        n->children[i]->parent = n;
+    }
+}
+
+/* Splits x's full child i in two around its median, which moves up
+ * into x. Returns 0, changing nothing, if out of memory. */
+static int
+split_child(BTREE *t, BTREE_NODE *x, int i)
+{
+    BTREE_NODE *y = x->children[i];
+    BTREE_NODE *z = btree_node_alloc(t, y->leaf);
+    int j;
+    if (!z) {
+        return 0;
+    }
+    z->parent = x;
+    z->count = BTREE_T - 1;
+    memcpy(z->items, y->items + BTREE_T, (BTREE_T - 1) * sizeof(void *));
+    z->size = BTREE_T - 1;
+    if (!y->leaf) {
+        memcpy(z->children, y->children + BTREE_T, BTREE_T * sizeof(BTREE_NODE *));
+        adopt_children(z, 0, BTREE_T);
+        for (j = 0; j < BTREE_T; ++j) {
+            z->size += z->children[j]->size;
+        }
+    }
+    y->count = BTREE_T - 1;
+    y->size -= z->size + 1;
+    memmove(x->items + i + 1, x->items + i, (x->count - i) * sizeof(void *));
+    memmove(x->children + i + 2, x->children + i + 1, (x->count - i) * sizeof(BTREE_NODE *));
+    x->items[i] = y->items[BTREE_T - 1];
+    x->children[i + 1] = z;
+    ++x->count;
+    return 1;
+}
+
+int
+btree_insert(BTREE *t, void *item, BTREE_CMP cmp)
+{
+    BTREE_NODE *n;
+    int i;
+    if (!t->root) {
+        t->root = btree_node_alloc(t, 1);
+        if (!t->root) {
+            return 0;
+        }
+    }
+    if (t->root->count == BTREE_MAX_ITEMS) {
+        BTREE_NODE *s = btree_node_alloc(t, 0);
+        if (!s) {
+            return 0;
+        }
+        s->children[0] = t->root;
+        s->size = t->root->size;
+        t->root->parent = s;
+        if (!split_child(t, s, 0)) {
+            t->root->parent = NULL;
+            btree_node_free(t, s);
+            return 0;
+        }
+        t->root = s;
+    }
+    n = t->root;
+    while (1) {
+        i = n->count;
+        while (i > 0 && cmp(item, n->items[i - 1]) < 0) {
+            --i;
+        }
+        if (n->leaf) {
+            break;
+        }
+        if (n->children[i]->count == BTREE_MAX_ITEMS) {
+            if (!split_child(t, n, i)) {
+                return 0;
+            }
+            if (cmp(item, n->items[i]) >= 0) {
+                ++i;
+            }
+        }
+        n = n->children[i];
+    }
+    memmove(n->items + i + 1, n->items + i, (n->count - i) * sizeof(void *));
+    n->items[i] = item;
+    ++n->count;
+    for (; n; n = n->parent) {
+        ++n->size;
+    }
+    return 1;
+}
+
+/* Finds the node and position of an item equal to the one given */
+static BTREE_NODE *
+btree_locate(BTREE *t, const void *item, BTREE_CMP cmp, int *index)
+{
+    BTREE_NODE *n = t->root;
+    while (n) {
+        int i = 0, c = 1;
+        while (i < n->count && (c = cmp(n->items[i], item)) < 0) {
+            ++i;
+        }
+        if (i < n->count && c == 0) {
+            *index = i;
+            return n;
+        }
+        n = n->leaf ? NULL : n->children[i];
+    }
+    return NULL;
+}
+
+void *
+btree_find(BTREE *t, const void *item, BTREE_CMP cmp)
+{
+    int i;
+    BTREE_NODE *n = btree_locate(t, item, cmp, &i);
+    return n ? n->items[i] : NULL;
+}
+
+/* Child i of x has too few items; make up the difference from the
+ * sibling on the left. */
+static void
+borrow_left(BTREE_NODE *x, int i)
+{
+    BTREE_NODE *n = x->children[i], *left = x->children[i - 1];
+    unsigned int moved = 1;
+    memmove(n->items + 1, n->items, n->count * sizeof(void *));
+    n->items[0] = x->items[i - 1];
+    x->items[i - 1] = left->items[left->count - 1];
+    if (!n->leaf) {
+        memmove(n->children + 1, n->children, (n->count + 1) * sizeof(BTREE_NODE *));
+        n->children[0] = left->children[left->count];
+        n->children[0]->parent = n;
+        moved += n->children[0]->size;
+    }
+    ++n->count;
+    --left->count;
+    n->size += moved;
+    left->size -= moved;
+}
+
+/* ... or from the sibling on the right. */
+static void
+borrow_right(BTREE_NODE *x, int i)
+{
+    BTREE_NODE *n = x->children[i], *right = x->children[i + 1];
+    unsigned int moved = 1;
+    n->items[n->count] = x->items[i];
+    x->items[i] = right->items[0];
+    memmove(right->items, right->items + 1, (right->count - 1) * sizeof(void *));
+    if (!n->leaf) {
+        n->children[n->count + 1] = right->children[0];
+        n->children[n->count + 1]->parent = n;
+        moved += right->children[0]->size;
+        memmove(right->children, right->children + 1, right->count * sizeof(BTREE_NODE *));
+    }
+    ++n->count;
+    --right->count;
+    n->size += moved;
+    right->size -= moved;
+}
+
+/* Folds child i + 1 of x, and the item between them, into child i */
+static void
+merge_children(BTREE *t, BTREE_NODE *x, int i)
+{
+    BTREE_NODE *y = x->children[i], *z = x->children[i + 1];
+    y->items[y->count] = x->items[i];
+    memcpy(y->items + y->count + 1, z->items, z->count * sizeof(void *));
+    if (!y->leaf) {
+        memcpy(y->children + y->count + 1, z->children, (z->count + 1) * sizeof(BTREE_NODE *));
+        adopt_children(y, y->count + 1, y->count + z->count + 2);
+    }
+    y->count += z->count + 1;
+    y->size += z->size + 1;
+    memmove(x->items + i, x->items + i + 1, (x->count - i - 1) * sizeof(void *));
+    memmove(x->children + i + 1, x->children + i + 2, (x->count - i - 1) * sizeof(BTREE_NODE *));
+    --x->count;
+    btree_node_free(t, z);
+}
+
+int
+btree_delete(BTREE *t, const void *item, BTREE_CMP cmp)
+{
+    int i;
+    BTREE_NODE *p, *n = btree_locate(t, item, cmp, &i);
+    if (!n) {
+        return 0;
+    }
+    if (!n->leaf) {
+        /* Trade places with the predecessor and delete that instead */
+        p = n->children[i];
+        while (!p->leaf) {
+            p = p->children[p->count];
+        }
+        n->items[i] = p->items[p->count - 1];
+        n = p;
+        i = p->count - 1;
+    }
+    memmove(n->items + i, n->items + i + 1, (n->count - i - 1) * sizeof(void *));
+    --n->count;
+    for (p = n; p; p = p->parent) {
+        --p->size;
+    }
+    while (n->parent && n->count < BTREE_T - 1) {
+        p = n->parent;
+        i = child_index(p, n);
+        if (i > 0 && p->children[i - 1]->count >= BTREE_T) {
+            borrow_left(p, i);
+            break;
+        } else if (i < p->count && p->children[i + 1]->count >= BTREE_T) {
+            borrow_right(p, i);
+            break;
+        }
+        merge_children(t, p, (i > 0) ? i - 1 : i);
+        n = p;
+    }
+    n = t->root;
+    if (!n->count) {
+        t->root = n->leaf ? NULL : n->children[0];
+        if (t->root) {
+            t->root->parent = NULL;
+        }
+        btree_node_free(t, n);
+    }
+    return 1;
+}
+
+static void *
+cursor_at(BTREE_CURSOR *c, BTREE_NODE *n, int i)
+{
+    c->node = n;
+    c->index = i;
+    return n ? n->items[i] : NULL;
+}
+
+void *
+btree_minimum(BTREE *t, BTREE_CURSOR *c)
+{
+    BTREE_NODE *n = t->root;
+    if (!n) {
+        return cursor_at(c, NULL, 0);
+    }
+    while (!n->leaf) {
+        n = n->children[0];
+    }
+    return cursor_at(c, n, 0);
+}
+
+void *
+btree_maximum(BTREE *t, BTREE_CURSOR *c)
+{
+    BTREE_NODE *n = t->root;
+    if (!n) {
+        return cursor_at(c, NULL, 0);
+    }
+    while (!n->leaf) {
+        n = n->children[n->count];
+    }
+    return cursor_at(c, n, n->count - 1);
+}
+
+void *
+btree_next(BTREE_CURSOR *c)
+{
+    BTREE_NODE *n = c->node;
+    int i = c->index;
+    if (!n) {
+        return NULL;
+    }
+    if (!n->leaf) {
+        n = n->children[i + 1];
+        while (!n->leaf) {
+            n = n->children[0];
+        }
+        return cursor_at(c, n, 0);
+    }
+    ++i;
+    /* Off the end of this node, the next item is the one after the
+     * first ancestor we're to the left of. */
+    while (i >= n->count) {
+        if (!n->parent) {
+            return cursor_at(c, NULL, 0);
+        }
+        i = child_index(n->parent, n);
+        n = n->parent;
+    }
+    return cursor_at(c, n, i);
+}
+
+void *
+btree_prev(BTREE_CURSOR *c)
+{
+    BTREE_NODE *n = c->node;
+    int i = c->index;
+    if (!n) {
+        return NULL;
+    }
+    if (!n->leaf) {
+        n = n->children[i];
+        while (!n->leaf) {
+            n = n->children[n->count];
+        }
+        return cursor_at(c, n, n->count - 1);
+    }
+    while (i == 0) {
+        if (!n->parent) {
+            return cursor_at(c, NULL, 0);
+        }
+        i = child_index(n->parent, n);
+        n = n->parent;
+    }
+    return cursor_at(c, n, i - 1);
+}
+
+unsigned int
+btree_size(BTREE *t)
+{
+    return t->root ? t->root->size : 0;
+}
+
+void *
+btree_select(BTREE *t, unsigned int k, BTREE_CURSOR *c)
+{
+    BTREE_CURSOR scratch;
+    BTREE_NODE *n = t->root;
+    if (!c) {
+        c = &scratch;
+    }
+    if (!n || k >= n->size) {
+        return cursor_at(c, NULL, 0);
+    }
+    while (!n->leaf) {
+        int i;
+        for (i = 0; k >= n->children[i]->size; ++i) {
+            k -= n->children[i]->size;
+            if (k == 0) {
+                return cursor_at(c, n, i);
+            }
+            --k;
+        }
+        n = n->children[i];
+    }
+    return cursor_at(c, n, k);
+}
@@ -0,0 +1,93 @@
+#ifndef BTREE_H_
+#define BTREE_H_
+
+#include "tree.h"
+
+/**********************************************************************
+ * btree.h - B-trees
+ *
+ * The red-black trees in tree.h spend a node, three pointers and a
+ * cache miss on every element they hold, so walking a large one in
+ * order hops all over the heap. The B-trees here pack up to
+ * BTREE_MAX_ITEMS item pointers into each node, sized so that a
+ * leaf's items fill two 64-byte cache lines. Since nearly all of the
+ * items in a B-tree live in its leaves, an inorder walk is mostly a
+ * sequential scan through arrays.
+ *
+ * These are ordinary B-trees as in Chapter 18 of CLRS, not B+-trees:
+ * every item is stored exactly once, so internal nodes never hold
+ * stale copies of items that have since been deleted and freed.
+ *
+ * Unlike TREE, a BTREE is not intrusive. It holds plain pointers to
+ * your items, and allocates its own nodes from a pair of TREE_POOLs.
+ * Each node also records how many items lie beneath it, so
+ * btree_select works just like tree_select on a tree with
+ * TREE_ORDER_STATISTICS.
+ **********************************************************************/
+
+#define BTREE_MIN_DEGREE 8
+#define BTREE_MAX_ITEMS (2 * BTREE_MIN_DEGREE - 1)
+
+typedef struct btree_node {
+    struct btree_node *parent;
+    unsigned int size;
+    unsigned short count, leaf;
+    void *items[BTREE_MAX_ITEMS];
+    /* Leaves are allocated without this array */
+    struct btree_node *children[BTREE_MAX_ITEMS + 1];
+} BTREE_NODE;
+
+typedef struct btree {
+    BTREE_NODE *root;
+    TREE_POOL leaves, branches;
+} BTREE;
+
+void btree_init(BTREE *t);
+
+/* Frees every node. The items themselves are left alone. */
+void btree_clear(BTREE *t);
+
+/**********************************************************************
+ * Comparators work like TREE_CMP, but are handed the item pointers
+ * themselves. Insert places items after any equal ones already in
+ * the tree. Find and delete locate an item equal to the one you pass
+ * in, so delete is only well-defined on trees whose items are all
+ * distinct under cmp.
+ *
+ * btree_insert returns 0 if it cannot allocate a node, in which case
+ * the tree is still valid but does not contain the item. btree_delete
+ * returns 1 if it found and removed something.
+ **********************************************************************/
+typedef int (*BTREE_CMP)(const void *, const void *);
+int btree_insert(BTREE *t, void *item, BTREE_CMP cmp);
+void *btree_find(BTREE *t, const void *item, BTREE_CMP cmp);
+int btree_delete(BTREE *t, const void *item, BTREE_CMP cmp);
+
+/**********************************************************************
+ * Cursors. Since items don't know where they are in the tree, inorder
+ * traversal goes through a BTREE_CURSOR instead of tree_next's node
+ * pointers: btree_minimum or btree_maximum (or btree_select) points
+ * the cursor at an item and returns it, and btree_next and btree_prev
+ * move it along. All of these return NULL once they run out of items.
+ *
+ * Inserting into or deleting from a tree invalidates every cursor
+ * into it.
+ **********************************************************************/
+typedef struct btree_cursor {
+    BTREE_NODE *node;
+    int index;
+} BTREE_CURSOR;
+
+void *btree_minimum(BTREE *t, BTREE_CURSOR *c);
+void *btree_maximum(BTREE *t, BTREE_CURSOR *c);
+void *btree_next(BTREE_CURSOR *c);
+void *btree_prev(BTREE_CURSOR *c);
+
+/**********************************************************************
+ * Order statistics, as in tree.h. btree_select also sets up c, if it
+ * is not NULL.
+ **********************************************************************/
+unsigned int btree_size(BTREE *t);
+void *btree_select(BTREE *t, unsigned int k, BTREE_CURSOR *c);
+
+#endif
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "epoch.h"
+
+/* Every store and load that orders readers against the writer is
+ * sequentially consistent. A reader's store of its epoch must not be
+ * reordered after its load of the shared pointer, and release or
+ * acquire alone don't forbid that. */
+
+typedef struct epoch_reader {
+    unsigned long epoch;
+    int depth;
+    struct epoch_reader *next;
+} EPOCH_READER;
+
+typedef struct epoch_retired {
+    void *ptr;
+    MNCL_EPOCH_FN fn;
+    unsigned long epoch;
+    struct epoch_retired *next;
+} EPOCH_RETIRED;
+
+static unsigned long global_epoch = 1;
+static EPOCH_READER *readers = NULL;
+static __thread EPOCH_READER *self = NULL;
+
+/* Atom tables may be retired from any thread, so the list of retired
+ * items has a lock of its own. Nothing is destroyed while it is held,
+ * since destroying one thing may well retire another. */
+static EPOCH_RETIRED *retired = NULL;
+static char retired_locked = 0;
+
+static void
+retired_lock(void)
+{
+    while (__atomic_test_and_set(&retired_locked, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&retired_locked, __ATOMIC_RELAXED)) {
+            MNCL_SPIN_PAUSE();
+        }
+    }
+}
+
+static void
+retired_unlock(void)
+{
+    __atomic_clear(&retired_locked, __ATOMIC_RELEASE);
+}
+
+void
+mncl_epoch_enter(void)
+{
+    EPOCH_READER *r = self;
+    if (!r) {
+        r = (EPOCH_READER *)calloc(1, sizeof(EPOCH_READER));
+        if (!r) {
+            fprintf(stderr, "Heap exhausted while registering a reader thread!\n");
+            abort();
+        }
+        r->next = __atomic_load_n(&readers, __ATOMIC_SEQ_CST);
+        while (!__atomic_compare_exchange_n(&readers, &r->next, r, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            /* r->next has been refreshed; try again */
+        }
+        self = r;
+    }
+    if (r->depth++ == 0) {
+        __atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    }
+}
+
+void
+mncl_epoch_exit(void)
+{
+    EPOCH_READER *r = self;
+    if (r && --r->depth == 0) {
+        __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* The oldest epoch any reader is still in, or ~0 if none are */
+static unsigned long
+oldest_reader(void)
+{
+    unsigned long oldest = ~0UL;
+    EPOCH_READER *r = __atomic_load_n(&readers, __ATOMIC_SEQ_CST);
+    for (; r; r = r->next) {
+        unsigned long e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+        if (e && e < oldest) {
+            oldest = e;
+        }
+    }
+    return oldest;
+}
+
+void
+mncl_epoch_reclaim(void)
+{
+    EPOCH_RETIRED **link, *ready = NULL;
+    unsigned long oldest;
+    if (!__atomic_load_n(&retired, __ATOMIC_RELAXED)) {
+        return;
+    }
+    retired_lock();
+    /* Only once the lock is held, so that everything on the list was
+     * retired before the readers were looked at */
+    oldest = oldest_reader();
+    link = &retired;
+    while (*link) {
+        EPOCH_RETIRED *item = *link;
+        if (item->epoch < oldest) {
+            *link = item->next;
+            item->next = ready;
+            ready = item;
+        } else {
+            link = &item->next;
+        }
+    }
+    retired_unlock();
+    while (ready) {
+        EPOCH_RETIRED *item = ready;
+        ready = item->next;
+        item->fn(item->ptr);
+        free(item);
+    }
+}
+
+void
+mncl_epoch_retire(void *ptr, MNCL_EPOCH_FN fn)
+{
+    EPOCH_RETIRED *item = (EPOCH_RETIRED *)malloc(sizeof(EPOCH_RETIRED));
+    unsigned long epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    if (!item) {
+        /* Nowhere to queue it, so wait out the readers instead */
+        while (oldest_reader() <= epoch) {
+            MNCL_SPIN_PAUSE();
+        }
+        fn(ptr);
+        return;
+    }
+    item->ptr = ptr;
+    item->fn = fn;
+    item->epoch = epoch;
+    retired_lock();
+    item->next = retired;
+    retired = item;
+    retired_unlock();
+    mncl_epoch_reclaim();
+}
+
+void
+mncl_uninit_epochs(void)
+{
+    EPOCH_READER *r = readers;
+    while (retired) {
+        EPOCH_RETIRED *item = retired;
+        retired = item->next;
+        item->fn(item->ptr);
+        free(item);
+    }
+    while (r) {
+        EPOCH_READER *next = r->next;
+        free(r);
+        r = next;
+    }
+    readers = NULL;
+    self = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/**********************************************************************
+ * epoch.h - epoch-based memory reclamation
+ *
+ * This lets threads read shared structures without locks while one
+ * writer replaces them. Readers bracket each access with
+ * mncl_epoch_enter and mncl_epoch_exit. The writer, once it has
+ * atomically swapped in a new version of something, hands the old
+ * version to mncl_epoch_retire, and the old version is only actually
+ * destroyed after every reader that might have seen it has exited.
+ *
+ * The scheme is the usual one. A global epoch counter is bumped on
+ * every retirement, each reader thread records the epoch it entered
+ * in (or 0 when outside), and something retired in epoch R is freed
+ * once no reader is still in an epoch <= R.
+ *
+ * Reader sections may nest, and any thread may read. Any thread may
+ * also retire and reclaim, though not from inside a reader section
+ * of its own. Each reading thread gets a small record the first time
+ * it enters, and that record is never freed until
+ * mncl_uninit_epochs, which should only be called once every other
+ * thread is done.
+ **********************************************************************/
+
+/* A hint to the processor that the caller is spinning, waiting on
+ * another thread */
+#if defined(__i386__) || defined(__x86_64__)
+#define MNCL_SPIN_PAUSE() __builtin_ia32_pause()
+#else
+#define MNCL_SPIN_PAUSE() ((void)0)
+#endif
+
+void mncl_epoch_enter(void);
+void mncl_epoch_exit(void);
+
+typedef void (*MNCL_EPOCH_FN)(void *);
+void mncl_epoch_retire(void *ptr, MNCL_EPOCH_FN fn);
+
+/* Destroys whatever retired items are now safe to destroy. Retiring
+ * something does this too. */
+void mncl_epoch_reclaim(void);
+
+void mncl_uninit_epochs(void);
+
+#endif
@@ -140,7 +140,7 @@ mncl_alloc_spritesheet(const char *resource_name)
     if (!spritesheet) {
         return NULL;
     }
-    loaded = IMG_Load_RW(SDL_RWFromMem(raw->data, raw->size), 1);
+    loaded = IMG_Load_RW(SDL_RWFromConstMem(raw->data, raw->size), 1);
     if (!loaded) {
         free(spritesheet);
         mncl_release_raw(raw);
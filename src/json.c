@@ -1,8 +1,60 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <ctype.h>
 #include <string.h>
+#include <float.h>
+#include <locale.h>
+#include <stdint.h>
 #include "monocle.h"
+#include "monocle_internal.h"
+#include "tree.h"
+
+/* Arena documents. Every node of one of these, along with its
+ * strings, arrays and (frozen) object maps, is carved out of a chain
+ * of chunks owned by the root, so freeing the root frees the whole
+ * document at once. The first chunk is sized from the input, so most
+ * documents fit in one. Nodes carry MNCL_DATA_IN_ARENA, which makes
+ * mncl_free_data on anything but the root do nothing. The root holds
+ * one reference to the arena and each shared copy (see
+ * mncl_data_share) holds another; the last one to go frees it.
+ *
+ * These are the only values of a node's flags that mean anything.
+ * Any other value, such as the zero of a node a client filled in
+ * itself, marks a plain heap node. */
+
+#define MNCL_DATA_FLAGS_MAGIC 0x4d4e4300
+#define MNCL_DATA_IN_ARENA (MNCL_DATA_FLAGS_MAGIC | 1)
+#define MNCL_DATA_ARENA_ROOT (MNCL_DATA_FLAGS_MAGIC | 2)
+#define MNCL_DATA_SHARED (MNCL_DATA_FLAGS_MAGIC | 3)
+
+/* True for every node whose values belong to an arena, root included */
+#define DATA_IN_ARENA(d) ((d)->flags == MNCL_DATA_IN_ARENA || (d)->flags == MNCL_DATA_ARENA_ROOT)
+
+/* Arena allocations are aligned for doubles */
+#define ARENA_ALIGN(n) (((n) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
+typedef struct mncl_data_chunk {
+    struct mncl_data_chunk *next;
+    size_t size, used;
+} MNCL_DATA_CHUNK;
+
+typedef struct {
+    MNCL_DATA root; /* Must come first */
+    MNCL_DATA_CHUNK *chunks;
+    int refs;
+} MNCL_DATA_ARENA;
+
+/* A shared copy of (part of) an arena document. Its value is that of
+ * the node it copies, so its array or object belongs to the arena
+ * until mncl_data_writable first changes it; after that, own is a
+ * private copy of the node, and the value is own's. */
+typedef struct {
+    MNCL_DATA core; /* Must come first */
+    MNCL_DATA_ARENA *arena;
+    MNCL_DATA *own;
+} MNCL_DATA_SHARED_VALUE;
 
 /* JSON Parse context. */
 typedef struct {
@@ -10,9 +62,46 @@ typedef struct {
                     * necessarily null-terminated! */
     size_t size;   /* The length of s */
     int i;         /* The parser's "cursor" location, as an offset */
-    int line, col; /* The parser's "cursor" location, in the file */
+    int base;      /* The offset of s in the whole input, for push
+                    * parses, which discard what they've parsed */
+    int mark, mark_line, mark_nl; /* How many newlines come before
+                                   * the offset mark in the input,
+                                   * and where the last of those is
+                                   * (see position) */
+    char *scratch; /* The elements and members of every array and
+                    * object still being parsed, innermost last, and
+                    * any string being decoded on top of those */
+    size_t top, capacity; /* The used and allocated size of scratch */
+    MNCL_DATA_ARENA *arena; /* Where nodes go, or NULL for the heap */
+    const MNCL_DATA_EVENTS *events; /* If set, report values to these
+                                     * handlers instead of building
+                                     * nodes */
+    void *user;    /* Passed along to the event handlers */
+    void *inline_scratch[32]; /* Where scratch starts out, so small
+                               * documents need no heap for it */
+    int finished;  /* Whether the input ends at the end of s, or more
+                    * of it may yet be fed in */
+    int state;     /* Where the parse is, as a PARSE_ value */
+    size_t frame;  /* Where the innermost open array or object's frame
+                    * is in scratch, or NO_FRAME */
+    MNCL_DATA *result; /* The document, once it has been parsed */
+    MNCL_DATA_ERROR error; /* What went wrong, if anything did */
 } MNCL_DATA_PARSE_CTX;
 
+/* Parser states. Each begins by skipping whitespace, so a push parse
+ * that runs out of input partway through one can start it again once
+ * there's more. */
+enum {
+    PARSE_VALUE,       /* Expecting a value */
+    PARSE_ARRAY_NEXT,  /* In an array, expecting ',' or ']' */
+    PARSE_OBJECT_NEXT, /* In an object, expecting ',' or '}' */
+    PARSE_KEY,         /* Expecting an object member's key */
+    PARSE_COLON,       /* Expecting the ':' after a key */
+    PARSE_END,         /* Expecting nothing but whitespace */
+    PARSE_DONE,
+    PARSE_FAILED
+};
+
 /* Strings and arrays need an extra dummy field to store the extra data. */
 
 typedef struct {
@@ -25,9 +114,15 @@ typedef struct {
     MNCL_DATA *array[0];
 } MNCL_DATA_ARRAY_VALUE;
 
-static char error_str[512] = "";
-MNCL_DATA mncl_data_dummy;
-MNCL_DATA *mncl_data_ok = &mncl_data_dummy;
+/* Each parse keeps its own error, so parses may run on several
+ * threads at once. The error of the last parse on each thread is
+ * copied here as well, for mncl_data_error. */
+static __thread char error_str[512] = "";
+
+/* Event parses build nothing, and the parser functions return this in
+ * place of the values they would have built. It is marked as an arena
+ * node so that freeing it does nothing. */
+static MNCL_DATA event_ok = { MNCL_DATA_NULL, { 0 }, MNCL_DATA_IN_ARENA };
 
 const char *
 mncl_data_error()
@@ -35,6 +130,127 @@ mncl_data_error()
     return error_str;
 }
 
+static void
+error_set(MNCL_DATA_ERROR *error, int line, int column, const char *message)
+{
+    error->line = line;
+    error->column = column;
+    snprintf(error->message, sizeof(error->message), "%d:%d: %s", line, column, message);
+}
+
+/* Passes a parse's error on to mncl_data_error and to the caller */
+static void
+error_report(const MNCL_DATA_ERROR *error, MNCL_DATA_ERROR *out)
+{
+    strcpy(error_str, error->message);
+    if (out) {
+        *out = *error;
+    }
+}
+
+static MNCL_DATA_CHUNK *
+arena_chunk(size_t size)
+{
+    MNCL_DATA_CHUNK *chunk = (MNCL_DATA_CHUNK *)malloc(ARENA_ALIGN(sizeof(MNCL_DATA_CHUNK)) + size);
+    if (chunk) {
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+    }
+    return chunk;
+}
+
+static void *
+arena_alloc(MNCL_DATA_ARENA *arena, size_t size)
+{
+    MNCL_DATA_CHUNK *chunk = arena->chunks;
+    size = ARENA_ALIGN(size);
+    if (chunk->used + size > chunk->size) {
+        size_t grown = chunk->size * 2;
+        chunk = arena_chunk(grown > size ? grown : size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    chunk->used += size;
+    return (char *)chunk + ARENA_ALIGN(sizeof(MNCL_DATA_CHUNK)) + chunk->used - size;
+}
+
+/* Starts an arena, with a first chunk of about size bytes */
+static MNCL_DATA_ARENA *
+arena_new(size_t size)
+{
+    MNCL_DATA_CHUNK *chunk = arena_chunk(ARENA_ALIGN(sizeof(MNCL_DATA_ARENA)) + (size > 4096 ? ARENA_ALIGN(size) : 4096));
+    MNCL_DATA_ARENA *arena;
+    if (!chunk) {
+        return NULL;
+    }
+    arena = (MNCL_DATA_ARENA *)((char *)chunk + ARENA_ALIGN(sizeof(MNCL_DATA_CHUNK)));
+    chunk->used = ARENA_ALIGN(sizeof(MNCL_DATA_ARENA));
+    arena->chunks = chunk;
+    arena->refs = 1;
+    arena->root.tag = MNCL_DATA_NULL;
+    arena->root.flags = MNCL_DATA_ARENA_ROOT;
+    return arena;
+}
+
+static void
+arena_free(MNCL_DATA_ARENA *arena)
+{
+    /* The arena itself lives in the last chunk */
+    MNCL_DATA_CHUNK *chunk = arena->chunks;
+    while (chunk) {
+        MNCL_DATA_CHUNK *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/* Drops one reference to the arena, freeing it if that was the last */
+static void
+arena_release(MNCL_DATA_ARENA *arena)
+{
+    if (__atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        arena_free(arena);
+    }
+}
+
+/* Makes value the arena's root, which is what the caller gets */
+static MNCL_DATA *
+arena_root(MNCL_DATA_ARENA *arena, MNCL_DATA *value)
+{
+    arena->root.tag = value->tag;
+    arena->root.value = value->value;
+    return &arena->root;
+}
+
+/* Allocates a size-byte node, from the arena if there is one */
+static MNCL_DATA *
+data_node(MNCL_DATA_ARENA *arena, MNCL_DATA_TYPE tag, size_t size)
+{
+    MNCL_DATA *result = arena ? (MNCL_DATA *)arena_alloc(arena, size) : (MNCL_DATA *)malloc(size);
+    if (result) {
+        result->tag = tag;
+        result->flags = arena ? MNCL_DATA_IN_ARENA : 0;
+    }
+    return result;
+}
+
+/* Lays an object's members out as a frozen map in the arena */
+static MNCL_KV *
+arena_kv(MNCL_DATA_ARENA *arena, KEY_VALUE_PAIR *pairs, unsigned int count)
+{
+    MNCL_KV *kv = (MNCL_KV *)arena_alloc(arena, sizeof(MNCL_KV));
+    void *block = arena_alloc(arena, kv_frozen_size(count));
+    if (!kv || !block) {
+        return NULL;
+    }
+    mncl_kv_init_frozen(kv, block, NULL, pairs, count);
+    return kv;
+}
+
 void
 mncl_free_data (MNCL_DATA *json)
 {
@@ -42,6 +258,20 @@ mncl_free_data (MNCL_DATA *json)
     if (!json) {
         return;
     }
+    if (json->flags == MNCL_DATA_ARENA_ROOT) {
+        arena_release((MNCL_DATA_ARENA *)json);
+        return;
+    }
+    if (json->flags == MNCL_DATA_IN_ARENA) {
+        return;
+    }
+    if (json->flags == MNCL_DATA_SHARED) {
+        MNCL_DATA_SHARED_VALUE *shared = (MNCL_DATA_SHARED_VALUE *)json;
+        mncl_free_data(shared->own);
+        arena_release(shared->arena);
+        free(shared);
+        return;
+    }
     switch (json->tag) {
     case MNCL_DATA_ARRAY:
         for (i = 0; i < json->value.array.size; ++i) {
@@ -60,15 +290,25 @@ mncl_free_data (MNCL_DATA *json)
     free (json);
 }
 
+typedef struct {
+    KEY_VALUE_PAIR *pairs;
+    unsigned int count;
+    MNCL_DATA_ARENA *arena;
+} MNCL_DATA_CLONE_CTX;
+
+static MNCL_DATA *data_clone(MNCL_DATA *src, MNCL_DATA_ARENA *arena);
+
 void
 mncl_data_clone_kv (const char *key, void *data, void *user)
 {
-    MNCL_KV *kv = (MNCL_KV *)user;
-    mncl_kv_insert (kv, key, mncl_data_clone((MNCL_DATA *)data));
+    MNCL_DATA_CLONE_CTX *ctx = (MNCL_DATA_CLONE_CTX *)user;
+    KEY_VALUE_PAIR *pair = &ctx->pairs[ctx->count++];
+    pair->key = mncl_atom(key);
+    pair->value = data_clone((MNCL_DATA *)data, ctx->arena);
 }
 
-MNCL_DATA *
-mncl_data_clone (MNCL_DATA *src)
+static MNCL_DATA *
+data_clone(MNCL_DATA *src, MNCL_DATA_ARENA *arena)
 {
     if (!src) {
         return NULL;
@@ -78,37 +318,59 @@ mncl_data_clone (MNCL_DATA *src)
     case MNCL_DATA_BOOLEAN:
     case MNCL_DATA_NUMBER:
     {
-        MNCL_DATA *dest = malloc(sizeof(MNCL_DATA));
-        dest->tag = src->tag;
-        dest->value = src->value;
+        MNCL_DATA *dest = data_node(arena, src->tag, sizeof(MNCL_DATA));
+        if (dest) {
+            dest->value = src->value;
+        }
         return dest;
     }
     case MNCL_DATA_STRING:
     {
-        MNCL_DATA_STRING_VALUE *dest = malloc(sizeof(MNCL_DATA_STRING_VALUE) + strlen(src->value.string) + 1);
-        dest->core.tag = src->tag;
-        dest->core.value.string = &dest->str[0];
-        strcpy(dest->core.value.string, src->value.string);
+        MNCL_DATA_STRING_VALUE *dest = (MNCL_DATA_STRING_VALUE *)data_node(arena, src->tag, sizeof(MNCL_DATA_STRING_VALUE) + strlen(src->value.string) + 1);
+        if (dest) {
+            dest->core.value.string = &dest->str[0];
+            strcpy(dest->core.value.string, src->value.string);
+        }
         return (MNCL_DATA *)dest;
     }
     case MNCL_DATA_ARRAY:
     {
         int i;
-        MNCL_DATA_ARRAY_VALUE *dest = malloc(sizeof(MNCL_DATA_ARRAY_VALUE) + sizeof(MNCL_DATA *) * src->value.array.size);
-        dest->core.tag = src->tag;
+        MNCL_DATA_ARRAY_VALUE *dest = (MNCL_DATA_ARRAY_VALUE *)data_node(arena, src->tag, sizeof(MNCL_DATA_ARRAY_VALUE) + sizeof(MNCL_DATA *) * src->value.array.size);
+        if (!dest) {
+            return NULL;
+        }
         dest->core.value.array.size = src->value.array.size;
         dest->core.value.array.data = &dest->array[0];
         for (i = 0; i < src->value.array.size; ++i) {
-            dest->array[i] = mncl_data_clone(src->value.array.data[i]);
+            dest->array[i] = data_clone(src->value.array.data[i], arena);
         }
         return (MNCL_DATA *)dest;
     }
     case MNCL_DATA_OBJECT:
     {
-        MNCL_DATA *dest = malloc(sizeof(MNCL_DATA));
-        dest->tag = src->tag;
-        dest->value.object = mncl_alloc_kv((MNCL_KV_DELETER)mncl_free_data);
-        mncl_kv_foreach(src->value.object, mncl_data_clone_kv, dest->value.object);
+        MNCL_DATA *dest = data_node(arena, src->tag, sizeof(MNCL_DATA));
+        MNCL_DATA_CLONE_CTX ctx;
+        if (!dest) {
+            return NULL;
+        }
+        dest->value.object = arena ? NULL : mncl_alloc_kv((MNCL_KV_DELETER)mncl_free_data);
+        /* The source is walked in order, so this builds in linear time */
+        ctx.count = 0;
+        ctx.arena = arena;
+        ctx.pairs = (KEY_VALUE_PAIR *)malloc(mncl_kv_count(src->value.object) * sizeof(KEY_VALUE_PAIR) + 1);
+        if (ctx.pairs) {
+            mncl_kv_foreach(src->value.object, mncl_data_clone_kv, &ctx);
+            if (arena) {
+                dest->value.object = arena_kv(arena, ctx.pairs, ctx.count);
+            } else if (!mncl_kv_build(dest->value.object, ctx.pairs, ctx.count)) {
+                unsigned int i;
+                for (i = 0; i < ctx.count; ++i) {
+                    mncl_free_data((MNCL_DATA *)ctx.pairs[i].value);
+                }
+            }
+            free(ctx.pairs);
+        }
         return dest;
     }
     default:
@@ -117,6 +379,40 @@ mncl_data_clone (MNCL_DATA *src)
     return NULL;
 }
 
+MNCL_DATA *
+mncl_data_clone (MNCL_DATA *src)
+{
+    return data_clone(src, NULL);
+}
+
+/* Sizes the new arena after the source's, if that was one */
+MNCL_DATA *
+mncl_data_clone_arena (MNCL_DATA *src)
+{
+    size_t size = 0;
+    MNCL_DATA_ARENA *arena;
+    MNCL_DATA *result;
+    if (!src) {
+        return NULL;
+    }
+    if (src->flags == MNCL_DATA_ARENA_ROOT) {
+        MNCL_DATA_CHUNK *chunk;
+        for (chunk = ((MNCL_DATA_ARENA *)src)->chunks; chunk; chunk = chunk->next) {
+            size += chunk->used;
+        }
+    }
+    arena = arena_new(size);
+    if (!arena) {
+        return NULL;
+    }
+    result = data_clone(src, arena);
+    if (!result) {
+        arena_free(arena);
+        return NULL;
+    }
+    return arena_root(arena, result);
+}
+
 /* We have this return an int because the ctype functions take ints
  * and that can get ugly. */
 static int
@@ -134,19 +430,161 @@ readch (MNCL_DATA_PARSE_CTX *ctx)
     int c = peekch(ctx);
     if (c) {
         ++ctx->i;
-        ++ctx->col;
-        if (c == '\n') {
-            ctx->col = 1;
-            ++ctx->line;
-        }
     }
     return c;
 }
 
+/* Steps over n characters that are already known not to be the end
+ * of the input */
+static void
+skip (MNCL_DATA_PARSE_CTX *ctx, int n)
+{
+    ctx->i += n;
+}
+
+/* Works out the line and column of offset i in s. Nothing keeps
+ * track of these as the parser goes; instead, this counts the
+ * newlines since the last offset it was asked about, so offsets must
+ * be asked about in order. Lines count from 0 and columns from 1,
+ * except on the first line, where they count from 0. */
+static void
+position(MNCL_DATA_PARSE_CTX *ctx, int i, int *line, int *col)
+{
+    const char *p = ctx->s + (ctx->mark - ctx->base), *end = ctx->s + i;
+    while (p < end && (p = (const char *)memchr(p, '\n', end - p)) != NULL) {
+        ++ctx->mark_line;
+        ctx->mark_nl = ctx->base + (int)(p - ctx->s);
+        ++p;
+    }
+    ctx->mark = ctx->base + i;
+    *line = ctx->mark_line;
+    *col = ctx->mark_line ? ctx->mark - ctx->mark_nl : ctx->mark;
+}
+
+/* Reports an error at offset i in s. The push parser may yet take
+ * the error back and go on from an earlier offset, so the mark is
+ * left where it was. */
+static void
+parse_error(MNCL_DATA_PARSE_CTX *ctx, int i, const char *fmt, ...)
+{
+    char message[480];
+    int line, col, mark = ctx->mark, mark_line = ctx->mark_line, mark_nl = ctx->mark_nl;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    position(ctx, i, &line, &col);
+    ctx->mark = mark;
+    ctx->mark_line = mark_line;
+    ctx->mark_nl = mark_nl;
+    error_set(&ctx->error, line, col, message);
+}
+
+/* Steps over a run of digits, returning how many there were */
+static int
+digits (MNCL_DATA_PARSE_CTX *ctx)
+{
+    int n = 0;
+    while (ctx->i + n < ctx->size && ctx->s[ctx->i + n] >= '0' && ctx->s[ctx->i + n] <= '9') {
+        ++n;
+    }
+    skip(ctx, n);
+    return n;
+}
+
+/* Bulk scanning. The parser spends most of its time in runs of
+ * whitespace and of plain string characters, so where the compiler
+ * targets SSE2 or AVX2 these are found a block at a time: each
+ * scan_*_mask function below classifies one SCAN_BLOCK-byte block
+ * into a bitmask, one bit per byte, with the first byte lowest.
+ * Whatever is left over at the end of the input, or everything if
+ * neither instruction set is available, goes through the ordinary
+ * character-at-a-time code. */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_BLOCK 32
+typedef __m256i SCAN_VEC;
+#define scan_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define scan_splat _mm256_set1_epi8
+#define scan_eq _mm256_cmpeq_epi8
+#define scan_or _mm256_or_si256
+#define scan_sub _mm256_sub_epi8
+#define scan_min _mm256_min_epu8
+#define scan_bits(v) ((unsigned int)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_BLOCK 16
+typedef __m128i SCAN_VEC;
+#define scan_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define scan_splat _mm_set1_epi8
+#define scan_eq _mm_cmpeq_epi8
+#define scan_or _mm_or_si128
+#define scan_sub _mm_sub_epi8
+#define scan_min _mm_min_epu8
+#define scan_bits(v) ((unsigned int)_mm_movemask_epi8(v))
+#endif
+
+#ifdef SCAN_BLOCK
+/* Bytes that aren't whitespace (as isspace sees it: space and \t
+ * through \r) */
+static unsigned int
+scan_space_mask(const char *p)
+{
+    /* x <= y, unsigned, exactly when min(x, y) == x */
+    const unsigned int all = (unsigned int)(((unsigned long long)1 << SCAN_BLOCK) - 1);
+    SCAN_VEC v = scan_load(p);
+    SCAN_VEC ctl = scan_sub(v, scan_splat('\t'));
+    SCAN_VEC ws = scan_or(scan_eq(v, scan_splat(' ')),
+                          scan_eq(scan_min(ctl, scan_splat('\r' - '\t')), ctl));
+    return ~scan_bits(ws) & all;
+}
+
+/* Bytes that end a run of plain string text: quotes, backslashes and
+ * control characters */
+static unsigned int
+scan_string_mask(const char *p)
+{
+    SCAN_VEC v = scan_load(p);
+    SCAN_VEC special = scan_or(scan_eq(v, scan_splat('\"')),
+                               scan_eq(v, scan_splat('\\')));
+    special = scan_or(special, scan_eq(scan_min(v, scan_splat(0x1f)), v));
+    return scan_bits(special);
+}
+#endif
+
+/* The number of plain string characters at the cursor, as counted
+ * by whole blocks. The count may fall short of the real run. */
+static size_t
+plain_run(MNCL_DATA_PARSE_CTX *ctx)
+{
+    size_t n = 0;
+#ifdef SCAN_BLOCK
+    while (ctx->i + n + SCAN_BLOCK <= ctx->size) {
+        unsigned int stop = scan_string_mask(ctx->s + ctx->i + n);
+        if (stop) {
+            return n + __builtin_ctz(stop);
+        }
+        n += SCAN_BLOCK;
+    }
+#endif
+    return n;
+}
+
 /* Skip whitespace */
 static void
 space (MNCL_DATA_PARSE_CTX *ctx)
 {
+#ifdef SCAN_BLOCK
+    while (ctx->i + SCAN_BLOCK <= ctx->size) {
+        unsigned int stop = scan_space_mask(ctx->s + ctx->i);
+        if (stop) {
+            ctx->i += __builtin_ctz(stop);
+            return;
+        }
+        ctx->i += SCAN_BLOCK;
+    }
+#endif
     while (1) {
         int c = peekch(ctx);
         if (!c || !isspace(c)) {
@@ -156,130 +594,269 @@ space (MNCL_DATA_PARSE_CTX *ctx)
     }
 }
 
+/* Makes room for n more bytes on top of the scratch stack */
+static int
+scratch_reserve(MNCL_DATA_PARSE_CTX *ctx, size_t n)
+{
+    size_t capacity = ctx->capacity ? ctx->capacity : 256;
+    char *grown;
+    if (ctx->top + n <= ctx->capacity) {
+        return 1;
+    }
+    while (capacity < ctx->top + n) {
+        capacity *= 2;
+    }
+    if (ctx->scratch == (char *)ctx->inline_scratch) {
+        grown = (char *)malloc(capacity);
+        if (grown) {
+            memcpy(grown, ctx->scratch, ctx->top);
+        }
+    } else {
+        grown = (char *)realloc(ctx->scratch, capacity);
+    }
+    if (!grown) {
+        parse_error(ctx, ctx->i, "Out of memory");
+        return 0;
+    }
+    ctx->scratch = grown;
+    ctx->capacity = capacity;
+    return 1;
+}
+
+static int
+scratch_push(MNCL_DATA_PARSE_CTX *ctx, const void *item, size_t n)
+{
+    if (!scratch_reserve(ctx, n)) {
+        return 0;
+    }
+    memcpy(ctx->scratch + ctx->top, item, n);
+    ctx->top += n;
+    return 1;
+}
+
+/* What an event parse returns once a handler has run */
+static MNCL_DATA *
+event_result(MNCL_DATA_PARSE_CTX *ctx, int ok)
+{
+    if (!ok) {
+        parse_error(ctx, ctx->i, "Parsing stopped by event handler");
+        return NULL;
+    }
+    return &event_ok;
+}
+
 static MNCL_DATA *
-word(MNCL_DATA_PARSE_CTX *ctx, int scan)
+word(MNCL_DATA_PARSE_CTX *ctx)
 {
     const char *s = ctx->s + ctx->i;
+    const MNCL_DATA_EVENTS *events = ctx->events;
+    MNCL_DATA *result;
+    int boolean;
     if (*s == 'n' && ctx->i + 4 <= ctx->size && !strncmp(s, "null", 4)) {
-        int i;
-        MNCL_DATA *result;
-        for (i = 0; i < 4; ++i) {
-            readch(ctx);
+        skip(ctx, 4);
+        if (events) {
+            return event_result(ctx, !events->null_value || events->null_value(ctx->user));
         }
-        if (scan) {
-            return mncl_data_ok;
-        }
-        result = (MNCL_DATA *)malloc(sizeof(MNCL_DATA));
+        result = data_node(ctx->arena, MNCL_DATA_NULL, sizeof(MNCL_DATA));
         if (!result) {
-            snprintf(error_str, 512, "%d:%d: Out of memory", ctx->line, ctx->col);
+            parse_error(ctx, ctx->i, "Out of memory");
             return NULL;
         }
-        result->tag = MNCL_DATA_NULL;
         return result;
     } else if (*s == 't' && ctx->i + 4 <= ctx->size && !strncmp(s, "true", 4)) {
-        int i;
-        MNCL_DATA *result;
-        for (i = 0; i < 4; ++i) {
-            readch(ctx);
-        }
-        if (scan) {
-            return mncl_data_ok;
-        }
-        result = (MNCL_DATA *)malloc(sizeof(MNCL_DATA));
-        if (!result) {
-            snprintf(error_str, 512, "%d:%d: Out of memory", ctx->line, ctx->col);
-            return NULL;
-        }
-        result->tag = MNCL_DATA_BOOLEAN;
-        result->value.boolean = 1;
-        return result;
+        skip(ctx, 4);
+        boolean = 1;
     } else if (*s == 'f' && ctx->i + 5 <= ctx->size && !strncmp(s, "false", 5)) {
-        int i;
-        MNCL_DATA *result;
-        for (i = 0; i < 5; ++i) {
-            readch(ctx);
-        }
-        if (scan) {
-            return mncl_data_ok;
-        }
-        result = (MNCL_DATA *)malloc(sizeof(MNCL_DATA));
-        if (!result) {
-            snprintf(error_str, 512, "%d:%d: Out of memory", ctx->line, ctx->col);
-            return NULL;
-        }
-        result->tag = MNCL_DATA_BOOLEAN;
-        result->value.boolean = 0;
-        return result;
+        skip(ctx, 5);
+        boolean = 0;
+    } else {
+        parse_error(ctx, ctx->i, "Expected value");
+        return NULL;
     }
-    snprintf(error_str, 512, "%d:%d: Expected value", ctx->line, ctx->col);
-    return NULL;
+    if (events) {
+        return event_result(ctx, !events->boolean || events->boolean(ctx->user, boolean));
+    }
+    result = data_node(ctx->arena, MNCL_DATA_BOOLEAN, sizeof(MNCL_DATA));
+    if (!result) {
+        parse_error(ctx, ctx->i, "Out of memory");
+        return NULL;
+    }
+    result->value.boolean = boolean;
+    return result;
 }
 
-static MNCL_DATA *
-number(MNCL_DATA_PARSE_CTX *ctx, int scan)
+/* Steps over the number at the cursor, returning 0 if it's
+ * malformed */
+static int
+number_scan(MNCL_DATA_PARSE_CTX *ctx)
 {
-    const char *s = ctx->s + ctx->i;
     int ch;
-    MNCL_DATA *result;
     if (peekch(ctx) == '-') {
-        readch(ctx);
+        skip(ctx, 1);
     }
     if (peekch(ctx) == '0') {
-        readch(ctx);
+        skip(ctx, 1);
         if (isdigit(peekch(ctx))) {
-            snprintf(error_str, 512, "%d:%d: Numbers may not have leading zeros", ctx->line, ctx->col);
-            return NULL;
-        }
-    } else {
-        int n = 0;
-        while (isdigit(peekch(ctx))) {
-            readch(ctx);
-            ++n;
-        }
-        if (n == 0) {
-            snprintf(error_str, 512, "%d:%d: Expected number", ctx->line, ctx->col);
-            return NULL;
+            parse_error(ctx, ctx->i, "Numbers may not have leading zeros");
+            return 0;
         }
+    } else if (digits(ctx) == 0) {
+        parse_error(ctx, ctx->i, "Expected number");
+        return 0;
     }
     if (peekch(ctx) == '.') {
-        int n = 0;
-        readch(ctx);
-        while (isdigit(peekch(ctx))) {
-            readch(ctx);
-            ++n;
-        }
-        if (n == 0) {
-            snprintf(error_str, 512, "%d:%d: Expected number after decimal point", ctx->line, ctx->col);
-            return NULL;
+        skip(ctx, 1);
+        if (digits(ctx) == 0) {
+            parse_error(ctx, ctx->i, "Expected number after decimal point");
+            return 0;
         }
     }
     ch = peekch(ctx);
     if (ch == 'e' || ch == 'E') {
-        int n = 0;
-        readch(ctx);
+        skip(ctx, 1);
         ch = peekch(ctx);
         if (ch == '+' || ch == '-') {
-            readch(ctx);
+            skip(ctx, 1);
+        }
+        if (digits(ctx) == 0) {
+            parse_error(ctx, ctx->i, "Expected number after exponent");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Number conversion. Most numbers in data resources are integers or
+ * short decimals, and for those the digits and the power of ten are
+ * both exact as doubles, so one multiplication or division rounds
+ * the value correctly (Clinger's fast path). Anything else goes to
+ * strtod. Where the compiler evaluates doubles in extra precision
+ * that one operation could round twice, so only integers take the
+ * fast path there. */
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD != 0
+#define NUMBER_FAST_FLOAT 0
+#else
+#define NUMBER_FAST_FLOAT 1
+#endif
+
+#define NUMBER_MAX_EXACT ((uint64_t)1 << 53)
+
+static const double exact_tens[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Converts the n bytes of number at s, which number_scan has vetted,
+ * returning 0 if it runs out of memory */
+static int
+number_value(MNCL_DATA_PARSE_CTX *ctx, const char *s, int n, double *value)
+{
+    const char *p = s, *end = s + n;
+    uint64_t w = 0;
+    int negative = 0, digits = 0, exact = 1, scale = 0, exponent = 0;
+    char *copy, *point;
+    if (*p == '-') {
+        negative = 1;
+        ++p;
+    }
+    /* Up to 19 significant digits fit in w */
+    for (; p < end && isdigit(*p); ++p) {
+        if (digits < 19) {
+            w = w * 10 + (*p - '0');
+            digits += (w != 0);
+        } else {
+            exact = 0;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && isdigit(*p); ++p) {
+            if (digits < 19) {
+                w = w * 10 + (*p - '0');
+                digits += (w != 0);
+                --scale;
+            } else {
+                exact = 0;
+            }
+        }
+    }
+    if (p < end) {
+        int exponent_negative = 0;
+        if (*++p == '-' || *p == '+') {
+            exponent_negative = (*p++ == '-');
+        }
+        for (; p < end; ++p) {
+            if (exponent < 100000) {
+                exponent = exponent * 10 + (*p - '0');
+            }
         }
-        while (isdigit(peekch(ctx))) {
-            readch(ctx);
-            ++n;
+        scale += exponent_negative ? -exponent : exponent;
+    }
+    if (exact && w <= NUMBER_MAX_EXACT) {
+        double d = (double)w;
+        if (w == 0 || scale == 0) {
+            *value = negative ? -d : d;
+            return 1;
+        }
+#if NUMBER_FAST_FLOAT
+        /* Digits to spare let a larger power of ten be split, the
+         * rest going into w while it stays exact */
+        while (scale > 22 && w <= NUMBER_MAX_EXACT / 10) {
+            w *= 10;
+            --scale;
+        }
+        d = (double)w;
+        if (scale > 0 && scale <= 22) {
+            *value = negative ? -(d * exact_tens[scale]) : d * exact_tens[scale];
+            return 1;
+        } else if (scale < 0 && scale >= -22) {
+            *value = negative ? -(d / exact_tens[-scale]) : d / exact_tens[-scale];
+            return 1;
+        }
+#endif
+    }
+    /* strtod wants a terminated string, and reads the decimal point
+     * of the current locale */
+    if (!scratch_reserve(ctx, n + 1)) {
+        return 0;
+    }
+    copy = ctx->scratch + ctx->top;
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    point = strchr(copy, '.');
+    if (point) {
+        *point = *localeconv()->decimal_point;
+    }
+    *value = strtod(copy, NULL);
+    return 1;
+}
+
+/* The value of the number at s, which number_scan has vetted and the
+ * cursor has just passed */
+static MNCL_DATA *
+number(MNCL_DATA_PARSE_CTX *ctx, const char *s)
+{
+    MNCL_DATA *result;
+    double value;
+    int n = (int)(ctx->s + ctx->i - s);
+    if (ctx->events) {
+        if (!ctx->events->number) {
+            return &event_ok;
         }
-        if (n == 0) {
-            snprintf(error_str, 512, "%d:%d: Expected number after exponent", ctx->line, ctx->col);
+        if (!number_value(ctx, s, n, &value)) {
             return NULL;
         }
+        return event_result(ctx, ctx->events->number(ctx->user, value));
     }
-    if (scan) {
-        return mncl_data_ok;
+    if (!number_value(ctx, s, n, &value)) {
+        return NULL;
     }
-    result = (MNCL_DATA *)malloc(sizeof(MNCL_DATA));
+    result = data_node(ctx->arena, MNCL_DATA_NUMBER, sizeof(MNCL_DATA));
     if (!result) {
-        snprintf(error_str, 512, "%d:%d: Out of memory", ctx->line, ctx->col);
+        parse_error(ctx, ctx->i, "Out of memory");
         return NULL;
     }
-    result->tag = MNCL_DATA_NUMBER;
-    result->value.number = strtod(s, NULL);
+    result->value.number = value;
     return result;
 }
 
@@ -297,7 +874,7 @@ hex_decode(MNCL_DATA_PARSE_CTX *ctx)
         } else if (c >= 'a' && c <= 'f') {
             hexit = c - 'a' + 10;
         } else {
-            snprintf(error_str, 512, "%d:%d: Expected hex digit", ctx->line, ctx->col);
+            parse_error(ctx, ctx->i, "Expected hex digit");
             return -1;
         }
         result = result * 16 + hexit;
@@ -305,398 +882,1751 @@ hex_decode(MNCL_DATA_PARSE_CTX *ctx)
     return result;
 }
 
+/* Decodes the string at the cursor, returning its length (or -1 on
+ * error) and pointing *text at the result, which is not
+ * null-terminated. Text with no escapes in it is left where it is in
+ * the input; anything else is decoded onto the top of the scratch
+ * stack, without being pushed. */
 static int
-mncl_data_str_size(MNCL_DATA_PARSE_CTX *ctx_orig, int scan)
+mncl_data_str_decode(MNCL_DATA_PARSE_CTX *ctx, const char **text)
 {
-    /* We don't want to alter the context here, so we make a copy */
-    MNCL_DATA_PARSE_CTX ctx = *ctx_orig;
-    int c = readch(&ctx);
-    int result = 0;
+    int first = ctx->i, c = readch(ctx);
+    int result = 0, start = ctx->i, copying = 0;
 
     if (c != '\"') {
-        snprintf(error_str, 512, "%d:%d: Expected string", ctx.line, ctx.col);
+        parse_error(ctx, ctx->i, "Expected string");
         return -1;
     }
     while(1) {
-        c = readch(&ctx);
+        char *dst;
+        int ch;
+        size_t run = plain_run(ctx);
+        if (run) {
+            if (copying) {
+                if (!scratch_reserve(ctx, result + run)) {
+                    return -1;
+                }
+                memcpy(ctx->scratch + ctx->top + result, ctx->s + ctx->i, run);
+            }
+            result += run;
+            skip(ctx, run);
+        }
+        c = readch(ctx);
         if (c == 10) {
-            snprintf(error_str, 512, "%d:%d: Unterminated string constant", ctx_orig->line, ctx_orig->col);
+            parse_error(ctx, first, "Unterminated string constant");
             return -1;
         }
         if (c < 32) {
-            snprintf(error_str, 512, "%d:%d: Illegal string character", ctx.line, ctx.col);
+            parse_error(ctx, ctx->i, "Illegal string character");
             return -1;
         }
         if (c == '\"') {
-            if (scan) {
-                *ctx_orig = ctx;
-            }
+            *text = copying ? ctx->scratch + ctx->top : ctx->s + start;
             return result;
-        } else if (c == '\\') {
-            c = readch(&ctx);
-            if (c < 32) {
-                snprintf(error_str, 512, "%d:%d: Unterminated string constant", ctx_orig->line, ctx_orig->col);
-                return -1;
-            } else {
-                int ch;
-                switch(c) {
-                case 'u':
-                    ch = hex_decode(&ctx);
-                    if (ch < 0) {
-                        return -1;
-                    } else if (ch == 0) {
-                        snprintf(error_str, 512, "%d:%d: NULL character in string", ctx.line, ctx.col);
-                        return -1;
-                    } else if (ch < 0x80) {
-                        result += 1;
-                    } else if (ch < 0x800) {
-                        result += 2;
-                    } else {
-                        result += 3;
-                    }
-                    break;
-                case '\"':
-                case '\\':
-                case '/':
-                case 'b':
-                case 'f':
-                case 'n':
-                case 'r':
-                case 't':
-                    result += 1;
-                    break;
-                default:
-                    snprintf(error_str, 512, "%d:%d: Illegal string escape '%c'", ctx.line, ctx.col, c);
+        }
+        if (c != '\\') {
+            if (copying) {
+                if (!scratch_reserve(ctx, result + 1)) {
                     return -1;
                 }
+                ctx->scratch[ctx->top + result] = c;
             }
-        } else {
             result += 1;
+            continue;
         }
-    }
-    return result;
-}
-
-/* The buffer dst must have been pre-sized by a call to
- * mncl_data_str_size. This function returns 0 on failure, >= 0 on
- * success. */
-static int
-mncl_data_strcpy(char *dst, MNCL_DATA_PARSE_CTX *ctx) {
-    int c = readch(ctx); /* Skip the leading quote */
-    while(1) {
+        /* No escape decodes to more than three bytes */
+        if (!scratch_reserve(ctx, result + 3)) {
+            return -1;
+        }
+        if (!copying) {
+            /* Everything so far was plain, so it's all still in place */
+            memcpy(ctx->scratch + ctx->top, ctx->s + start, result);
+            copying = 1;
+        }
+        dst = ctx->scratch + ctx->top + result;
         c = readch(ctx);
-        if (c == '\"') {
-            *dst++ = '\0';
-            return 1;
-        } else if (c == '\\') {
-            int ch;
-            c = readch(ctx);
-            switch(c) {
-            case 'u':
-                ch = hex_decode(ctx);
-                if (ch < 0) {
-                    return 0;
-                } else if (ch < 0x80) {
-                    *dst++ = ch;
-                } else if (ch < 0x800) {
-                    *dst++ = (((ch >> 6) & 0xff) | 0xC0);
-                    *dst++ = (ch & 0x3f) | 0x80;
-                } else {
-                    *dst++ = (((ch >> 12) & 0xff) | 0xe0);
-                    *dst++ = ((ch >> 6) & 0x3f) | 0x80;
-                    *dst++ = (ch & 0x3f) | 0x80;
-                }
-                break;
-            case '\"':
-            case '\\':
-            case '/':
-                *dst++ = c;
-                break;
-            case 'b':
-                *dst++ = '\b';
-                break;
-            case 'f':
-                *dst++ = '\f';
-                break;
-            case 'n':
-                *dst++ = '\n';
-                break;
-            case 'r':
-                *dst++ = '\r';
-                break;
-            case 't':
-                *dst++ = '\t';
-                break;
-            default:
-                snprintf(error_str, 512, "%d:%d: Illegal string escape '%c'", ctx->line, ctx->col, c);
-                return 0;
+        if (c < 32) {
+            parse_error(ctx, first, "Unterminated string constant");
+            return -1;
+        }
+        switch(c) {
+        case 'u':
+            ch = hex_decode(ctx);
+            if (ch < 0) {
+                return -1;
+            } else if (ch == 0) {
+                parse_error(ctx, ctx->i, "NULL character in string");
+                return -1;
+            } else if (ch < 0x80) {
+                dst[0] = ch;
+                result += 1;
+            } else if (ch < 0x800) {
+                dst[0] = (((ch >> 6) & 0xff) | 0xC0);
+                dst[1] = (ch & 0x3f) | 0x80;
+                result += 2;
+            } else {
+                dst[0] = (((ch >> 12) & 0xff) | 0xe0);
+                dst[1] = ((ch >> 6) & 0x3f) | 0x80;
+                dst[2] = (ch & 0x3f) | 0x80;
+                result += 3;
             }
-        } else {
-            *dst++ = c;
+            break;
+        case '\"':
+        case '\\':
+        case '/':
+            dst[0] = c;
+            result += 1;
+            break;
+        case 'b':
+            dst[0] = '\b';
+            result += 1;
+            break;
+        case 'f':
+            dst[0] = '\f';
+            result += 1;
+            break;
+        case 'n':
+            dst[0] = '\n';
+            result += 1;
+            break;
+        case 'r':
+            dst[0] = '\r';
+            result += 1;
+            break;
+        case 't':
+            dst[0] = '\t';
+            result += 1;
+            break;
+        default:
+            parse_error(ctx, ctx->i, "Illegal string escape '%c'", c);
+            return -1;
         }
     }
-    return 1;
 }
 
 static MNCL_DATA *
-string(MNCL_DATA_PARSE_CTX *ctx, int scan)
+string(MNCL_DATA_PARSE_CTX *ctx, const char *text, int sz)
 {
     MNCL_DATA_STRING_VALUE *result;
-    int sz = mncl_data_str_size(ctx, scan);
-    if (sz < 0) {
-        return NULL;
+    if (ctx->events) {
+        return event_result(ctx, !ctx->events->string || ctx->events->string(ctx->user, text, sz));
     }
-    if (scan) {
-        return mncl_data_ok;
-    }
-    result = malloc(sizeof(MNCL_DATA_STRING_VALUE) + sz + 1);
+    result = (MNCL_DATA_STRING_VALUE *)data_node(ctx->arena, MNCL_DATA_STRING, sizeof(MNCL_DATA_STRING_VALUE) + sz + 1);
     if (!result) {
-        snprintf(error_str, 512, "%d:%d: Out of memory", ctx->line, ctx->col);
+        parse_error(ctx, ctx->i, "Out of memory");
         return NULL;
     }
+    memcpy(result->str, text, sz);
     result->str[sz] = '\0';
-    if (mncl_data_strcpy(result->str, ctx)) {
-        result->core.tag = MNCL_DATA_STRING;
-        result->core.value.string = result->str;
-        return (MNCL_DATA *)result;
+    result->core.value.string = result->str;
+    return (MNCL_DATA *)result;
+}
+
+/* Arrays and objects are parsed without recursion. Each one still
+ * open has a frame on the scratch stack, and its elements or members
+ * so far are piled up after the frame until it is closed. */
+typedef struct {
+    size_t parent;     /* Offset of the enclosing frame, or NO_FRAME */
+    MNCL_DATA *node;   /* The object being filled in */
+    MNCL_ATOM *key;    /* The key of the member being parsed */
+    unsigned int count; /* Elements or members so far */
+    int object;        /* Whether this is an object or an array */
+    int line, col;     /* Where an array began, for error messages */
+} MNCL_DATA_FRAME;
+
+#define NO_FRAME ((size_t)-1)
+
+static MNCL_DATA_FRAME *
+current_frame(MNCL_DATA_PARSE_CTX *ctx)
+{
+    return (MNCL_DATA_FRAME *)(ctx->scratch + ctx->frame);
+}
+
+/* Whether the cursor is at the end of what has arrived so far, with
+ * more input still to come */
+static int
+hungry(MNCL_DATA_PARSE_CTX *ctx)
+{
+    return !ctx->finished && ctx->i >= ctx->size;
+}
+
+/* Puts the cursor back at the start of a token that ran into the end
+ * of the input so far, so it can be parsed again once there's more.
+ * Whatever error the token seemed to have is forgotten. */
+static int
+token_rewind(MNCL_DATA_PARSE_CTX *ctx, int i)
+{
+    ctx->error.message[0] = '\0';
+    ctx->i = i;
+    return 0;
+}
+
+static int
+frame_open(MNCL_DATA_PARSE_CTX *ctx, int object, MNCL_DATA *node, int line, int col)
+{
+    MNCL_DATA_FRAME frame;
+    frame.parent = ctx->frame;
+    frame.node = node;
+    frame.key = NULL;
+    frame.count = 0;
+    frame.object = object;
+    frame.line = line;
+    frame.col = col;
+    if (!scratch_push(ctx, &frame, sizeof(frame))) {
+        return 0;
     }
-    free (result);
-    return NULL;
+    ctx->frame = ctx->top - sizeof(frame);
+    return 1;
 }
 
-/* Array and Object need this forward decl */
-static MNCL_DATA *value(MNCL_DATA_PARSE_CTX *ctx, int scan);
+/* Pops the innermost frame, along with everything piled up after it */
+static void
+frame_close(MNCL_DATA_PARSE_CTX *ctx)
+{
+    size_t parent = current_frame(ctx)->parent;
+    ctx->top = ctx->frame;
+    ctx->frame = parent;
+}
 
-static MNCL_DATA *
-array(MNCL_DATA_PARSE_CTX *ctx, int scan)
-{
-    MNCL_DATA_ARRAY_VALUE *result = NULL;
-    int i, count = 0;
-    MNCL_DATA_PARSE_CTX start = *ctx;
-    int ch = readch(ctx);
-    if (ch != '[') {
-        snprintf(error_str, 512, "%d:%d: Expected '['", ctx->line, ctx->col);
-        return NULL;
+/* Hands a finished value to whatever it's part of */
+static int
+complete(MNCL_DATA_PARSE_CTX *ctx, MNCL_DATA *v)
+{
+    MNCL_DATA_FRAME *frame;
+    KEY_VALUE_PAIR pair;
+    if (ctx->frame == NO_FRAME) {
+        ctx->result = v;
+        ctx->state = PARSE_END;
+        return 1;
     }
-    space(ctx);
-    while (1) {
-        ch = peekch(ctx);
-        /* If we aren't just starting, we've just read a 'value',
-         * which strips trailing whitespace. The next character should
-         * be a ] or a , or the beginning of the first value. */
-        if (ch == ']') {
-            readch(ctx);
-            break;
-        } else if (ch == '\0') {
-            snprintf(error_str, 512, "%d:%d: Unterminated array", start.line, start.col);
-            return NULL;
-        }
-        if (count) {
-            if (ch != ',') {
-                snprintf(error_str, 512, "%d:%d: Expected ','", ctx->line, ctx->col);
-                return NULL;
-            }
-            readch(ctx);
+    frame = current_frame(ctx);
+    ++frame->count;
+    if (frame->object) {
+        ctx->state = PARSE_OBJECT_NEXT;
+        pair.key = frame->key;
+        pair.value = v;
+        if (ctx->events || scratch_push(ctx, &pair, sizeof(pair))) {
+            return 1;
         }
-        if (!value(ctx, 1)) {
-            return NULL;
+    } else {
+        ctx->state = PARSE_ARRAY_NEXT;
+        if (ctx->events || scratch_push(ctx, &v, sizeof(v))) {
+            return 1;
         }
-        ++count;
     }
-    if (scan) {
-        return mncl_data_ok;
+    mncl_free_data(v);
+    return 0;
+}
+
+static MNCL_DATA *
+array_close(MNCL_DATA_PARSE_CTX *ctx)
+{
+    MNCL_DATA_FRAME *frame = current_frame(ctx);
+    MNCL_DATA_ARRAY_VALUE *result;
+    unsigned int count = frame->count;
+    if (ctx->events) {
+        frame_close(ctx);
+        return event_result(ctx, !ctx->events->end_array || ctx->events->end_array(ctx->user));
     }
-    result = malloc(sizeof(MNCL_DATA_ARRAY_VALUE) + (sizeof (MNCL_DATA *) * count));
+    result = (MNCL_DATA_ARRAY_VALUE *)data_node(ctx->arena, MNCL_DATA_ARRAY, sizeof(MNCL_DATA_ARRAY_VALUE) + (sizeof (MNCL_DATA *) * count));
     if (!result) {
-        snprintf(error_str, 512, "%d:%d: Out of memory", ctx->line, ctx->col);
+        parse_error(ctx, ctx->i, "Out of memory");
         return NULL;
     }
-    /* This is kind of copy-pastey. We might better served with a
-     * split like when parsing strings. */
-    *ctx = start;
-    readch(ctx); /* Consume the '[' */
-    result->core.tag = MNCL_DATA_ARRAY;
     result->core.value.array.size = count;
     result->core.value.array.data = result->array;
-    for (i = 0; i < count; ++i) {
-        result->array[i] = NULL;
-    }
-    space(ctx);
-    i = 0;
-    while (1) {
-        ch = peekch(ctx);
-        /* If we aren't just starting, we've just read a 'value',
-         * which strips trailing whitespace. The next character should
-         * be a ] or a , or the beginning of the first value. */
-        if (ch == ']') {
-            readch(ctx);
-            break;
-        } else if (ch == '\0') {
-            snprintf(error_str, 512, "%d:%d: Unterminated array", start.line, start.col);
-            return NULL;
-        }
-        if (i) {
-            if (ch != ',') {
-                snprintf(error_str, 512, "%d:%d: Expected ','", ctx->line, ctx->col);
-                return NULL;
-            }
-            readch(ctx);
-        }
-        result->array[i] = value(ctx, 0);
-        if (!result->array[i]) {
-            /* This should really only happen if we run out of memory
-             * partway through; any malformed JSON objects should be
-             * caught by the sizing scan above. */
-            mncl_free_data((MNCL_DATA *)result);
-            return NULL;
-        }
-        ++i;
+    if (count) {
+        memcpy(result->array, ctx->scratch + ctx->frame + sizeof(MNCL_DATA_FRAME), count * sizeof(MNCL_DATA *));
     }
+    frame_close(ctx);
     return (MNCL_DATA *)result;
 }
 
 static MNCL_DATA *
-object(MNCL_DATA_PARSE_CTX *ctx, int scan)
+object_close(MNCL_DATA_PARSE_CTX *ctx)
 {
-    MNCL_DATA *result = mncl_data_ok;
-    int first = 1, ch = readch(ctx);
-    if (ch != '{') {
-        snprintf(error_str, 512, "%d:%d: Out of memory", ctx->line, ctx->col);
-        return NULL;
+    MNCL_DATA_FRAME *frame = current_frame(ctx);
+    MNCL_DATA *result = frame->node;
+    /* Members are handed to the map all at once, so that the usual
+     * sorted-ish input builds in linear time */
+    KEY_VALUE_PAIR *pairs = (KEY_VALUE_PAIR *)(ctx->scratch + ctx->frame + sizeof(MNCL_DATA_FRAME));
+    unsigned int count = frame->count;
+    if (ctx->events) {
+        frame_close(ctx);
+        return event_result(ctx, !ctx->events->end_object || ctx->events->end_object(ctx->user));
     }
-    if (!scan) {
-        result = (MNCL_DATA *)malloc(sizeof(MNCL_DATA));
-        if (!result) {
-            snprintf(error_str, 512, "%d:%d: Out of memory", ctx->line, ctx->col);
+    if (ctx->arena) {
+        result->value.object = arena_kv(ctx->arena, pairs, count);
+        if (!result->value.object) {
+            parse_error(ctx, ctx->i, "Out of memory");
             return NULL;
         }
-        result->tag = MNCL_DATA_OBJECT;
-        result->value.object = mncl_alloc_kv((MNCL_KV_DELETER)mncl_free_data);
+    } else if (count && !mncl_kv_build(result->value.object, pairs, count)) {
+        parse_error(ctx, ctx->i, "Out of memory");
+        return NULL;
+    }
+    frame_close(ctx);
+    return result;
+}
+
+/* Frees everything a failed parse had built */
+static void
+abandon(MNCL_DATA_PARSE_CTX *ctx)
+{
+    while (ctx->frame != NO_FRAME) {
+        MNCL_DATA_FRAME *frame = current_frame(ctx);
+        char *p = ctx->scratch + ctx->frame + sizeof(MNCL_DATA_FRAME);
+        char *end = ctx->scratch + ctx->top;
+        if (frame->object) {
+            for (; p < end; p += sizeof(KEY_VALUE_PAIR)) {
+                mncl_free_data((MNCL_DATA *)((KEY_VALUE_PAIR *)p)->value);
+            }
+            mncl_free_data(frame->node);
+        } else {
+            for (; p < end; p += sizeof(MNCL_DATA *)) {
+                mncl_free_data(*(MNCL_DATA **)p);
+            }
+        }
+        frame_close(ctx);
     }
+    mncl_free_data(ctx->result);
+    ctx->result = NULL;
+}
 
-    while (1) {
-        int keysize;
-        char *curkey = NULL;
-        MNCL_DATA *val;
+/* Parses the value starting with ch, or at least opens it if it's an
+ * array or object. Like the states in parse_run, this returns 1 if it
+ * got anywhere, 0 if it needs more input first, and -1 on error. */
+static int
+value(MNCL_DATA_PARSE_CTX *ctx, int ch)
+{
+    const MNCL_DATA_EVENTS *events = ctx->events;
+    int i = ctx->i, line = 0, col = 0, sz;
+    const char *text;
+    MNCL_DATA *result;
+    if (ch == '{') {
+        skip(ctx, 1);
+        if (events) {
+            if (events->begin_object && !events->begin_object(ctx->user)) {
+                event_result(ctx, 0);
+                return -1;
+            }
+            result = &event_ok;
+        } else {
+            result = data_node(ctx->arena, MNCL_DATA_OBJECT, sizeof(MNCL_DATA));
+            if (!result) {
+                parse_error(ctx, ctx->i, "Out of memory");
+                return -1;
+            }
+            /* Arena maps are laid out once the members are all in */
+            result->value.object = ctx->arena ? NULL : mncl_alloc_kv((MNCL_KV_DELETER)mncl_free_data);
+        }
+        if (!frame_open(ctx, 1, result, line, col)) {
+            mncl_free_data(result);
+            return -1;
+        }
+        ctx->state = PARSE_OBJECT_NEXT;
+        return 1;
+    } else if (ch == '[') {
+        position(ctx, i, &line, &col);
+        skip(ctx, 1);
+        if (events && events->begin_array && !events->begin_array(ctx->user)) {
+            event_result(ctx, 0);
+            return -1;
+        }
+        if (!frame_open(ctx, 0, NULL, line, col)) {
+            return -1;
+        }
+        ctx->state = PARSE_ARRAY_NEXT;
+        return 1;
+    } else if (ch == '\"') {
+        sz = mncl_data_str_decode(ctx, &text);
+        if (hungry(ctx)) {
+            return token_rewind(ctx, i);
+        }
+        if (sz < 0) {
+            return -1;
+        }
+        result = string(ctx, text, sz);
+    } else if (ch == '-' || isdigit(ch)) {
+        sz = number_scan(ctx);
+        if (hungry(ctx)) {
+            return token_rewind(ctx, i);
+        }
+        if (!sz) {
+            return -1;
+        }
+        result = number(ctx, ctx->s + i);
+    } else {
+        /* Enough to tell the words apart */
+        if (!ctx->finished && ctx->size - ctx->i < 5) {
+            return 0;
+        }
+        result = word(ctx);
+    }
+    if (!result || !complete(ctx, result)) {
+        return -1;
+    }
+    return 1;
+}
 
+/* Parses as much as it can of what has arrived. Returns 1 once the
+ * whole document is in, 0 if it needs more input, and -1 on error,
+ * after which everything built so far has been freed. */
+static int
+parse_run(MNCL_DATA_PARSE_CTX *ctx)
+{
+    while (ctx->state != PARSE_DONE) {
+        MNCL_DATA_FRAME *frame;
+        MNCL_DATA *result;
+        const char *key;
+        MNCL_ATOM *atom;
+        int ch, i, keysize, progress = 1;
+        if (ctx->state == PARSE_FAILED) {
+            return -1;
+        }
         space(ctx);
+        if (hungry(ctx)) {
+            return 0;
+        }
         ch = peekch(ctx);
-        if (ch == '}') {
-            readch(ctx);
+        switch (ctx->state) {
+        case PARSE_VALUE:
+            progress = value(ctx, ch);
             break;
-        }
-        if (first) {
-            first = 0;
-        } else {
-            if (ch != ',') {
-                if (!scan) {
-                    mncl_free_data(result);
+        case PARSE_ARRAY_NEXT:
+            frame = current_frame(ctx);
+            if (ch == ']') {
+                skip(ctx, 1);
+                result = array_close(ctx);
+                if (!result || !complete(ctx, result)) {
+                    progress = -1;
+                }
+            } else if (ch == '\0') {
+                error_set(&ctx->error, frame->line, frame->col, "Unterminated array");
+                progress = -1;
+            } else if (frame->count && ch != ',') {
+                parse_error(ctx, ctx->i, "Expected ','");
+                progress = -1;
+            } else {
+                if (frame->count) {
+                    skip(ctx, 1);
                 }
-                snprintf(error_str, 512, "%d:%d: Expected ':'", ctx->line, ctx->col);
-                return NULL;
+                ctx->state = PARSE_VALUE;
             }
-            readch(ctx);
-            space(ctx);
-        }
-        keysize = mncl_data_str_size(ctx, scan);
-        if (keysize < 0) {
-            if (!scan) {
-                mncl_free_data(result);
+            break;
+        case PARSE_OBJECT_NEXT:
+            frame = current_frame(ctx);
+            if (ch == '}') {
+                skip(ctx, 1);
+                result = object_close(ctx);
+                if (!result || !complete(ctx, result)) {
+                    progress = -1;
+                }
+            } else if (frame->count && ch != ',') {
+                parse_error(ctx, ctx->i, "Expected ':'");
+                progress = -1;
+            } else {
+                if (frame->count) {
+                    skip(ctx, 1);
+                }
+                ctx->state = PARSE_KEY;
             }
-            return NULL;
-        }
-        if (!scan) {
-            curkey = malloc(keysize + 1);
-            if (!curkey) {
-                mncl_free_data(result);
-                snprintf(error_str, 512, "%d:%d: Out of memory", ctx->line, ctx->col);
-                return NULL;
+            break;
+        case PARSE_KEY:
+            i = ctx->i;
+            keysize = mncl_data_str_decode(ctx, &key);
+            if (hungry(ctx)) {
+                return token_rewind(ctx, i);
             }
-            mncl_data_strcpy(curkey, ctx);
-        }
-        space(ctx);
-        ch = readch(ctx);
-        if (ch != ':') {
-            if (!scan) {
-                free(curkey);
-                mncl_free_data(result);
+            if (keysize < 0) {
+                progress = -1;
+            } else if (ctx->events) {
+                if (ctx->events->key && !ctx->events->key(ctx->user, key, keysize)) {
+                    event_result(ctx, 0);
+                    progress = -1;
+                }
+            } else {
+                /* Keys are interned, so the decoded text only needs
+                 * to live long enough to be looked up in the atom
+                 * table. */
+                atom = mncl_atom_n(key, keysize);
+                if (atom) {
+                    current_frame(ctx)->key = atom;
+                } else {
+                    parse_error(ctx, ctx->i, "Out of memory");
+                    progress = -1;
+                }
             }
-            snprintf(error_str, 512, "%d:%d: Expected ':'", ctx->line, ctx->col);
-            return NULL;
-        }
-        val = value(ctx, scan);
-        if (!val) {
-            if (!scan) {
-                free(curkey);
-                mncl_free_data(result);
+            ctx->state = PARSE_COLON;
+            break;
+        case PARSE_COLON:
+            if (readch(ctx) != ':') {
+                parse_error(ctx, ctx->i, "Expected ':'");
+                progress = -1;
             }
-            return NULL;
+            ctx->state = PARSE_VALUE;
+            break;
+        case PARSE_END:
+            if (ch) {
+                /* This seems mean-spirited */
+                parse_error(ctx, ctx->i, "Extra garbage after value");
+                progress = -1;
+            }
+            ctx->state = PARSE_DONE;
+            break;
+        }
+        if (progress < 0) {
+            abandon(ctx);
+            ctx->state = PARSE_FAILED;
+            return -1;
         }
-        if (!scan) {
-            mncl_kv_insert(result->value.object, curkey, val);
-            free(curkey);
+        if (!progress) {
+            return 0;
         }
     }
-    return result;
+    return 1;
+}
+
+static void
+parse_init(MNCL_DATA_PARSE_CTX *ctx, MNCL_DATA_ARENA *arena, const MNCL_DATA_EVENTS *events, void *user)
+{
+    ctx->s = "";
+    ctx->size = 0;
+    ctx->i = 0;
+    ctx->base = 0;
+    ctx->mark = ctx->mark_line = ctx->mark_nl = 0;
+    ctx->scratch = (char *)ctx->inline_scratch;
+    ctx->top = 0;
+    ctx->capacity = sizeof(ctx->inline_scratch);
+    ctx->arena = arena;
+    ctx->events = events;
+    ctx->user = user;
+    ctx->finished = 0;
+    ctx->state = PARSE_VALUE;
+    ctx->frame = NO_FRAME;
+    ctx->result = NULL;
+    ctx->error.line = ctx->error.column = 0;
+    ctx->error.message[0] = '\0';
+}
+
+static void
+parse_cleanup(MNCL_DATA_PARSE_CTX *ctx)
+{
+    if (ctx->scratch != (char *)ctx->inline_scratch) {
+        free(ctx->scratch);
+    }
 }
 
 static MNCL_DATA *
-value(MNCL_DATA_PARSE_CTX *ctx, int scan)
+parse_data(const char *data, size_t size, MNCL_DATA_ARENA *arena, const MNCL_DATA_EVENTS *events, void *user, MNCL_DATA_ERROR *error)
 {
-    int ch;
-    MNCL_DATA *result = NULL;
-    space(ctx);
-    ch = peekch(ctx);
-    switch (ch) {
-    case '{':
-        result = object(ctx, scan);
-        break;
-    case '[':
-        result = array(ctx, scan);
-        break;
-    case '-':
-        result = number(ctx, scan);
-        break;
-    case '\"':
-        result = string(ctx, scan);
-        break;
-    default:
-        if (isdigit(ch)) {
-            result = number(ctx, scan);
-        } else {
-            result = word(ctx, scan);
-        }
+    MNCL_DATA_PARSE_CTX ctx;
+    parse_init(&ctx, arena, events, user);
+    ctx.s = data;
+    ctx.size = size;
+    ctx.finished = 1;
+    parse_run(&ctx);
+    parse_cleanup(&ctx);
+    error_report(&ctx.error, error);
+    return ctx.result;
+}
+
+MNCL_DATA *
+mncl_parse_data_ex(const char *data, size_t size, int flags, MNCL_DATA_ERROR *error)
+{
+    MNCL_DATA *result;
+    MNCL_DATA_ARENA *arena;
+    MNCL_DATA_ERROR oom;
+    if (!(flags & MNCL_DATA_PARSE_ARENA)) {
+        return parse_data(data, size, NULL, NULL, NULL, error);
     }
-    space(ctx);
-    return result;
+    /* Parsed documents take up four to eight times the space of
+     * their text. Erring on the large side is cheap, since pages of a
+     * big allocation that are never touched are never really used. */
+    arena = arena_new(size * 8);
+    if (!arena) {
+        error_set(&oom, 0, 0, "Out of memory");
+        error_report(&oom, error);
+        return NULL;
+    }
+    result = parse_data(data, size, arena, NULL, NULL, error);
+    if (!result) {
+        arena_free(arena);
+        return NULL;
+    }
+    return arena_root(arena, result);
 }
 
 MNCL_DATA *
 mncl_parse_data(const char *data, size_t size)
 {
+    return mncl_parse_data_ex(data, size, 0, NULL);
+}
+
+MNCL_DATA *
+mncl_parse_data_arena(const char *data, size_t size)
+{
+    return mncl_parse_data_ex(data, size, MNCL_DATA_PARSE_ARENA, NULL);
+}
+
+int
+mncl_parse_data_events(const char *data, size_t size, const MNCL_DATA_EVENTS *events, void *user)
+{
+    return parse_data(data, size, NULL, events, user, NULL) != NULL;
+}
+
+/* Push parsing. Input is parsed straight out of each piece as it's
+ * fed in, except for a token cut off by the end of a piece: that much
+ * is kept in pending and parsed again once the rest of it arrives. */
+struct mncl_data_parser {
     MNCL_DATA_PARSE_CTX ctx;
-    MNCL_DATA *result;
-    ctx.s = data;
-    ctx.size = size;
-    ctx.i = 0;
-    ctx.line = ctx.col = 0;
+    char *pending;   /* When ctx.s is this, it holds the unparsed
+                      * input, null-terminated */
+    size_t capacity; /* The allocated size of pending */
+};
+
+/* Lets go of the part of s that has been parsed, once position has
+ * counted the newlines in it */
+static void
+parser_discard(MNCL_DATA_PARSE_CTX *ctx)
+{
+    int line, col;
+    position(ctx, ctx->i, &line, &col);
+    ctx->base += ctx->i;
+    ctx->s += ctx->i;
+    ctx->size -= ctx->i;
+    ctx->i = 0;
+}
+
+/* Moves the unparsed input into pending, followed by size bytes of
+ * data */
+static int
+parser_keep(MNCL_DATA_PARSER *parser, const char *data, size_t size)
+{
+    MNCL_DATA_PARSE_CTX *ctx = &parser->ctx;
+    size_t left;
+    parser_discard(ctx);
+    left = ctx->size;
+    if (left + size + 1 > parser->capacity) {
+        size_t capacity = parser->capacity ? parser->capacity : 256;
+        char *grown;
+        while (capacity < left + size + 1) {
+            capacity *= 2;
+        }
+        grown = (char *)malloc(capacity);
+        if (!grown) {
+            parse_error(ctx, ctx->i, "Out of memory");
+            return 0;
+        }
+        memcpy(grown, ctx->s, left);
+        free(parser->pending);
+        parser->pending = grown;
+        parser->capacity = capacity;
+    } else {
+        memmove(parser->pending, ctx->s, left);
+    }
+    memcpy(parser->pending + left, data, size);
+    parser->pending[left + size] = '\0';
+    ctx->s = parser->pending;
+    ctx->i = 0;
+    ctx->size = left + size;
+    return 1;
+}
+
+static MNCL_DATA_PARSER *
+parser_new(MNCL_DATA_ARENA *arena)
+{
+    MNCL_DATA_PARSER *parser = (MNCL_DATA_PARSER *)malloc(sizeof(MNCL_DATA_PARSER));
     error_str[0] = error_str[511] = '\0';
-    result = value(&ctx, 0);
-    if (result && peekch(&ctx)) {
-        /* This seems mean-spirited */
-        mncl_free_data(result);
-        snprintf(error_str, 512, "%d:%d: Extra garbage after value", ctx.line, ctx.col);
+    if (!parser) {
+        snprintf(error_str, 512, "0:0: Out of memory");
         return NULL;
     }
-        
-    return result;
+    parse_init(&parser->ctx, arena, NULL, NULL);
+    parser->pending = NULL;
+    parser->capacity = 0;
+    return parser;
 }
 
-MNCL_DATA *
-mncl_data_lookup(MNCL_DATA *map, const char *key)
+MNCL_DATA_PARSER *
+mncl_data_parser_new(void)
 {
-    if (!map || map->tag != MNCL_DATA_OBJECT) {
+    return parser_new(NULL);
+}
+
+MNCL_DATA_PARSER *
+mncl_data_parser_new_arena(size_t size)
+{
+    MNCL_DATA_PARSER *parser;
+    MNCL_DATA_ARENA *arena = arena_new(size * 8);
+    if (!arena) {
+        snprintf(error_str, 512, "0:0: Out of memory");
         return NULL;
     }
-    return mncl_kv_find(map->value.object, key);
+    parser = parser_new(arena);
+    if (!parser) {
+        arena_free(arena);
+    }
+    return parser;
+}
+
+int
+mncl_data_parser_feed(MNCL_DATA_PARSER *parser, const char *data, size_t size)
+{
+    MNCL_DATA_PARSE_CTX *ctx = &parser->ctx;
+    while (size && ctx->state != PARSE_FAILED) {
+        size_t used = size;
+        if (ctx->i < ctx->size) {
+            /* Finish off the token that was cut off last time. Adding
+             * at least as much again as is already pending each time
+             * keeps reparsing a long token linear overall. */
+            size_t left = ctx->size - ctx->i;
+            used = left > 64 ? left : 64;
+            if (used > size) {
+                used = size;
+            }
+            if (!parser_keep(parser, data, used)) {
+                abandon(ctx);
+                ctx->state = PARSE_FAILED;
+                break;
+            }
+        } else {
+            parser_discard(ctx);
+            ctx->s = data;
+            ctx->size = size;
+        }
+        parse_run(ctx);
+        if (ctx->s == parser->pending && ctx->size - ctx->i <= used) {
+            /* Whatever is left is still in data, and is better parsed
+             * from there */
+            used -= ctx->size - ctx->i;
+            ctx->size = ctx->i;
+        }
+        data += used;
+        size -= used;
+    }
+    if (ctx->state != PARSE_FAILED && ctx->s != parser->pending && !parser_keep(parser, data, 0)) {
+        abandon(ctx);
+        ctx->state = PARSE_FAILED;
+    }
+    error_report(&ctx->error, NULL);
+    return ctx->state != PARSE_FAILED;
+}
+
+MNCL_DATA *
+mncl_data_parser_finish(MNCL_DATA_PARSER *parser)
+{
+    MNCL_DATA_PARSE_CTX *ctx = &parser->ctx;
+    MNCL_DATA *result;
+    ctx->finished = 1;
+    parse_run(ctx);
+    result = ctx->result;
+    parse_cleanup(ctx);
+    error_report(&ctx->error, NULL);
+    if (ctx->arena) {
+        if (result) {
+            result = arena_root(ctx->arena, result);
+        } else {
+            arena_free(ctx->arena);
+        }
+    }
+    free(parser->pending);
+    free(parser);
+    return result;
+}
+
+/* Binary documents. An image is a header, a table of nodes, a table
+ * of object members and a table of null-terminated strings, and
+ * refers to everything by its index or offset in those tables, so it
+ * can be loaded with no parsing at all and from anywhere in memory.
+ * All fields are little-endian:
+ *
+ *    "MNCLDATA", version, node count, member count, string bytes
+ *    node:   tag, a, b
+ *    member: key string offset, node index
+ *
+ * A node's a and b are the boolean, the low and high words of the
+ * number's bits, the string's offset, or the array's length and
+ * first element (or the object's member count and first member).
+ * Node 0 is the root, and every other node comes after its parent,
+ * with the elements and member values of each array or object side
+ * by side. */
+
+#define BINARY_MAGIC "MNCLDATA"
+#define BINARY_VERSION 1
+#define BINARY_HEADER 24
+#define BINARY_NODE 12
+#define BINARY_MEMBER 8
+
+static uint32_t
+binary_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+binary_put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+typedef struct {
+    unsigned char *nodes, *members;
+    char *strings;
+    size_t node_count, member_count, string_bytes;
+    size_t node_capacity, member_capacity, string_capacity;
+    MNCL_KV *keys;  /* Offsets of the keys written so far, plus one */
+    int failed;
+} MNCL_DATA_WRITER;
+
+/* Grows one of the writer's tables to hold n more items */
+static int
+writer_reserve(MNCL_DATA_WRITER *w, void *table, size_t *capacity, size_t used, size_t n, size_t item)
+{
+    unsigned char **t = (unsigned char **)table;
+    size_t grown = *capacity ? *capacity : 64;
+    unsigned char *p;
+    if (used + n <= *capacity) {
+        return 1;
+    }
+    while (grown < used + n) {
+        grown *= 2;
+    }
+    p = (unsigned char *)realloc(*t, grown * item);
+    if (!p) {
+        w->failed = 1;
+        return 0;
+    }
+    *t = p;
+    *capacity = grown;
+    return 1;
+}
+
+/* Adds a string to the string table, returning its offset */
+static uint32_t
+writer_string(MNCL_DATA_WRITER *w, const char *s)
+{
+    size_t n = strlen(s) + 1, offset = w->string_bytes;
+    if (!writer_reserve(w, &w->strings, &w->string_capacity, w->string_bytes, n, 1)) {
+        return 0;
+    }
+    memcpy(w->strings + offset, s, n);
+    w->string_bytes += n;
+    return (uint32_t)offset;
+}
+
+/* Keys repeat a great deal, so each is only written once */
+static uint32_t
+writer_key(MNCL_DATA_WRITER *w, const char *key)
+{
+    uintptr_t known = (uintptr_t)mncl_kv_find(w->keys, key);
+    uint32_t offset;
+    if (known) {
+        return (uint32_t)(known - 1);
+    }
+    offset = writer_string(w, key);
+    if (!w->failed && !mncl_kv_insert(w->keys, key, (void *)((uintptr_t)offset + 1))) {
+        w->failed = 1;
+    }
+    return offset;
+}
+
+/* Claims n consecutive nodes, returning the index of the first */
+static size_t
+writer_nodes(MNCL_DATA_WRITER *w, size_t n)
+{
+    size_t first = w->node_count;
+    if (!writer_reserve(w, &w->nodes, &w->node_capacity, w->node_count, n, BINARY_NODE)) {
+        return 0;
+    }
+    w->node_count += n;
+    return first;
+}
+
+static void writer_node(MNCL_DATA_WRITER *w, size_t index, MNCL_DATA *v);
+
+typedef struct {
+    MNCL_DATA_WRITER *w;
+    size_t member, node;
+} MNCL_DATA_WRITER_OBJECT;
+
+static void
+writer_member(const char *key, void *value, void *user)
+{
+    MNCL_DATA_WRITER_OBJECT *o = (MNCL_DATA_WRITER_OBJECT *)user;
+    uint32_t offset = writer_key(o->w, key);
+    unsigned char *member = o->w->members + o->member * BINARY_MEMBER;
+    binary_put_u32(member, offset);
+    binary_put_u32(member + 4, (uint32_t)o->node);
+    writer_node(o->w, o->node, (MNCL_DATA *)value);
+    ++o->member;
+    ++o->node;
+}
+
+/* Writes v as node index, along with everything under it */
+static void
+writer_node(MNCL_DATA_WRITER *w, size_t index, MNCL_DATA *v)
+{
+    uint32_t tag = v ? (uint32_t)v->tag : MNCL_DATA_NULL, a = 0, b = 0;
+    size_t i, first;
+    uint64_t bits;
+    if (w->failed) {
+        return;
+    }
+    switch (tag) {
+    case MNCL_DATA_NULL:
+        break;
+    case MNCL_DATA_BOOLEAN:
+        a = v->value.boolean ? 1 : 0;
+        break;
+    case MNCL_DATA_NUMBER:
+        memcpy(&bits, &v->value.number, sizeof(bits));
+        a = (uint32_t)bits;
+        b = (uint32_t)(bits >> 32);
+        break;
+    case MNCL_DATA_STRING:
+        a = writer_string(w, v->value.string);
+        break;
+    case MNCL_DATA_ARRAY:
+        a = (uint32_t)v->value.array.size;
+        first = writer_nodes(w, a);
+        b = (uint32_t)first;
+        for (i = 0; i < a; ++i) {
+            writer_node(w, first + i, v->value.array.data[i]);
+        }
+        break;
+    case MNCL_DATA_OBJECT:
+    {
+        MNCL_DATA_WRITER_OBJECT o;
+        a = mncl_kv_count(v->value.object);
+        b = (uint32_t)w->member_count;
+        if (!writer_reserve(w, &w->members, &w->member_capacity, w->member_count, a, BINARY_MEMBER)) {
+            return;
+        }
+        w->member_count += a;
+        o.w = w;
+        o.member = b;
+        o.node = writer_nodes(w, a);
+        mncl_kv_foreach(v->value.object, writer_member, &o);
+        break;
+    }
+    default:
+        w->failed = 1;
+        return;
+    }
+    if (!w->failed) {
+        unsigned char *node = w->nodes + index * BINARY_NODE;
+        binary_put_u32(node, tag);
+        binary_put_u32(node + 4, a);
+        binary_put_u32(node + 8, b);
+    }
+}
+
+void *
+mncl_data_save_binary(MNCL_DATA *data, size_t *size)
+{
+    MNCL_DATA_WRITER w;
+    unsigned char *image = NULL;
+    memset(&w, 0, sizeof(w));
+    w.keys = mncl_alloc_kv(NULL);
+    if (!w.keys) {
+        w.failed = 1;
+    }
+    writer_nodes(&w, 1);
+    writer_node(&w, 0, data);
+    if (!w.failed) {
+        *size = BINARY_HEADER + w.node_count * BINARY_NODE + w.member_count * BINARY_MEMBER + w.string_bytes;
+        image = (unsigned char *)malloc(*size);
+    }
+    if (image) {
+        unsigned char *p = image + BINARY_HEADER;
+        memcpy(image, BINARY_MAGIC, 8);
+        binary_put_u32(image + 8, BINARY_VERSION);
+        binary_put_u32(image + 12, (uint32_t)w.node_count);
+        binary_put_u32(image + 16, (uint32_t)w.member_count);
+        binary_put_u32(image + 20, (uint32_t)w.string_bytes);
+        memcpy(p, w.nodes, w.node_count * BINARY_NODE);
+        p += w.node_count * BINARY_NODE;
+        /* Documents without objects or strings never allocate these */
+        if (w.member_count) {
+            memcpy(p, w.members, w.member_count * BINARY_MEMBER);
+        }
+        p += w.member_count * BINARY_MEMBER;
+        if (w.string_bytes) {
+            memcpy(p, w.strings, w.string_bytes);
+        }
+    } else {
+        snprintf(error_str, 512, "Out of memory");
+    }
+    if (w.keys) {
+        mncl_free_kv(w.keys);
+    }
+    free(w.nodes);
+    free(w.members);
+    free(w.strings);
+    return image;
+}
+
+/* Whether offset starts a string that ends inside the string table */
+static int
+binary_string_ok(const char *strings, size_t string_bytes, uint32_t offset)
+{
+    return offset < string_bytes && memchr(strings + offset, '\0', string_bytes - offset) != NULL;
+}
+
+static MNCL_DATA *
+binary_error(const char *message)
+{
+    snprintf(error_str, 512, "Malformed binary data: %s", message);
+    return NULL;
+}
+
+MNCL_DATA *
+mncl_data_load_binary(const void *image, size_t size)
+{
+    const unsigned char *header = (const unsigned char *)image, *nodes, *members;
+    const char *strings;
+    size_t node_count, member_count, string_bytes, i, elements = 0, map_bytes = 0, widest = 0;
+    MNCL_DATA_ARENA *arena;
+    MNCL_DATA *built;
+    KEY_VALUE_PAIR *pairs;
+    char *text;
+    int failed = 0;
+
+    if (size < BINARY_HEADER || memcmp(header, BINARY_MAGIC, 8)) {
+        return binary_error("not a binary document");
+    }
+    if (binary_u32(header + 8) != BINARY_VERSION) {
+        return binary_error("unknown version");
+    }
+    node_count = binary_u32(header + 12);
+    member_count = binary_u32(header + 16);
+    string_bytes = binary_u32(header + 20);
+    if (node_count < 1 || node_count > (size - BINARY_HEADER) / BINARY_NODE ||
+        member_count > (size - BINARY_HEADER - node_count * BINARY_NODE) / BINARY_MEMBER ||
+        string_bytes != size - BINARY_HEADER - node_count * BINARY_NODE - member_count * BINARY_MEMBER) {
+        return binary_error("wrong size");
+    }
+    nodes = header + BINARY_HEADER;
+    members = nodes + node_count * BINARY_NODE;
+    strings = (const char *)(members + member_count * BINARY_MEMBER);
+
+    /* Check every reference before building anything, and total up
+     * what the arena will need */
+    for (i = 0; i < node_count; ++i) {
+        const unsigned char *node = nodes + i * BINARY_NODE;
+        uint32_t a = binary_u32(node + 4), b = binary_u32(node + 8), j;
+        switch (binary_u32(node)) {
+        case MNCL_DATA_NULL:
+        case MNCL_DATA_BOOLEAN:
+        case MNCL_DATA_NUMBER:
+            break;
+        case MNCL_DATA_STRING:
+            if (!binary_string_ok(strings, string_bytes, a)) {
+                return binary_error("bad string");
+            }
+            break;
+        case MNCL_DATA_ARRAY:
+            if (a > INT_MAX || b <= i || b > node_count || a > node_count - b) {
+                return binary_error("bad array");
+            }
+            elements += ARENA_ALIGN(a * sizeof(MNCL_DATA *));
+            break;
+        case MNCL_DATA_OBJECT:
+            if (b > member_count || a > member_count - b) {
+                return binary_error("bad object");
+            }
+            for (j = b; j < b + a; ++j) {
+                uint32_t value = binary_u32(members + j * BINARY_MEMBER + 4);
+                if (!binary_string_ok(strings, string_bytes, binary_u32(members + j * BINARY_MEMBER)) ||
+                    value <= i || value >= node_count) {
+                    return binary_error("bad object member");
+                }
+            }
+            map_bytes += ARENA_ALIGN(sizeof(MNCL_KV)) + ARENA_ALIGN(kv_frozen_size(a));
+            widest = a > widest ? a : widest;
+            break;
+        default:
+            return binary_error("bad tag");
+        }
+    }
+
+    /* Everything fits in one chunk: the nodes side by side, then the
+     * array elements and maps, then the strings in one piece */
+    arena = arena_new(node_count * sizeof(MNCL_DATA) + elements + map_bytes + string_bytes + 64);
+    pairs = (KEY_VALUE_PAIR *)malloc(widest * sizeof(KEY_VALUE_PAIR) + 1);
+    built = arena ? (MNCL_DATA *)arena_alloc(arena, node_count * sizeof(MNCL_DATA)) : NULL;
+    text = built ? (char *)arena_alloc(arena, string_bytes + 1) : NULL;
+    if (!text || !pairs) {
+        free(pairs);
+        if (arena) {
+            arena_free(arena);
+        }
+        snprintf(error_str, 512, "Out of memory");
+        return NULL;
+    }
+    memcpy(text, strings, string_bytes);
+    for (i = 0; !failed && i < node_count; ++i) {
+        const unsigned char *node = nodes + i * BINARY_NODE;
+        uint32_t a = binary_u32(node + 4), b = binary_u32(node + 8), j;
+        uint64_t bits;
+        MNCL_DATA *v = &built[i];
+        v->tag = (MNCL_DATA_TYPE)binary_u32(node);
+        v->flags = MNCL_DATA_IN_ARENA;
+        switch (v->tag) {
+        case MNCL_DATA_NULL:
+            break;
+        case MNCL_DATA_BOOLEAN:
+            v->value.boolean = a != 0;
+            break;
+        case MNCL_DATA_NUMBER:
+            bits = ((uint64_t)b << 32) | a;
+            memcpy(&v->value.number, &bits, sizeof(bits));
+            break;
+        case MNCL_DATA_STRING:
+            v->value.string = text + a;
+            break;
+        case MNCL_DATA_ARRAY:
+            v->value.array.size = (int)a;
+            v->value.array.data = (MNCL_DATA **)arena_alloc(arena, a * sizeof(MNCL_DATA *));
+            if (!v->value.array.data) {
+                failed = 1;
+                break;
+            }
+            for (j = 0; j < a; ++j) {
+                v->value.array.data[j] = &built[b + j];
+            }
+            break;
+        case MNCL_DATA_OBJECT:
+            for (j = 0; !failed && j < a; ++j) {
+                const unsigned char *member = members + (b + j) * BINARY_MEMBER;
+                pairs[j].key = mncl_atom(text + binary_u32(member));
+                pairs[j].value = &built[binary_u32(member + 4)];
+                failed = !pairs[j].key;
+            }
+            v->value.object = failed ? NULL : arena_kv(arena, pairs, a);
+            failed = !v->value.object;
+            break;
+        default:
+            break;
+        }
+    }
+    free(pairs);
+    if (failed) {
+        arena_free(arena);
+        snprintf(error_str, 512, "Out of memory");
+        return NULL;
+    }
+    return arena_root(arena, &built[0]);
+}
+
+MNCL_DATA *
+mncl_data_lookup(MNCL_DATA *map, const char *key)
+{
+    if (!map || map->tag != MNCL_DATA_OBJECT) {
+        return NULL;
+    }
+    return mncl_kv_find(map->value.object, key);
+}
+
+/* Writing. Text goes out through a window of bytes, w->p up to
+ * w->end: the unused end of the caller's buffer, which grows as it
+ * fills, or a chunk that is written to the file whenever it fills.
+ * Nothing is written or allocated per value; numbers and strings are
+ * formatted in place. */
+
+#define WRITE_CHUNK 4096
+#define WRITE_INDENT 4
+#define WRITE_MAX_PLACES 9
+
+typedef struct {
+    MNCL_DATA_BUFFER *buffer;
+    FILE *f;
+    char *p, *end;
+    int pretty, depth, first, failed;
+    char chunk[WRITE_CHUNK];
+} MNCL_DATA_TEXT_WRITER;
+
+#define TEXT_ROOM(w, n) ((size_t)((w)->end - (w)->p) >= (size_t)(n) || text_room((w), (n)))
+
+/* Makes room for n more bytes, n being at most WRITE_CHUNK. A buffer
+ * always keeps one more byte spare, for the terminator. */
+static int
+text_room(MNCL_DATA_TEXT_WRITER *w, size_t n)
+{
+    if (w->failed) {
+        return 0;
+    }
+    if (w->f) {
+        size_t used = w->p - w->chunk;
+        if (used && fwrite(w->chunk, 1, used, w->f) != used) {
+            snprintf(error_str, 512, "Could not write data");
+            w->failed = 1;
+            return 0;
+        }
+        w->p = w->chunk;
+    } else {
+        MNCL_DATA_BUFFER *b = w->buffer;
+        size_t used = w->p - b->data, grown = b->capacity ? b->capacity : 256;
+        char *data;
+        while (grown < used + n + 1) {
+            grown *= 2;
+        }
+        data = (char *)realloc(b->data, grown);
+        if (!data) {
+            snprintf(error_str, 512, "Out of memory");
+            w->failed = 1;
+            return 0;
+        }
+        b->data = data;
+        b->capacity = grown;
+        w->p = data + used;
+        w->end = data + grown - 1;
+    }
+    return 1;
+}
+
+static void
+text_bytes(MNCL_DATA_TEXT_WRITER *w, const char *s, size_t n)
+{
+    while (n) {
+        size_t k = (n < WRITE_CHUNK) ? n : WRITE_CHUNK;
+        if (!TEXT_ROOM(w, k)) {
+            return;
+        }
+        memcpy(w->p, s, k);
+        w->p += k;
+        s += k;
+        n -= k;
+    }
+}
+
+static void
+text_char(MNCL_DATA_TEXT_WRITER *w, char c)
+{
+    if (TEXT_ROOM(w, 1)) {
+        *w->p++ = c;
+    }
+}
+
+/* Starts a new line at the current depth, if pretty printing */
+static void
+text_newline(MNCL_DATA_TEXT_WRITER *w)
+{
+    size_t n = (size_t)w->depth * WRITE_INDENT;
+    if (!w->pretty) {
+        return;
+    }
+    text_char(w, '\n');
+    while (n && TEXT_ROOM(w, 1)) {
+        size_t k = (size_t)(w->end - w->p);
+        k = (k < n) ? k : n;
+        memset(w->p, ' ', k);
+        w->p += k;
+        n -= k;
+    }
+}
+
+/* What follows the backslash when each byte is escaped, or 0 for
+ * bytes that go out as they are. The terminator is 1, so it ends a
+ * run too. */
+static const char text_escapes[256] = {
+    1,   'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0,   0,   '"', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   '\\', 0,  0,   0
+};
+
+static void
+text_string(MNCL_DATA_TEXT_WRITER *w, const char *s)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    text_char(w, '"');
+    for (;;) {
+        /* Copy as much as fits of the run up to the next escape */
+        char *out = w->p, *end = w->end;
+        char escape;
+        while (out < end && !text_escapes[*p]) {
+            *out++ = (char)*p++;
+        }
+        w->p = out;
+        escape = text_escapes[*p];
+        if (!escape) {
+            if (!text_room(w, WRITE_CHUNK)) {
+                return;
+            }
+            continue;
+        }
+        if (escape == 1 || !TEXT_ROOM(w, 6)) {
+            break;
+        }
+        *w->p++ = '\\';
+        *w->p++ = escape;
+        if (escape == 'u') {
+            *w->p++ = '0';
+            *w->p++ = '0';
+            *w->p++ = "0123456789abcdef"[*p >> 4];
+            *w->p++ = "0123456789abcdef"[*p & 15];
+        }
+        ++p;
+    }
+    text_char(w, '"');
+}
+
+static const char number_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Writes the text of x into out (which has room for 32 bytes),
+ * returning its length. The text is the shortest that reads back as
+ * exactly x. Integers and short decimals are found by scaling by
+ * powers of ten, which is exact when the scaled value divides back
+ * to x, just as number_value would read it; anything else is left
+ * to printf, trying more digits until strtod gives x back. JSON has
+ * no infinities or NaNs, so those are written as null. */
+static int
+number_text(char *out, double x)
+{
+    char digits[24], *p = out, *point;
+    uint64_t bits, m = 0;
+    double ax;
+    int n, places = -1, precision;
+    if (x != x || x - x != 0) {
+        memcpy(out, "null", 4);
+        return 4;
+    }
+    memcpy(&bits, &x, sizeof(bits));
+    ax = (bits >> 63) ? -x : x;
+    /* Below 2^53, the signed conversion is the quicker one */
+    if (ax < (double)NUMBER_MAX_EXACT && ax == (double)(int64_t)ax) {
+        places = 0;
+        m = (uint64_t)(int64_t)ax;
+    }
+#if NUMBER_FAST_FLOAT
+    for (n = 1; places < 0 && n <= WRITE_MAX_PLACES; ++n) {
+        double scaled = ax * exact_tens[n];
+        if (scaled >= (double)NUMBER_MAX_EXACT) {
+            break;
+        }
+        if (scaled == (double)(int64_t)scaled && scaled / exact_tens[n] == ax) {
+            places = n;
+            m = (uint64_t)(int64_t)scaled;
+        }
+    }
+#endif
+    if (places < 0) {
+        /* Below 15 digits, two numbers that differ are never the same
+         * double, except among the subnormals */
+        for (precision = (ax < DBL_MIN) ? 1 : 15; precision < 17; ++precision) {
+            snprintf(out, 32, "%.*g", precision, x);
+            if (strtod(out, NULL) == x) {
+                break;
+            }
+        }
+        if (precision == 17) {
+            snprintf(out, 32, "%.17g", x);
+        }
+        point = strchr(out, *localeconv()->decimal_point);
+        if (point) {
+            *point = '.';
+        }
+        return (int)strlen(out);
+    }
+    while (places > 0 && m % 10 == 0) {
+        m /= 10;
+        --places;
+    }
+    n = 0;
+    while (m >= 100) {
+        const char *pair = number_pairs + (m % 100) * 2;
+        digits[n++] = pair[1];
+        digits[n++] = pair[0];
+        m /= 100;
+    }
+    do {
+        digits[n++] = (char)('0' + m % 10);
+        m /= 10;
+    } while (m);
+    if (bits >> 63) {
+        *p++ = '-';
+    }
+    if (n <= places) {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', places - n);
+        p += places - n;
+        places = -1;
+    }
+    while (n) {
+        if (n-- == places) {
+            *p++ = '.';
+        }
+        *p++ = digits[n];
+    }
+    return (int)(p - out);
+}
+
+static void text_value(MNCL_DATA_TEXT_WRITER *w, MNCL_DATA *v);
+
+static void
+text_member(const char *key, void *value, void *user)
+{
+    MNCL_DATA_TEXT_WRITER *w = (MNCL_DATA_TEXT_WRITER *)user;
+    if (!w->first) {
+        text_char(w, ',');
+    }
+    text_newline(w);
+    text_string(w, key);
+    text_char(w, ':');
+    if (w->pretty) {
+        text_char(w, ' ');
+    }
+    text_value(w, (MNCL_DATA *)value);
+    w->first = 0;
+}
+
+static void
+text_value(MNCL_DATA_TEXT_WRITER *w, MNCL_DATA *v)
+{
+    int i;
+    if (w->failed) {
+        return;
+    }
+    switch (v ? v->tag : MNCL_DATA_NULL) {
+    case MNCL_DATA_BOOLEAN:
+        text_bytes(w, v->value.boolean ? "true" : "false", v->value.boolean ? 4 : 5);
+        break;
+    case MNCL_DATA_NUMBER:
+        if (TEXT_ROOM(w, 32)) {
+            w->p += number_text(w->p, v->value.number);
+        }
+        break;
+    case MNCL_DATA_STRING:
+        text_string(w, v->value.string);
+        break;
+    case MNCL_DATA_ARRAY:
+        text_char(w, '[');
+        if (v->value.array.size) {
+            ++w->depth;
+            for (i = 0; i < v->value.array.size; ++i) {
+                if (i) {
+                    text_char(w, ',');
+                }
+                text_newline(w);
+                text_value(w, v->value.array.data[i]);
+            }
+            --w->depth;
+            text_newline(w);
+        }
+        text_char(w, ']');
+        break;
+    case MNCL_DATA_OBJECT:
+        text_char(w, '{');
+        if (mncl_kv_count(v->value.object)) {
+            ++w->depth;
+            w->first = 1;
+            mncl_kv_foreach(v->value.object, text_member, w);
+            --w->depth;
+            text_newline(w);
+        }
+        text_char(w, '}');
+        break;
+    default:
+        text_bytes(w, "null", 4);
+        break;
+    }
+}
+
+/* Writes data in the form flags ask for */
+static void
+text_write(MNCL_DATA_TEXT_WRITER *w, MNCL_DATA *data, int flags)
+{
+    if (flags & MNCL_DATA_WRITE_BINARY) {
+        size_t size;
+        void *image = mncl_data_save_binary(data, &size);
+        if (!image) {
+            w->failed = 1;
+            return;
+        }
+        text_bytes(w, (const char *)image, size);
+        free(image);
+        return;
+    }
+    w->pretty = (flags & MNCL_DATA_WRITE_PRETTY) != 0;
+    w->depth = 0;
+    text_value(w, data);
+    if (w->pretty) {
+        text_char(w, '\n');
+    }
+}
+
+int
+mncl_write_data(MNCL_DATA *data, MNCL_DATA_BUFFER *buffer, int flags)
+{
+    MNCL_DATA_TEXT_WRITER w;
+    w.buffer = buffer;
+    w.f = NULL;
+    w.failed = 0;
+    w.p = buffer->data + buffer->size;
+    w.end = (buffer->capacity > buffer->size) ? buffer->data + buffer->capacity - 1 : w.p;
+    text_write(&w, data, flags);
+    if (!w.failed && !buffer->data) {
+        text_room(&w, 1);
+    }
+    if (w.failed) {
+        return 0;
+    }
+    *w.p = '\0';
+    buffer->size = w.p - buffer->data;
+    return 1;
+}
+
+int
+mncl_write_data_file(MNCL_DATA *data, FILE *f, int flags)
+{
+    MNCL_DATA_TEXT_WRITER w;
+    w.buffer = NULL;
+    w.f = f;
+    w.failed = 0;
+    w.p = w.chunk;
+    w.end = w.chunk + WRITE_CHUNK;
+    text_write(&w, data, flags);
+    return text_room(&w, WRITE_CHUNK);
+}
+
+/* Compiled paths. Each step keeps its key as an atom and, if it is
+ * all digits, as an array index too; which is used depends on what
+ * the step lands on. The hint is where the key was last found in a
+ * frozen map (see kv_find_atom_hinted). Lookups from several threads
+ * at once may overwrite each other's hints, which is harmless, as a
+ * hint is only ever a guess. */
+typedef struct {
+    MNCL_ATOM *key;
+    int index;
+    unsigned int hint;
+} MNCL_DATA_PATH_STEP;
+
+struct mncl_data_path {
+    int count;
+    MNCL_DATA_PATH_STEP steps[1];
+};
+
+MNCL_DATA_PATH *
+mncl_data_path_new(const char *path)
+{
+    MNCL_DATA_PATH *result;
+    const char *p;
+    int count = 1, i;
+    for (p = path; *p; ++p) {
+        count += (*p == '/');
+    }
+    result = (MNCL_DATA_PATH *)malloc(sizeof(MNCL_DATA_PATH) + (count - 1) * sizeof(MNCL_DATA_PATH_STEP));
+    if (!result) {
+        return NULL;
+    }
+    result->count = count;
+    for (i = 0, p = path; i < count; ++i) {
+        MNCL_DATA_PATH_STEP *step = &result->steps[i];
+        size_t len = strcspn(p, "/"), n;
+        step->key = mncl_atom_n(p, len);
+        step->index = (len > 0 && len < 10) ? 0 : -1;
+        step->hint = 0;
+        for (n = 0; n < len && step->index >= 0; ++n) {
+            step->index = isdigit((unsigned char)p[n]) ? step->index * 10 + (p[n] - '0') : -1;
+        }
+        if (!step->key) {
+            free(result);
+            return NULL;
+        }
+        p += len + 1;
+    }
+    return result;
+}
+
+MNCL_DATA *
+mncl_data_path_lookup(MNCL_DATA *data, MNCL_DATA_PATH *path)
+{
+    int i;
+    for (i = 0; data && i < path->count; ++i) {
+        MNCL_DATA_PATH_STEP *step = &path->steps[i];
+        if (data->tag == MNCL_DATA_OBJECT) {
+            data = (MNCL_DATA *)kv_find_atom_hinted(data->value.object, step->key, &step->hint);
+        } else if (data->tag == MNCL_DATA_ARRAY && step->index >= 0 && step->index < data->value.array.size) {
+            data = data->value.array.data[step->index];
+        } else {
+            return NULL;
+        }
+    }
+    return data;
+}
+
+void
+mncl_free_data_path(MNCL_DATA_PATH *path)
+{
+    free(path);
+}
+
+/* Sharing. A shared copy costs one small node, however big the
+ * document, and copies nothing until mncl_data_writable is asked for
+ * a node in it: then that node and every one above it that still
+ * belongs to the arena get private copies, each sharing all its
+ * other children. */
+
+/* The arena that doc's values belong to, if there is one */
+static MNCL_DATA_ARENA *
+shared_arena(MNCL_DATA *doc)
+{
+    if (doc->flags == MNCL_DATA_ARENA_ROOT) {
+        return (MNCL_DATA_ARENA *)doc;
+    }
+    if (doc->flags == MNCL_DATA_SHARED) {
+        return ((MNCL_DATA_SHARED_VALUE *)doc)->arena;
+    }
+    return NULL;
+}
+
+MNCL_DATA *
+mncl_data_share_part(MNCL_DATA *doc, MNCL_DATA *part)
+{
+    MNCL_DATA_ARENA *arena;
+    MNCL_DATA_SHARED_VALUE *result;
+    if (!part) {
+        return NULL;
+    }
+    arena = doc ? shared_arena(doc) : NULL;
+    if (!arena || !(DATA_IN_ARENA(part) ||
+                    (part == doc && !((MNCL_DATA_SHARED_VALUE *)doc)->own))) {
+        /* Nothing to share, so start a new arena to share from */
+        MNCL_DATA *copy = mncl_data_clone_arena(part);
+        if (!copy) {
+            return NULL;
+        }
+        result = (MNCL_DATA_SHARED_VALUE *)mncl_data_share_part(copy, copy);
+        mncl_free_data(copy);
+        return (MNCL_DATA *)result;
+    }
+    result = (MNCL_DATA_SHARED_VALUE *)malloc(sizeof(MNCL_DATA_SHARED_VALUE));
+    if (!result) {
+        return NULL;
+    }
+    __atomic_add_fetch(&arena->refs, 1, __ATOMIC_RELAXED);
+    result->core.tag = part->tag;
+    result->core.flags = MNCL_DATA_SHARED;
+    result->core.value = part->value;
+    result->arena = arena;
+    result->own = NULL;
+    return (MNCL_DATA *)result;
+}
+
+MNCL_DATA *
+mncl_data_share(MNCL_DATA *doc)
+{
+    return mncl_data_share_part(doc, doc);
+}
+
+static void
+writable_member(const char *key, void *value, void *user)
+{
+    MNCL_DATA_CLONE_CTX *ctx = (MNCL_DATA_CLONE_CTX *)user;
+    KEY_VALUE_PAIR *pair = &ctx->pairs[ctx->count++];
+    pair->key = mncl_atom(key);
+    pair->value = value;
+}
+
+/* A heap copy of src that shares src's children */
+static MNCL_DATA *
+writable_copy(MNCL_DATA *src)
+{
+    MNCL_DATA *dest;
+    MNCL_DATA_CLONE_CTX ctx;
+    if (src->tag == MNCL_DATA_ARRAY) {
+        MNCL_DATA_ARRAY_VALUE *array = (MNCL_DATA_ARRAY_VALUE *)data_node(NULL, src->tag, sizeof(MNCL_DATA_ARRAY_VALUE) + sizeof(MNCL_DATA *) * src->value.array.size);
+        if (array) {
+            array->core.value.array.size = src->value.array.size;
+            array->core.value.array.data = &array->array[0];
+            memcpy(array->array, src->value.array.data, sizeof(MNCL_DATA *) * src->value.array.size);
+        }
+        return (MNCL_DATA *)array;
+    }
+    if (src->tag != MNCL_DATA_OBJECT) {
+        return data_clone(src, NULL);
+    }
+    dest = data_node(NULL, src->tag, sizeof(MNCL_DATA));
+    ctx.count = 0;
+    ctx.arena = NULL;
+    ctx.pairs = (KEY_VALUE_PAIR *)malloc(mncl_kv_count(src->value.object) * sizeof(KEY_VALUE_PAIR) + 1);
+    if (dest) {
+        dest->value.object = mncl_alloc_kv((MNCL_KV_DELETER)mncl_free_data);
+    }
+    if (!dest || !dest->value.object || !ctx.pairs) {
+        if (dest && dest->value.object) {
+            mncl_free_kv(dest->value.object);
+        }
+        free(dest);
+        free(ctx.pairs);
+        return NULL;
+    }
+    mncl_kv_foreach(src->value.object, writable_member, &ctx);
+    if (ctx.count && !mncl_kv_build(dest->value.object, ctx.pairs, ctx.count)) {
+        mncl_free_kv(dest->value.object);
+        free(dest);
+        dest = NULL;
+    }
+    free(ctx.pairs);
+    return dest;
+}
+
+MNCL_DATA *
+mncl_data_writable(MNCL_DATA *doc, const char *path)
+{
+    MNCL_DATA_PATH *steps;
+    MNCL_DATA *node = doc;
+    int i;
+    if (!doc || DATA_IN_ARENA(doc)) {
+        return NULL;
+    }
+    if (doc->flags == MNCL_DATA_SHARED && !((MNCL_DATA_SHARED_VALUE *)doc)->own &&
+        (doc->tag == MNCL_DATA_ARRAY || doc->tag == MNCL_DATA_OBJECT)) {
+        MNCL_DATA *own = writable_copy(doc);
+        if (!own) {
+            return NULL;
+        }
+        ((MNCL_DATA_SHARED_VALUE *)doc)->own = own;
+        doc->value = own->value;
+    }
+    if (!*path) {
+        return doc;
+    }
+    steps = mncl_data_path_new(path);
+    if (!steps) {
+        return NULL;
+    }
+    for (i = 0; node && i < steps->count; ++i) {
+        MNCL_DATA_PATH_STEP *step = &steps->steps[i];
+        MNCL_DATA *child = NULL;
+        if (node->tag == MNCL_DATA_OBJECT) {
+            child = (MNCL_DATA *)kv_find_atom_hinted(node->value.object, step->key, &step->hint);
+        } else if (node->tag == MNCL_DATA_ARRAY && step->index >= 0 && step->index < node->value.array.size) {
+            child = node->value.array.data[step->index];
+        }
+        if (child && DATA_IN_ARENA(child)) {
+            MNCL_DATA *copy = writable_copy(child);
+            if (copy && node->tag == MNCL_DATA_ARRAY) {
+                node->value.array.data[step->index] = copy;
+            } else if (copy && !mncl_kv_insert_atom(node->value.object, step->key, copy)) {
+                mncl_free_data(copy);
+                copy = NULL;
+            }
+            child = copy;
+        }
+        node = child;
+    }
+    mncl_free_data_path(steps);
+    return node;
 }
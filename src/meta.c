@@ -2,6 +2,8 @@
 #include <SDL_mixer.h>
 #include "monocle.h"
 #include "monocle_internal.h"
+#include "atom.h"
+#include "epoch.h"
 
 void
 mncl_init(void)
@@ -23,8 +25,13 @@ void
 mncl_uninit()
 {
     mncl_unload_all_resources();
+    /* Retired resources still need SDL and the zip mappings to be
+     * destroyed, so they go now rather than in mncl_uninit_epochs */
+    mncl_epoch_reclaim();
     Mix_CloseAudio();
     Mix_Quit();
     SDL_Quit();
     mncl_uninit_raw_system();
+    mncl_uninit_epochs();
+    mncl_uninit_atoms();
 }
@@ -10,6 +10,13 @@ extern "C" {
 /* Raw */
 void mncl_uninit_raw_system(void);
 
+/* Passes a resource to sink a piece at a time as it is read (and
+ * inflated), so that it is never all in memory at once. Returns 0 if
+ * the resource couldn't be found or read. A sink may return 0 to stop
+ * early, which still counts as success. */
+typedef int (*MNCL_RAW_SINK)(const char *data, size_t size, void *user);
+int mncl_stream_raw(const char *resource, MNCL_RAW_SINK sink, void *user);
+
 /* Spritesheets */
 MNCL_SPRITESHEET *mncl_alloc_spritesheet(const char *resource_name);
 void mncl_free_spritesheet(MNCL_SPRITESHEET *spritesheet);
@@ -4,18 +4,40 @@
 #include "monocle.h"
 #include "monocle_internal.h"
 #include "tree.h"
+#include "btree.h"
+#include "atom.h"
 
-typedef struct struct_mncl_object_full {
-    MNCL_OBJECT object;
-    int depth;
-    MNCL_KIND *kind;
-} MNCL_OBJECT_FULL;
+typedef struct struct_mncl_object_full MNCL_OBJECT_FULL;
 
 typedef struct struct_mncl_object_node {
     TREE_NODE header;
     MNCL_OBJECT_FULL *obj;
 } MNCL_OBJECT_NODE;
 
+/* Kinds rarely have more than a handful of traits, so objects carry
+ * that many subscription links inline and only go to the heap for
+ * the rest. */
+#define INLINE_TRAIT_LINKS 4
+
+/* Every red-black tree an object can be in gets a link node embedded
+ * in the object itself, so joining and leaving trees never allocates
+ * and leaving never has to search. A link whose obj field is NULL is
+ * not currently in its tree. The master and render sets are B-trees
+ * of object pointers instead; see below. */
+struct struct_mncl_object_full {
+    MNCL_OBJECT object;
+    int depth;
+    MNCL_KIND *kind;
+    /* Set once the object is in pending_destruction. */
+    int doomed;
+    /* Set while the object is in renderable. */
+    int rendered;
+    MNCL_OBJECT_NODE creation_link, destruction_link, collision_link;
+    /* One link per entry in kind->traits, in the same order */
+    MNCL_OBJECT_NODE trait_links[INLINE_TRAIT_LINKS];
+    MNCL_OBJECT_NODE *extra_trait_links;
+};
+
 static int
 objcmp(TREE_NODE *a, TREE_NODE *b)
 {
@@ -26,14 +48,24 @@ objcmp(TREE_NODE *a, TREE_NODE *b)
     return (a_ < b_) ? -1 : ((a_ > b_) ? 1 : 0);
 }
 
+/* The same ordering, for the B-trees, which hold the objects
+ * themselves. */
+static int
+masterobjcmp(const void *a, const void *b)
+{
+    intptr_t a_ = (intptr_t)a;
+    intptr_t b_ = (intptr_t)b;
+    return (a_ < b_) ? -1 : ((a_ > b_) ? 1 : 0);
+}
+
 /* This is like objcmp, but it's for the rendering tree. Sort first by
  * the depth of the object, and only for objects of identical depth
  * should we compare pointers. */
 static int
-scenecmp(TREE_NODE *a, TREE_NODE *b)
+scenecmp(const void *a, const void *b)
 {
-    MNCL_OBJECT_FULL *a_obj = (MNCL_OBJECT_FULL *)((MNCL_OBJECT_NODE *)a)->obj;
-    MNCL_OBJECT_FULL *b_obj = (MNCL_OBJECT_FULL *)((MNCL_OBJECT_NODE *)b)->obj;
+    const MNCL_OBJECT_FULL *a_obj = (const MNCL_OBJECT_FULL *)a;
+    const MNCL_OBJECT_FULL *b_obj = (const MNCL_OBJECT_FULL *)b;
     int depth_diff = a_obj->depth - b_obj->depth;
     if (!depth_diff) {
         intptr_t a_ = (intptr_t)(&(a_obj->object));
@@ -47,9 +79,12 @@ scenecmp(TREE_NODE *a, TREE_NODE *b)
 }
 
 /* Master set of objects. This tree is the one that owns its object
- * pointers; all others free their node structures without freeing the
- * object contained therein. */
-static TREE master;
+ * pointers; all others just unlink the object without freeing it. The
+ * objects themselves come from object_pool. This and renderable are
+ * walked from end to end every frame, so they are B-trees, which
+ * keep their items in packed arrays instead of scattered nodes. */
+static BTREE master;
+static TREE_POOL object_pool;
 
 /* Objects that are pending creation or destruction. It is not safe to
  * create or destroy objects until the current set of iterations
@@ -63,17 +98,31 @@ static TREE pending_creation, pending_destruction;
 /* Objects that get drawn. It is not safe to alter the "depth" field
  * of any of these objects except via set_object_depth, which properly
  * keeps this structure sorted. It is not safe to alter the depth of
- * objects during the rendering phase. */
-static TREE renderable;
+ * objects during the rendering phase. Like the subscriber trees, this
+ * keeps order statistics (see btree_select) so it can be split into
+ * equal ranges. */
+static BTREE renderable;
 
 /* Master map of traits. Traits are immortal. The first time we
  * try to create or look up a trait, if this doesn't exist it will
  * be populated with the default traits. */
 
-/* These map the strings the user or config file give to integers. */
+/* These map the strings the user or config file give to integers.
+ * The keys are atoms, so the trait names themselves are immortal. */
 static MNCL_KV *traits = NULL;
 static intptr_t num_traits = 0;
 
+/* The built-in traits are always created first, in this order, so
+ * the engine never has to look them up by name. */
+enum {
+    TRAIT_INVISIBLE = 1,
+    TRAIT_PRE_INPUT,
+    TRAIT_PRE_PHYSICS,
+    TRAIT_PRE_RENDER,
+    TRAIT_RENDER,
+    TRAIT_COLLISION
+};
+
 /* These map the integers stored above back to the names, and also
  * to the objects that have that trait for efficient iteration */
 typedef struct mncl_subscriber_set {
@@ -85,6 +134,7 @@ static MNCL_SUBSCRIBER_SET *subscribers = NULL;
 
 /* The current point in whatever iteration we're doing */
 static TREE_NODE *current_iter = NULL;
+static BTREE_CURSOR render_iter;
 
 /* Collision iteration also requires us to track where we are in the
  * trait array and where we are in the iterated trait */
@@ -103,12 +153,12 @@ ensure_basic_traits(void)
     if (!traits) {
         traits = mncl_alloc_kv(NULL);
         num_traits = 0;
-        mncl_kv_insert(traits, "invisible", (void *)++num_traits);
-        mncl_kv_insert(traits, "pre-input", (void *)++num_traits);
-        mncl_kv_insert(traits, "pre-physics", (void *)++num_traits);
-        mncl_kv_insert(traits, "pre-render", (void *)++num_traits);
-        mncl_kv_insert(traits, "render", (void *)++num_traits);
-        mncl_kv_insert(traits, "collision", (void *)++num_traits);
+        mncl_kv_insert(traits, "invisible", (void *)(num_traits = TRAIT_INVISIBLE));
+        mncl_kv_insert(traits, "pre-input", (void *)(num_traits = TRAIT_PRE_INPUT));
+        mncl_kv_insert(traits, "pre-physics", (void *)(num_traits = TRAIT_PRE_PHYSICS));
+        mncl_kv_insert(traits, "pre-render", (void *)(num_traits = TRAIT_PRE_RENDER));
+        mncl_kv_insert(traits, "render", (void *)(num_traits = TRAIT_RENDER));
+        mncl_kv_insert(traits, "collision", (void *)(num_traits = TRAIT_COLLISION));
     }
 }
 
@@ -116,10 +166,11 @@ void
 initialize_object_trees(void)
 {
     /* TODO: Confirm that we're starting from a position of no traits */
-    master.root = NULL;
+    btree_init(&master);
     pending_creation.root = NULL;
     pending_destruction.root = NULL;
-    renderable.root = NULL;
+    btree_init(&renderable);
+    tree_pool_init(&object_pool, sizeof(MNCL_OBJECT_FULL));
     indexed_traits = 0;
     trait_capacity = 0;
     subscribers = NULL;
@@ -136,12 +187,23 @@ create_indexed_trait(const char *key, void *value, void *user)
         if (subscribers[trait_index].name == NULL) {
             subscribers[trait_index].name = key;
             subscribers[trait_index].objs.root = NULL;
+            subscribers[trait_index].objs.flags = TREE_ORDER_STATISTICS;
         }
     } else {
         fprintf(stderr, "Tried to index an unallocated trait #%d for \"%s\"\n", (int)trait_index, key);
     }
 }
 
+/* The subscription link for the i-th entry in obj's kind's traits */
+static MNCL_OBJECT_NODE *
+trait_link(MNCL_OBJECT_FULL *obj, int i)
+{
+    if (i < INLINE_TRAIT_LINKS) {
+        return &obj->trait_links[i];
+    }
+    return &obj->extra_trait_links[i - INLINE_TRAIT_LINKS];
+}
+
 /* This should really only be called after initialize_object_trees,
  * which should be automatic. */
 /* Process pending creation and destruction events. Resize or create
@@ -171,6 +233,7 @@ sync_object_trees(void)
         for (i = indexed_traits; i < trait_capacity; ++i) {
             subscribers[i].name = NULL;
             subscribers[i].objs.root = NULL;
+            subscribers[i].objs.flags = TREE_ORDER_STATISTICS;
         }
     }
     /* Do we need to create new trait categories? No already existing
@@ -191,89 +254,64 @@ sync_object_trees(void)
         while (n) {
             MNCL_OBJECT_FULL *obj = ((MNCL_OBJECT_NODE *)n)->obj;
             unsigned int *kind_traits = obj->kind->traits;
-            while (*kind_traits) {
-                if (*kind_traits < indexed_traits) {
-                    MNCL_OBJECT_NODE *new_node = (MNCL_OBJECT_NODE *)malloc(sizeof(MNCL_OBJECT_NODE));
-                    if (!new_node) {
-                        fprintf(stderr, "Heap exhaustion while organizing traits\n");
-                        abort();
-                    }
-                    new_node->obj = obj;
-                    tree_insert(&subscribers[*kind_traits].objs, (TREE_NODE *)new_node, objcmp);
+            int i;
+            for (i = 0; kind_traits[i]; ++i) {
+                if (kind_traits[i] < indexed_traits) {
+                    MNCL_OBJECT_NODE *link = trait_link(obj, i);
+                    link->obj = obj;
+                    tree_insert(&subscribers[kind_traits[i]].objs, (TREE_NODE *)link, objcmp);
                 } else {
-                    fprintf (stderr, "Target trait %d >= indexed trait count %d\n", *kind_traits, indexed_traits);
+                    fprintf (stderr, "Target trait %d >= indexed trait count %d\n", kind_traits[i], indexed_traits);
                 }
-                ++kind_traits;
             }
             /* Register for collisions if neccessary */
             if (obj->kind->collisions && *obj->kind->collisions) {
-                MNCL_OBJECT_NODE *new_node = (MNCL_OBJECT_NODE *)malloc(sizeof(MNCL_OBJECT_NODE));
-                if (!new_node) {
-                    fprintf(stderr, "Heap exhaustion while organizing traits\n");
-                    abort();
-                }
-                new_node->obj = obj;
-                tree_insert(&subscribers[mncl_get_trait("collision")].objs, (TREE_NODE *)new_node, objcmp);
+                obj->collision_link.obj = obj;
+                tree_insert(&subscribers[TRAIT_COLLISION].objs, (TREE_NODE *)&obj->collision_link, objcmp);
             }
             /* Register for rendering if necessary */
             if (obj->kind->visible) {
-                MNCL_OBJECT_NODE *new_node = malloc(sizeof(MNCL_OBJECT_NODE));
-                if (new_node) {
-                    new_node->obj = obj;
-                    tree_insert(&renderable, (TREE_NODE *)new_node, scenecmp);
-                }
+                obj->rendered = btree_insert(&renderable, obj, scenecmp);
             }
+            obj->creation_link.obj = NULL;
             n = tree_next(n);
         }
-        /* Now clear out the space we'd been using to set these
-         * up. The objects themselves live in "master" and so we don't
-         * have to do anything to the contents.*/
-        tree_postorder(&pending_creation, (TREE_VISITOR)free);
+        /* The links live in the objects, so there is nothing to free */
         pending_creation.root = NULL;
     }
     /* Process any newly destroyed objects, removing them from the
      * lists and cleaning up their memory. */
     if (pending_destruction.root) {
-        TREE_NODE *n = tree_minimum(&pending_destruction);
-        while (n) {
-            MNCL_OBJECT_NODE search_node;
-            TREE_NODE *found_node;
+        TREE_NODE *n;
+        /* Each link lives inside its object, so take it out of
+         * pending_destruction before the object goes back to the
+         * pool; walking on from it afterwards would read freed
+         * memory. */
+        while ((n = tree_minimum(&pending_destruction)) != NULL) {
             MNCL_OBJECT_FULL *obj = ((MNCL_OBJECT_NODE *)n)->obj;
             unsigned int *kind_traits = obj->kind->traits;
-            search_node.obj = obj;
+            int i;
+            tree_delete(&pending_destruction, n);
             /* Unsubscribe from all the traits */
-            while (*kind_traits) {
-                if (*kind_traits < indexed_traits) {
-                    found_node = tree_find(&subscribers[*kind_traits].objs, (TREE_NODE *)&search_node, objcmp);
-                    if (found_node) {
-                        tree_delete(&subscribers[*kind_traits].objs, found_node);
-                        free(found_node);
-                    }
+            for (i = 0; kind_traits[i]; ++i) {
+                MNCL_OBJECT_NODE *link = trait_link(obj, i);
+                if (link->obj) {
+                    tree_delete(&subscribers[kind_traits[i]].objs, (TREE_NODE *)link);
                 }
-                ++kind_traits;
             }
-            /* Remove from the display list */
-            found_node = tree_find(&renderable, (TREE_NODE *)&search_node, scenecmp);
-            if (found_node) {
-                tree_delete(&renderable, found_node);
-                free(found_node);
+            /* Leave the collision list, if the kind joined it */
+            if (obj->collision_link.obj) {
+                tree_delete(&subscribers[TRAIT_COLLISION].objs, (TREE_NODE *)&obj->collision_link);
             }
-
-            /* Now actually destroy the object proper, which is in the master tree */
-            found_node = tree_find(&master, (TREE_NODE *)&search_node, objcmp);
-            if (found_node) {
-                MNCL_OBJECT_NODE *obj_node = (MNCL_OBJECT_NODE *)found_node;
-                tree_delete(&master, found_node);
-                free(obj_node->obj);
-                free(found_node);
+            /* Remove from the display list */
+            if (obj->rendered) {
+                btree_delete(&renderable, obj, scenecmp);
             }
-            n = tree_next(n);
+            /* Now actually destroy the object proper */
+            btree_delete(&master, obj, masterobjcmp);
+            free(obj->extra_trait_links);
+            tree_pool_free(&object_pool, obj);
         }
-        /* Now clear out the space we'd been using to set these
-         * up. The objects themselves live in "master" and so we don't
-         * have to do anything to the contents.*/
-        tree_postorder(&pending_destruction, (TREE_VISITOR)free);
-        pending_destruction.root = NULL;
     }
 }
 
@@ -281,12 +319,13 @@ unsigned int
 mncl_get_trait(const char *trait)
 {
     intptr_t result;
+    MNCL_ATOM *name = mncl_atom(trait);
     ensure_basic_traits();
-    result = (intptr_t)mncl_kv_find(traits, trait);
+    result = (intptr_t)mncl_kv_find_atom(traits, name);
     if (result) {
         return (unsigned int)result;
     }
-    mncl_kv_insert(traits, trait, (void *)++num_traits);
+    mncl_kv_insert_atom(traits, name, (void *)++num_traits);
     return num_traits;
 }
 
@@ -301,51 +340,62 @@ mncl_uninit_traits(void)
 MNCL_OBJECT *
 mncl_create_object(float x, float y, const char *kind)
 {
-    MNCL_OBJECT_FULL *obj = malloc(sizeof(MNCL_OBJECT_FULL));
-    MNCL_OBJECT_NODE *node = malloc(sizeof(MNCL_OBJECT_NODE));
-    MNCL_OBJECT_NODE *node2 = malloc(sizeof(MNCL_OBJECT_NODE));
+    MNCL_OBJECT_FULL *obj;
     MNCL_KIND *k = mncl_kind_resource(kind);
-    if (obj && node && node2 && k) {
-        node->obj = obj;
-        node2->obj = obj;
-        tree_insert(&master, (TREE_NODE *)node, objcmp);
-        tree_insert(&pending_creation, (TREE_NODE *)node2, objcmp);
-        obj->object.x = x;
-        obj->object.y = y;
-        obj->object.f = 0;
-        obj->object.dx = k->dx;
-        obj->object.dx = k->dy;
-        obj->object.df = k->df;
-        obj->object.sprite = k->sprite;
-        obj->depth = k->depth;
-        obj->kind = k;
-    } else {
-        if (obj) {
-            free(obj);
-        }
-        if (node) {
-            free(node);
-        }
-        if (node2) {
-            free(node2);
-        }
-        if (!k) {
-            fprintf(stderr, "Unknown kind \"%s\"\n", kind);
+    int i, trait_count = 0;
+    if (!k) {
+        fprintf(stderr, "Unknown kind \"%s\"\n", kind);
+        return NULL;
+    }
+    obj = (MNCL_OBJECT_FULL *)tree_pool_alloc(&object_pool);
+    if (!obj) {
+        return NULL;
+    }
+    obj->extra_trait_links = NULL;
+    while (k->traits[trait_count]) {
+        ++trait_count;
+    }
+    if (trait_count > INLINE_TRAIT_LINKS) {
+        obj->extra_trait_links = (MNCL_OBJECT_NODE *)malloc(sizeof(MNCL_OBJECT_NODE) * (trait_count - INLINE_TRAIT_LINKS));
+        if (!obj->extra_trait_links) {
+            tree_pool_free(&object_pool, obj);
+            return NULL;
         }
+    }
+    for (i = 0; i < trait_count; ++i) {
+        trait_link(obj, i)->obj = NULL;
+    }
+    obj->object.x = x;
+    obj->object.y = y;
+    obj->object.f = 0;
+    obj->object.dx = k->dx;
+    obj->object.dx = k->dy;
+    obj->object.df = k->df;
+    obj->object.sprite = k->sprite;
+    obj->depth = k->depth;
+    obj->kind = k;
+    obj->doomed = 0;
+    obj->rendered = 0;
+    obj->collision_link.obj = NULL;
+    obj->destruction_link.obj = NULL;
+    obj->creation_link.obj = obj;
+    if (!btree_insert(&master, obj, masterobjcmp)) {
+        free(obj->extra_trait_links);
+        tree_pool_free(&object_pool, obj);
         return NULL;
     }
+    tree_insert(&pending_creation, (TREE_NODE *)&obj->creation_link, objcmp);
     return &(obj->object);
 }
 
 void
 mncl_destroy_object(MNCL_OBJECT *obj)
 {
-    if (obj) {
-        MNCL_OBJECT_NODE *node = malloc(sizeof(MNCL_OBJECT_NODE));
-        if (node) {
-            node->obj = (MNCL_OBJECT_FULL *)obj;
-            tree_insert(&pending_destruction, (TREE_NODE *)node, objcmp);
-        }
+    MNCL_OBJECT_FULL *o_full = (MNCL_OBJECT_FULL *)obj;
+    if (o_full && !o_full->doomed) {
+        o_full->doomed = 1;
+        o_full->destruction_link.obj = o_full;
+        tree_insert(&pending_destruction, (TREE_NODE *)&o_full->destruction_link, objcmp);
     }
 }
 
@@ -355,16 +405,15 @@ object_begin(MNCL_EVENT_TYPE which)
     /* sync_object_trees() will clear out pending_destruction so we
      * don't have to check it here like we do in object_next() */
     sync_object_trees();
-    /* TODO: Cache these results, maybe, for speed? */
     switch(which) {
     case MNCL_EVENT_PREINPUT:
-        current_iter = tree_minimum(&subscribers[mncl_get_trait("pre-input")].objs);
+        current_iter = tree_minimum(&subscribers[TRAIT_PRE_INPUT].objs);
         break;
     case MNCL_EVENT_PREPHYSICS:
-        current_iter = tree_minimum(&subscribers[mncl_get_trait("pre-physics")].objs);
+        current_iter = tree_minimum(&subscribers[TRAIT_PRE_PHYSICS].objs);
         break;
     case MNCL_EVENT_PRERENDER:
-        current_iter = tree_minimum(&subscribers[mncl_get_trait("pre-render")].objs);
+        current_iter = tree_minimum(&subscribers[TRAIT_PRE_RENDER].objs);
         break;
     default:
         current_iter = NULL;
@@ -381,7 +430,7 @@ object_next(void)
 {
     while (current_iter) {
         current_iter = tree_next(current_iter);
-        if (current_iter && !tree_find(&pending_destruction, current_iter, objcmp)) {
+        if (current_iter && !((MNCL_OBJECT_NODE *)current_iter)->obj->doomed) {
             return &((MNCL_OBJECT_NODE *)current_iter)->obj->object;
         }
     }
@@ -458,7 +507,7 @@ mncl_object_at_point_next(void)
     while (point_collision_iter) {
         MNCL_OBJECT *self = &((MNCL_OBJECT_NODE *)point_collision_iter)->obj->object;
         int hit = 0;
-        if (!tree_find(&pending_destruction, point_collision_iter, objcmp)) {
+        if (!((MNCL_OBJECT_NODE *)point_collision_iter)->obj->doomed) {
             hit = point_in_object(point_collision_x, point_collision_y, self);
         }
         /* We've got the data we need, so iterate past it; we want
@@ -477,7 +526,7 @@ mncl_object_at_point_next(void)
 void
 collision_begin(MNCL_COLLISION *collision) {
     sync_object_trees();
-    current_iter = tree_minimum(&subscribers[mncl_get_trait("collision")].objs);
+    current_iter = tree_minimum(&subscribers[TRAIT_COLLISION].objs);
     if (current_iter) {
         collision_trait_iter = ((MNCL_OBJECT_NODE *)current_iter)->obj->kind->collisions;
         if (*collision_trait_iter) {
@@ -542,8 +591,8 @@ collision_next(MNCL_COLLISION *collision)
          * or both might have been destroyed by processing the
          * previous event */
         if (collision_other_iter &&
-            !tree_find(&pending_destruction, current_iter, objcmp) &&
-            !tree_find(&pending_destruction, collision_other_iter, objcmp)) {
+            !((MNCL_OBJECT_NODE *)current_iter)->obj->doomed &&
+            !((MNCL_OBJECT_NODE *)collision_other_iter)->obj->doomed) {
             MNCL_OBJECT *self = &((MNCL_OBJECT_NODE *)current_iter)->obj->object;
             MNCL_OBJECT *other = &((MNCL_OBJECT_NODE *)collision_other_iter)->obj->object;
             if (self != other && self->sprite && other->sprite) {
@@ -567,9 +616,10 @@ collision_next(MNCL_COLLISION *collision)
 void
 default_update_all_objects(void)
 {
-    TREE_NODE *n = tree_minimum(&master);
-    while (n) {
-        MNCL_OBJECT *o = &(((MNCL_OBJECT_NODE *)n)->obj->object);
+    BTREE_CURSOR c;
+    MNCL_OBJECT_FULL *o_full = (MNCL_OBJECT_FULL *)btree_minimum(&master, &c);
+    while (o_full) {
+        MNCL_OBJECT *o = &(o_full->object);
         o->x += o->dx;
         o->y += o->dy;
         o->f += o->df;
@@ -579,7 +629,7 @@ default_update_all_objects(void)
                 o->f = o->sprite->nframes - o->f;
             }
         }
-        n = tree_next(n);
+        o_full = (MNCL_OBJECT_FULL *)btree_next(&c);
     }
 }
 
@@ -587,31 +637,26 @@ void
 mncl_object_set_depth(MNCL_OBJECT *o, int new_depth)
 {
     MNCL_OBJECT_FULL *o_full = (MNCL_OBJECT_FULL *)o;
-    MNCL_OBJECT_NODE search;
-    TREE_NODE *render_node;
-    search.obj = o_full;
-    render_node = tree_find(&renderable, (TREE_NODE *)&search, scenecmp);
-    if (render_node) {
-        tree_delete(&renderable, render_node);
+    if (o_full->rendered) {
+        btree_delete(&renderable, o_full, scenecmp);
         o_full->depth = new_depth;
-        tree_insert(&renderable, render_node, scenecmp);
+        o_full->rendered = btree_insert(&renderable, o_full, scenecmp);
     }
 }
 
 static MNCL_OBJECT *
-render_process(void)
+render_process(MNCL_OBJECT_FULL *o_full)
 {
-    while (current_iter) {
-        MNCL_OBJECT_FULL *o_full = ((MNCL_OBJECT_NODE *)current_iter)->obj;
+    while (o_full) {
         MNCL_OBJECT *o = &(o_full->object);
         if (o_full->kind->visible && o->sprite && o->sprite->nframes &&
-                !tree_find(&pending_destruction, current_iter, objcmp)) {
+                !o_full->doomed) {
             if (o_full->kind->customrender) {
                 return o;
             }
             mncl_draw_sprite(o->sprite, (int)o->x, (int)o->y, (int)o->f);
         }
-        current_iter = tree_prev(current_iter);
+        o_full = (MNCL_OBJECT_FULL *)btree_prev(&render_iter);
     }
     return NULL;
 }
@@ -619,13 +664,11 @@ render_process(void)
 MNCL_OBJECT *
 render_begin(void)
 {
-    current_iter = tree_maximum(&renderable);
-    return render_process();
+    return render_process((MNCL_OBJECT_FULL *)btree_maximum(&renderable, &render_iter));
 }
 
 MNCL_OBJECT *
 render_next(void)
 {
-    current_iter = tree_prev(current_iter);
-    return render_process();
+    return render_process((MNCL_OBJECT_FULL *)btree_prev(&render_iter));
 }
@@ -4,7 +4,17 @@
 #include <string.h>
 #include <zlib.h>
 #include "monocle.h"
+#include "monocle_internal.h"
 #include "tree.h"
+#include "atom.h"
+
+/* Where we can, zipfiles are mapped into memory rather than read */
+#ifndef _WIN32
+#include <sys/mman.h>
+#define ZIP_MMAP 1
+#else
+#define ZIP_MMAP 0
+#endif
 
 /* Local utility functions */
 static int
@@ -13,70 +23,25 @@ decodeInt(unsigned char *p)
     return ((unsigned int)p[3] << 24) | ((unsigned int)p[2] << 16) | ((unsigned int)p[1] << 8) | p[0];
 }
 
-static short
-loadShort(FILE *f) 
-{
-    int l = fgetc(f);
-    int h = fgetc(f);
-    return (unsigned short)((h << 8) | l);
-}
-
 static unsigned int
-loadInt(FILE *f)
+decodeShort(unsigned char *p)
 {
-    int l = loadShort(f) & 0xFFFF;
-    int h = loadShort(f) & 0xFFFF;
-    return (h << 16) | l;
-}
-
-static void
-loadSkip(FILE *f, int n)
-{
-    int i;
-    for (i = 0; i < n; ++i) {
-        fgetc(f);
-    }
-}
-
-/* Like strncmp(n, fs, s) where fs is a string made by reading n
- * characters from f. Always reads n characters from f. s must be
- * null-terminated. fs needn't be and is expected not to be. */
-static int
-fstrncmp(FILE *f, int n, const char *s)
-{
-    int i, result = 0;
-    for (i = 0; i < n; ++i) {
-        int c = fgetc(f);
-        if (c < 0) {
-            /* We return early here because at EOF we have no more file to burn */
-            return -1;
-        }
-        result = c - (unsigned char)(*s);
-        if (result) {
-            ++i; ++s;
-            break;
-        }
-        ++s;
-    }
-    if (!result && i == n && *s) {
-        result = -1;
-    }
-    for (; i < n; ++i) {
-        fgetc(f);
-    }
-    return result;
+    return ((unsigned int)p[1] << 8) | p[0];
 }
 
 /* Zipfile seeking functions */
+/* Finds the central directory, returning its offset, size and entry
+ * count, or 0 if there isn't one that fits inside the file */
 static int
-seek_to_central_directory(FILE *f)
+find_central_directory(FILE *f, long *offset, unsigned int *dirsize, unsigned int *count)
 {
     long minstart, size, i;
     int state;
     char *buf;
     minstart = 65557;
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
+    if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0) {
+        return 0;
+    }
     if (minstart > size) {
         minstart = size;
     }
@@ -106,10 +71,13 @@ seek_to_central_directory(FILE *f)
             break;
         case 0x50:
             if (state == 3) {
-                fseek(f, decodeInt((unsigned char *)buf+i+16), SEEK_SET);
+                *count = decodeShort((unsigned char *)buf+i+10);
+                *dirsize = decodeInt((unsigned char *)buf+i+12);
+                *offset = (unsigned int)decodeInt((unsigned char *)buf+i+16);
                 free(buf);
-                /* Found it! */
-                return 1;
+                /* Found it! But the directory it describes has to
+                 * lie inside the file, or it can't be read */
+                return *dirsize <= (unsigned long)size && (unsigned long)*offset <= (unsigned long)size - *dirsize;
             }
             state = 0;
             break;
@@ -123,183 +91,327 @@ seek_to_central_directory(FILE *f)
     return 0;
 }
 
+/* Zipfile indexes. Mounting a zipfile reads its whole central
+ * directory at once and files each entry under its name, and the
+ * file stays open, so finding an entry is one map lookup and reading
+ * it starts with one seek. Where the whole file can be mapped into
+ * memory, entries are read straight out of the mapping instead, and
+ * stored (uncompressed) entries aren't copied at all. */
+
 struct zip_entry {
     int compressedSize, uncompressedSize, compression;
     unsigned int crc32;
+    long offset; /* Of the local header, or of the data once located */
+    int located;
 };
 
-/* Precondition: f needs to be pointing to the start of the central
- * directory. If you know you haven't reached path yet, you're still
- * OK as long as f is pointing to the start of a central directory
- * record.*/
-static int
-find_file_in_zip(FILE *f, const char *path, struct zip_entry *ze)
-{
-    while (1) {
-        short fnameLen;
-        int magic, suffixLen;
-        long offset;
-        magic = loadInt(f);
-        if (magic == 0x06054b50 || magic == 0x05054b50 || magic == 0x06064b50) {
-            /* We've hit the End of Central Directory record, a
-             * digital signature block, or a Zip64 end of directory
-             * record. We're done, and we didn't find what we were
-             * looking for. */
-            return 0;
+struct zip_index {
+    FILE *f;
+    unsigned char *map; /* The whole file, or NULL if it isn't mapped */
+    size_t mapSize;
+    MNCL_KV *entries; /* Entry name to struct zip_entry */
+    struct zip_entry table[1];
+};
+
+static void
+zip_index_free(struct zip_index *zip)
+{
+    if (zip) {
+#if ZIP_MMAP
+        if (zip->map) {
+            munmap(zip->map, zip->mapSize);
         }
-        if (magic != 0x02014b50) {
+#endif
+        fclose(zip->f);
+        mncl_free_kv(zip->entries);
+        free(zip);
+    }
+}
+
+/* Reads and indexes the central directory of the zipfile at
+ * pathname, returning NULL if it isn't a readable zipfile. Entries
+ * compressed in ways we can't handle are left out, as if they
+ * weren't there. */
+static struct zip_index *
+zip_index_open(const char *pathname)
+{
+    struct zip_index *zip = NULL;
+    unsigned char *dir = NULL;
+    KEY_VALUE_PAIR *pairs = NULL;
+    MNCL_KV *entries = NULL;
+    unsigned int size, count, n = 0, pos = 0;
+    long offset;
+    FILE *f = fopen(pathname, "rb");
+    if (!f || !find_central_directory(f, &offset, &size, &count)) {
+        goto fail;
+    }
+    dir = (unsigned char *)malloc(size + 1);
+    zip = (struct zip_index *)malloc(sizeof(struct zip_index) + count * sizeof(struct zip_entry));
+    pairs = (KEY_VALUE_PAIR *)malloc((count + 1) * sizeof(KEY_VALUE_PAIR));
+    entries = mncl_alloc_kv(NULL);
+    if (!dir || !zip || !pairs || !entries || fseek(f, offset, SEEK_SET) || fread(dir, 1, size, f) != size) {
+        goto fail;
+    }
+    while (n < count && pos + 46 <= size && decodeInt(dir + pos) == 0x02014b50) {
+        unsigned char *record = dir + pos;
+        unsigned int nameLen = decodeShort(record + 28);
+        struct zip_entry *ze = &zip->table[n];
+        pos += 46 + nameLen + decodeShort(record + 30) + decodeShort(record + 32);
+        if (pos > size) {
+            break;
+        }
+        ze->compression = decodeShort(record + 10);
+        ze->crc32 = decodeInt(record + 16);
+        ze->compressedSize = decodeInt(record + 20);
+        ze->uncompressedSize = decodeInt(record + 24);
+        ze->offset = (unsigned int)decodeInt(record + 42);
+        ze->located = 0;
+        if (ze->compression != 0 && ze->compression != 8) {
+            /* Unknown compression type */
+            continue;
+        }
+        pairs[n].key = mncl_atom_n((const char *)record + 46, nameLen);
+        pairs[n].value = ze;
+        if (!pairs[n].key) {
+            goto fail;
+        }
+        ++n;
+    }
+    /* The first of two entries with the same name is the one found */
+    for (pos = 0; pos < n / 2; ++pos) {
+        KEY_VALUE_PAIR swap = pairs[pos];
+        pairs[pos] = pairs[n - 1 - pos];
+        pairs[n - 1 - pos] = swap;
+    }
+    if (n && !mncl_kv_build(entries, pairs, n)) {
+        goto fail;
+    }
+    zip->f = f;
+    zip->entries = entries;
+    zip->map = NULL;
+    zip->mapSize = 0;
+#if ZIP_MMAP
+    if (!fseek(f, 0, SEEK_END) && ftell(f) > 0) {
+        void *map;
+        zip->mapSize = (size_t)ftell(f);
+        map = mmap(NULL, zip->mapSize, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        zip->map = (map == MAP_FAILED) ? NULL : (unsigned char *)map;
+    }
+#endif
+    free(pairs);
+    free(dir);
+    return zip;
+fail:
+    if (entries) {
+        mncl_free_kv(entries);
+    }
+    if (f) {
+        fclose(f);
+    }
+    free(zip);
+    free(pairs);
+    free(dir);
+    return NULL;
+}
+
+/* Looks an entry up and finds the start of its data, seeking to it
+ * if the file isn't mapped */
+static struct zip_entry *
+zip_index_find(struct zip_index *zip, const char *resourcename)
+{
+    struct zip_entry *ze = (struct zip_entry *)mncl_kv_find(zip->entries, resourcename);
+    if (!ze) {
+        return NULL;
+    }
+    if (!ze->located) {
+        unsigned char buf[30], *header = buf;
+        if (zip->map) {
+            header = (zip->mapSize >= 30 && (size_t)ze->offset <= zip->mapSize - 30) ? zip->map + ze->offset : NULL;
+        } else if (fseek(zip->f, ze->offset, SEEK_SET) || fread(buf, 1, 30, zip->f) != 30) {
+            header = NULL;
+        }
+        if (!header || decodeInt(header) != 0x04034b50) {
             /* ZIP directory corrupt */
-            return 0;
+            return NULL;
         }
-        loadSkip(f, 6);
-        ze->compression = loadShort(f);
-        loadSkip(f, 4);
-        ze->crc32 = loadInt(f);
-        ze->compressedSize = loadInt(f);
-        ze->uncompressedSize = loadInt(f);
-        fnameLen = loadShort(f);
-        suffixLen = loadShort(f);
-        suffixLen += loadShort(f);
-        loadSkip(f, 8);
-        offset = loadInt(f);
-        if (!fstrncmp(f, fnameLen, path)) {
-            if (ze->compression != 0 && ze->compression != 8) {
-                /* Unknown compression type */
-                return 0;
-            }
-            fseek(f, offset, SEEK_SET);
-            suffixLen = 0;
-            magic = loadInt(f);
-            if (magic != 0x04034b50) {
-                /* ZIP directory corrupt */
-                return 0;
-            }
-            loadSkip(f, 22);
-            suffixLen += loadShort(f);
-            suffixLen += loadShort(f);
-            loadSkip(f, suffixLen);
-            return 1;
+        ze->offset += 30 + decodeShort(header + 26) + decodeShort(header + 28);
+        ze->located = 1;
+    }
+    if (zip->map) {
+        /* A mapped entry must lie wholly inside the file */
+        if (ze->compressedSize < 0 || (size_t)ze->offset > zip->mapSize ||
+            (size_t)ze->compressedSize > zip->mapSize - ze->offset) {
+            return NULL;
         }
-        /* That wasn't it. Skip the suffix to get to the next
-         * entry */
-        loadSkip(f, suffixLen);
+        return ze;
     }
-    /* This should really qualify as unreachable code */
-    return 0;
+    return fseek(zip->f, ze->offset, SEEK_SET) ? NULL : ze;
 }
 
 /* Core resource-extraction functions */
-MNCL_RAW *
-zipfile_get_resource(const char *pathname, const char *resourcename)
-{
-    int success = 1;
-    FILE *f = NULL;
-    void *outbuf = NULL;
-    struct zip_entry ze;
-    ze.uncompressedSize = 0;
-    f = fopen(pathname, "rb");
-    if (!f) {
-        success = 0;
-    }
-    if (success) {
-        success = seek_to_central_directory(f);
-    }
-    if (success) {
-        success = find_file_in_zip(f, resourcename, &ze);
-    }
-    if (success) {
-        /* We actually found the file, and we know enough about it to
-         * perform the extraction! */
-        outbuf = malloc(ze.uncompressedSize);
-        printf ("Extracting %s: %d -> %d bytes\n", resourcename, ze.compressedSize, ze.uncompressedSize);
-        if (ze.compression) {
-            int leftToRead = ze.compressedSize;
-            int ret, index;
-            z_stream strm;
-            unsigned char inbuf[8192];
-            /* allocate inflate state */
-            index = 0;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = 0;
-            strm.next_in = Z_NULL;
-            ret = inflateInit2(&strm, -MAX_WBITS);
-            if (ret != Z_OK) {
+
+/* Passes an entry's contents to sink a piece at a time as they are
+ * read and inflated, returning 0 if they turned out to be corrupt. A
+ * sink that returns 0 cuts this short without it counting as a
+ * failure. */
+static int
+zipfile_extract(struct zip_index *zip, struct zip_entry *ze, MNCL_RAW_SINK sink, void *user)
+{
+    int leftToRead = ze->compressedSize, index = 0, ret, success = 1;
+    uint64_t crc = crc32(0L, Z_NULL, 0);
+    unsigned char inbuf[8192], outbuf[16384];
+    z_stream strm;
+    if (ze->compression) {
+        /* allocate inflate state */
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = 0;
+        strm.next_in = Z_NULL;
+        ret = inflateInit2(&strm, -MAX_WBITS);
+        if (ret != Z_OK) {
+            return 0;
+        }
+    }
+    while (success && leftToRead > 0) {
+        unsigned char *in = inbuf;
+        int nRead;
+        if (zip->map) {
+            /* The rest of the entry is all there at once */
+            in = zip->map + ze->offset + (ze->compressedSize - leftToRead);
+            nRead = leftToRead;
+        } else {
+            nRead = fread(inbuf, 1, (leftToRead > 8192) ? 8192 : leftToRead, zip->f);
+        }
+        if (nRead <= 0) {
+            /* Premature EOF */
+            success = 0;
+            break;
+        }
+        leftToRead -= nRead;
+        if (!ze->compression) {
+            if (index + nRead > ze->uncompressedSize) {
                 success = 0;
+                break;
             }
-            while (success && leftToRead > 0) {
-                int nRead = fread(inbuf, 1, (leftToRead > 8192) ? 8192 : leftToRead, f);
-                leftToRead -= nRead;
-                strm.avail_in = nRead;
-                strm.next_in = inbuf;
-                strm.avail_out = ze.uncompressedSize - index;
-                strm.next_out = (unsigned char *)((char *)outbuf + index);
-                ret = inflate(&strm, Z_NO_FLUSH);
-                switch (ret) {
-                case Z_NEED_DICT:
-                case Z_STREAM_ERROR:
-                case Z_DATA_ERROR:
-                case Z_MEM_ERROR:
-                    (void)inflateEnd(&strm);
-                    success = 0;
-                    break;
-                case Z_STREAM_END:
-                    leftToRead = 0;
-                    break;
-                default:
-                    break;
-                }
-                /* We might be able to ignore index and just not
-                 * update strm.avail_out and strm.next_out here. */
-                index = ze.uncompressedSize - strm.avail_out;
+            crc = crc32(crc, in, nRead);
+            index += nRead;
+            if (!sink((const char *)in, nRead, user)) {
+                return 1;
             }
-            inflateEnd(&strm);
-        } else {
-            if ((long)fread(outbuf, 1, ze.compressedSize, f) != ze.compressedSize) {
-                /* Can't read the resource for some reason */
+            continue;
+        }
+        strm.avail_in = nRead;
+        strm.next_in = in;
+        do {
+            int have;
+            strm.avail_out = sizeof(outbuf);
+            strm.next_out = outbuf;
+            ret = inflate(&strm, Z_NO_FLUSH);
+            switch (ret) {
+            case Z_NEED_DICT:
+            case Z_STREAM_ERROR:
+            case Z_DATA_ERROR:
+            case Z_MEM_ERROR:
                 success = 0;
+                break;
+            case Z_STREAM_END:
+                leftToRead = 0;
+                break;
+            default:
+                break;
             }
-        }
-        if (success) {
-            uint64_t crc = crc32(0L, Z_NULL, 0);
-            crc = crc32(crc, (unsigned char*)outbuf, ze.uncompressedSize);
-            crc &= 0xFFFFFFFF;
-            if (ze.crc32 != crc) {
+            have = sizeof(outbuf) - strm.avail_out;
+            if (!success || index + have > ze->uncompressedSize) {
                 success = 0;
+                break;
             }
-        }
+            crc = crc32(crc, outbuf, have);
+            index += have;
+            if (have && !sink((const char *)outbuf, have, user)) {
+                inflateEnd(&strm);
+                return 1;
+            }
+        } while (strm.avail_out == 0 && ret != Z_STREAM_END);
     }
-
-    /* Function epilogue. Clean up all our resources. */
-    if (f) {
-        fclose(f);
+    if (ze->compression) {
+        inflateEnd(&strm);
     }
-    if (!success && outbuf) {
-        free(outbuf);
-        outbuf = NULL;
+    crc &= 0xFFFFFFFF;
+    return success && index == ze->uncompressedSize && ze->crc32 == crc;
+}
+
+struct raw_fill {
+    unsigned char *data;
+    size_t size;
+};
+
+static int
+raw_fill(const char *data, size_t size, void *user)
+{
+    struct raw_fill *fill = (struct raw_fill *)user;
+    memcpy(fill->data + fill->size, data, size);
+    fill->size += size;
+    return 1;
+}
+
+static int
+raw_check(const char *data, size_t size, void *user)
+{
+    (void)data;
+    (void)size;
+    (void)user;
+    return 1;
+}
+
+/* Sets *view if the result's data is part of the zipfile's mapping,
+ * and so mustn't be freed */
+static MNCL_RAW *
+zipfile_get_resource(struct zip_index *zip, const char *resourcename, int *view)
+{
+    struct raw_fill fill;
+    MNCL_RAW *result;
+    struct zip_entry *ze = zip_index_find(zip, resourcename);
+    if (!ze) {
+        return NULL;
     }
-    if (outbuf) {
-        MNCL_RAW *result = malloc(sizeof(MNCL_RAW));
+    printf ("Extracting %s: %d -> %d bytes\n", resourcename, ze->compressedSize, ze->uncompressedSize);
+    if (zip->map && !ze->compression) {
+        /* Stored entries are used where they lie, once the CRC checks */
+        if (!zipfile_extract(zip, ze, raw_check, NULL)) {
+            return NULL;
+        }
+        result = malloc(sizeof(MNCL_RAW));
         if (result) {
-            result->data = outbuf;
-            result->size = ze.uncompressedSize;
-            return result;
-        } else {
-            free(outbuf);
+            result->data = zip->map + ze->offset;
+            result->size = ze->uncompressedSize;
+            *view = 1;
         }
+        return result;
     }
-    return NULL;
+    /* We actually found the file, and we know enough about it to
+     * perform the extraction! */
+    fill.data = malloc(ze->uncompressedSize);
+    fill.size = 0;
+    if ((!fill.data && ze->uncompressedSize) || !zipfile_extract(zip, ze, raw_fill, &fill)) {
+        free(fill.data);
+        return NULL;
+    }
+    result = malloc(sizeof(MNCL_RAW));
+    if (!result) {
+        free(fill.data);
+        return NULL;
+    }
+    result->data = fill.data;
+    result->size = ze->uncompressedSize;
+    return result;
 }
 
-MNCL_RAW *
-filesystem_get_resource(const char *pathbase, const char *resourcename)
+static FILE *
+filesystem_open(const char *pathbase, const char *resourcename)
 {
     char buf[PATH_MAX];
-    FILE *f;
     int i, j;
-    size_t size;
-    MNCL_RAW *result;
 
     /* Check for path traversal silliness */
     if ((resourcename[0] == '.' && resourcename[1] == '.') || strstr(resourcename, "/..")) {
@@ -325,22 +437,33 @@ filesystem_get_resource(const char *pathbase, const char *resourcename)
         }
     }
     buf[PATH_MAX-1] = 0;
-    f = fopen(buf, "rb");
+    return fopen(buf, "rb");
+}
+
+MNCL_RAW *
+filesystem_get_resource(const char *pathbase, const char *resourcename)
+{
+    FILE *f;
+    long size;
+    MNCL_RAW *result;
+
+    f = filesystem_open(pathbase, resourcename);
     if (!f) {
         return NULL;
     }
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    /* Without a stdio buffer, the whole file comes in with one read
+     * straight into place */
+    setvbuf(f, NULL, _IONBF, 0);
+    if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) {
+        fclose(f);
+        return NULL;
+    }
     result = malloc(sizeof(MNCL_RAW));
     if (result) {
-        result->data = malloc(size);
+        result->data = malloc(size ? size : 1);
         result->size = size;
-        if (result->data) {
-            for (i = 0; i < size; ++i) {
-                result->data[i] = fgetc(f);
-            }
-        } else {
+        if (!result->data || fread(result->data, 1, size, f) != (size_t)size) {
+            free(result->data);
             free(result);
             result = NULL;
         }
@@ -349,6 +472,19 @@ filesystem_get_resource(const char *pathbase, const char *resourcename)
     return result;
 }
 
+static int
+filesystem_extract(FILE *f, MNCL_RAW_SINK sink, void *user)
+{
+    char buf[16384];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        if (!sink(buf, n, user)) {
+            return 1;
+        }
+    }
+    return !ferror(f);
+}
+
 /* Data structures for handling the resource manager */
 
 typedef enum { PROVIDER_DIRECTORY, PROVIDER_ZIPFILE, NUM_PROVIDER_TYPES } PROVIDER_TYPE;
@@ -356,6 +492,7 @@ typedef enum { PROVIDER_DIRECTORY, PROVIDER_ZIPFILE, NUM_PROVIDER_TYPES } PROVID
 struct provider {
     struct provider *next;
     PROVIDER_TYPE tag;
+    struct zip_index *zip; /* PROVIDER_ZIPFILE only */
     char path[1];
 };
 
@@ -364,11 +501,14 @@ struct resmap_node {
     const char *resname;
     MNCL_RAW *resource;
     int refcount;
+    int view; /* Whether the data belongs to a zipfile mapping */
 };
 
 static struct provider *providers = NULL;
 static TREE locked_resources = { NULL };
 static TREE reverse_map = { NULL };
+static TREE_POOL locked_pool = TREE_POOL_INITIALIZER(struct resmap_node);
+static TREE_POOL reverse_pool = TREE_POOL_INITIALIZER(struct resmap_node);
 
 static int
 rescmp(TREE_NODE *a, TREE_NODE *b)
@@ -391,6 +531,7 @@ make_provider(const char *path, PROVIDER_TYPE ptype)
         return NULL;
     }
     newprov->tag = ptype;
+    newprov->zip = NULL;
     strcpy(newprov->path, path);
     newprov->next = providers;
     providers = newprov;
@@ -404,6 +545,7 @@ mncl_uninit_raw_system(void)
     while (providers) {
         struct provider *next = providers->next;
         printf ("Unmounting %s: %s\n", providers->tag == PROVIDER_DIRECTORY ? "directory" : "zipfile", providers->path);
+        zip_index_free(providers->zip);
         free(providers);
         providers = next;
     }
@@ -419,7 +561,18 @@ mncl_add_resource_directory(const char *path)
 int
 mncl_add_resource_zipfile(const char *path)
 {
-    return make_provider(path, PROVIDER_ZIPFILE) ? 1 : 0;
+    struct provider *provider;
+    struct zip_index *zip = zip_index_open(path);
+    if (!zip) {
+        return 0;
+    }
+    provider = make_provider(path, PROVIDER_ZIPFILE);
+    if (!provider) {
+        zip_index_free(zip);
+        return 0;
+    }
+    provider->zip = zip;
+    return 1;
 }
 
 MNCL_RAW *
@@ -429,6 +582,7 @@ mncl_acquire_raw(const char *resource)
     struct resmap_node seek, *found = NULL;
     struct provider *i = providers;
     char *duped_name;
+    int view = 0;
     seek.resname = resource;
     found = (struct resmap_node *)tree_find(&locked_resources, (TREE_NODE *)&seek, rescmp);
     if (found) {
@@ -441,7 +595,7 @@ mncl_acquire_raw(const char *resource)
             result = filesystem_get_resource(i->path, resource);
             break;
         case PROVIDER_ZIPFILE:
-            result = zipfile_get_resource(i->path, resource);
+            result = zipfile_get_resource(i->zip, resource, &view);
             break;
         default:
             /* ? */
@@ -454,25 +608,67 @@ mncl_acquire_raw(const char *resource)
         return NULL;
     }
     /* Update the resource map */
-    found = malloc(sizeof(struct resmap_node));
+    found = (struct resmap_node *)tree_pool_alloc(&locked_pool);
     duped_name = (char *)malloc(strlen(resource)+1);
     strcpy(duped_name, resource);
     found->resname = duped_name;
     found->resource = result;
     found->refcount = 1;
+    found->view = view;
     tree_insert(&locked_resources, (TREE_NODE *)found, rescmp);
     /* Build another copy for the reverse map */
-    found = malloc(sizeof(struct resmap_node));
+    found = (struct resmap_node *)tree_pool_alloc(&reverse_pool);
     duped_name = (char *)malloc(strlen(resource)+1);
     strcpy(duped_name, resource);
     found->resname = duped_name;
     found->resource = result;
     found->refcount = 0;
+    found->view = view;
     tree_insert(&reverse_map, (TREE_NODE *)found, ptrcmp);
     
     return result;
 }
 
+int
+mncl_stream_raw(const char *resource, MNCL_RAW_SINK sink, void *user)
+{
+    struct resmap_node seek, *found = NULL;
+    struct provider *i;
+    struct zip_entry *ze;
+    int result;
+    FILE *f;
+    seek.resname = resource;
+    found = (struct resmap_node *)tree_find(&locked_resources, (TREE_NODE *)&seek, rescmp);
+    if (found) {
+        /* Already in memory, so hand it over whole */
+        sink((const char *)found->resource->data, found->resource->size, user);
+        return 1;
+    }
+    for (i = providers; i; i = i->next) {
+        switch (i->tag) {
+        case PROVIDER_DIRECTORY:
+            f = filesystem_open(i->path, resource);
+            if (f) {
+                result = filesystem_extract(f, sink, user);
+                fclose(f);
+                return result;
+            }
+            break;
+        case PROVIDER_ZIPFILE:
+            ze = zip_index_find(i->zip, resource);
+            if (ze) {
+                printf ("Extracting %s: %d -> %d bytes\n", resource, ze->compressedSize, ze->uncompressedSize);
+                return zipfile_extract(i->zip, ze, sink, user);
+            }
+            break;
+        default:
+            /* ? */
+            break;
+        }
+    }
+    return 0;
+}
+
 void
 mncl_release_raw(MNCL_RAW *raw)
 {
@@ -495,12 +691,14 @@ mncl_release_raw(MNCL_RAW *raw)
             tree_delete(&reverse_map, (TREE_NODE *)found);
             tree_delete(&locked_resources, (TREE_NODE *)found2);
             if (found2->resource->data) {
-                free(found2->resource->data);
+                if (!found2->view) {
+                    free(found2->resource->data);
+                }
                 free(found2->resource);
                 free((void *)found2->resname);
                 free((void *)found->resname);
-                free(found);
-                free(found2);
+                tree_pool_free(&reverse_pool, found);
+                tree_pool_free(&locked_pool, found2);
             }
         } else {
             printf("new refcount %d\n", found2->refcount);
@@ -3,15 +3,75 @@
 #include "monocle.h"
 #include "monocle_internal.h"
 #include "tree.h"
+#include "epoch.h"
 
 typedef void *(*ALLOC_FN)(MNCL_DATA *);
 
+/* Each class's values are only ever changed by the thread that loads
+ * and unloads resmaps, which republishes them afterwards. The
+ * locators read the published snapshot, so other threads may look
+ * resources up while a load is in progress. */
 typedef struct res_class {
     MNCL_KV values;
     const char *type;
     ALLOC_FN alloc_fn;
+    MNCL_KV_PUBLISHED published;
 } RES_CLASS;
 
+/* The fields that the allocators read. Every resource of a class has
+ * much the same fields, so each is compiled into a path on first use
+ * (see mncl_data_path_new), and the paths are kept until the
+ * resources are all unloaded. */
+enum {
+    FIELD_WIDTH,
+    FIELD_HEIGHT,
+    FIELD_FRAMES,
+    FIELD_HOTSPOT_X,
+    FIELD_HOTSPOT_Y,
+    FIELD_HITBOX_X,
+    FIELD_HITBOX_Y,
+    FIELD_HITBOX_WIDTH,
+    FIELD_HITBOX_HEIGHT,
+    FIELD_X,
+    FIELD_Y,
+    FIELD_SPRITESHEET,
+    FIELD_FIRST_INDEX,
+    FIELD_LAST_INDEX,
+    FIELD_TILE_WIDTH,
+    FIELD_TILE_HEIGHT,
+    FIELD_DX,
+    FIELD_DY,
+    FIELD_FRAME,
+    FIELD_FRAME_SPEED,
+    FIELD_DEPTH,
+    FIELD_SPRITE,
+    FIELD_TRAITS,
+    FIELD_COLLISIONS,
+    FIELD_COUNT
+};
+
+static const char *field_names[FIELD_COUNT] = {
+    "width", "height", "frames", "hotspot-x", "hotspot-y", "hitbox-x",
+    "hitbox-y", "hitbox-width", "hitbox-height", "x", "y",
+    "spritesheet", "first-index", "last-index", "tile-width",
+    "tile-height", "dx", "dy", "frame", "frame-speed", "depth",
+    "sprite", "traits", "collisions"
+};
+
+static MNCL_DATA_PATH *field_paths[FIELD_COUNT];
+
+static MNCL_DATA *
+field(MNCL_DATA *arg, int which)
+{
+    if (!field_paths[which]) {
+        field_paths[which] = mncl_data_path_new(field_names[which]);
+        if (!field_paths[which]) {
+            return mncl_data_lookup(arg, field_names[which]);
+        }
+    }
+    return mncl_data_path_lookup(arg, field_paths[which]);
+}
+
 static void *
 raw_alloc(MNCL_DATA *arg)
 {
@@ -34,15 +94,15 @@ static void *
 sprite_alloc(MNCL_DATA *arg)
 {
     if (arg && arg->tag == MNCL_DATA_OBJECT) {
-        MNCL_DATA *mncl_data_w = mncl_data_lookup(arg, "width");
-        MNCL_DATA *mncl_data_h = mncl_data_lookup(arg, "height");
-        MNCL_DATA *mncl_data_fr = mncl_data_lookup(arg, "frames");
-        MNCL_DATA *hot_x = mncl_data_lookup(arg, "hotspot-x");
-        MNCL_DATA *hot_y = mncl_data_lookup(arg, "hotspot-y");
-        MNCL_DATA *hit_x = mncl_data_lookup(arg, "hitbox-x");
-        MNCL_DATA *hit_y = mncl_data_lookup(arg, "hitbox-y");
-        MNCL_DATA *hit_w = mncl_data_lookup(arg, "hitbox-width");
-        MNCL_DATA *hit_h = mncl_data_lookup(arg, "hitbox-height");
+        MNCL_DATA *mncl_data_w = field(arg, FIELD_WIDTH);
+        MNCL_DATA *mncl_data_h = field(arg, FIELD_HEIGHT);
+        MNCL_DATA *mncl_data_fr = field(arg, FIELD_FRAMES);
+        MNCL_DATA *hot_x = field(arg, FIELD_HOTSPOT_X);
+        MNCL_DATA *hot_y = field(arg, FIELD_HOTSPOT_Y);
+        MNCL_DATA *hit_x = field(arg, FIELD_HITBOX_X);
+        MNCL_DATA *hit_y = field(arg, FIELD_HITBOX_Y);
+        MNCL_DATA *hit_w = field(arg, FIELD_HITBOX_WIDTH);
+        MNCL_DATA *hit_h = field(arg, FIELD_HITBOX_HEIGHT);
 
         MNCL_SPRITE *result = NULL;
         int i;
@@ -89,9 +149,9 @@ sprite_alloc(MNCL_DATA *arg)
         for (i = 0; i < result->nframes; ++i) {
             MNCL_DATA *mncl_data_f = mncl_data_fr->value.array.data[i];
             if (mncl_data_f && mncl_data_f->tag == MNCL_DATA_OBJECT) {
-                MNCL_DATA *x = mncl_data_lookup(mncl_data_f, "x");
-                MNCL_DATA *y = mncl_data_lookup(mncl_data_f, "y");
-                MNCL_DATA *ss = mncl_data_lookup(mncl_data_f, "spritesheet");
+                MNCL_DATA *x = field(mncl_data_f, FIELD_X);
+                MNCL_DATA *y = field(mncl_data_f, FIELD_Y);
+                MNCL_DATA *ss = field(mncl_data_f, FIELD_SPRITESHEET);
                 if (x && y && ss && x->tag == MNCL_DATA_NUMBER && y->tag == MNCL_DATA_NUMBER && ss->tag == MNCL_DATA_STRING) {
                     MNCL_SPRITESHEET *ss_val = mncl_spritesheet_resource(ss->value.string);
                     if (ss_val) {
@@ -116,15 +176,15 @@ static void *
 font_alloc(MNCL_DATA *arg)
 {
     if (arg && arg->tag == MNCL_DATA_OBJECT) {
-        MNCL_DATA *mncl_data_w = mncl_data_lookup(arg, "width");
-        MNCL_DATA *mncl_data_h = mncl_data_lookup(arg, "height");
-        MNCL_DATA *mncl_data_first = mncl_data_lookup(arg, "first-index");
-        MNCL_DATA *mncl_data_last = mncl_data_lookup(arg, "last-index");
-        MNCL_DATA *mncl_data_ss = mncl_data_lookup(arg, "spritesheet");
-        MNCL_DATA *tile_w = mncl_data_lookup(arg, "tile-width");
-        MNCL_DATA *tile_h = mncl_data_lookup(arg, "tile-height");
-        MNCL_DATA *hot_x = mncl_data_lookup(arg, "hotspot-x");
-        MNCL_DATA *hot_y = mncl_data_lookup(arg, "hotspot-y");
+        MNCL_DATA *mncl_data_w = field(arg, FIELD_WIDTH);
+        MNCL_DATA *mncl_data_h = field(arg, FIELD_HEIGHT);
+        MNCL_DATA *mncl_data_first = field(arg, FIELD_FIRST_INDEX);
+        MNCL_DATA *mncl_data_last = field(arg, FIELD_LAST_INDEX);
+        MNCL_DATA *mncl_data_ss = field(arg, FIELD_SPRITESHEET);
+        MNCL_DATA *tile_w = field(arg, FIELD_TILE_WIDTH);
+        MNCL_DATA *tile_h = field(arg, FIELD_TILE_HEIGHT);
+        MNCL_DATA *hot_x = field(arg, FIELD_HOTSPOT_X);
+        MNCL_DATA *hot_y = field(arg, FIELD_HOTSPOT_Y);
 
         MNCL_FONT *result = NULL;
         MNCL_SPRITESHEET *spritesheet = NULL;
@@ -204,10 +264,15 @@ music_alloc(MNCL_DATA *arg)
     return NULL;
 }
 
+/* The resource map being loaded, which data resources share */
+static __thread MNCL_DATA *resmap_loading = NULL;
+
 static void *
 data_alloc(MNCL_DATA *arg)
 {
-    return mncl_data_clone(arg);
+    /* Shares the map's arena rather than copying out of it; the
+     * arena lives on until the last data resource from it goes */
+    return mncl_data_share_part(resmap_loading, arg);
 }
 
 static void *
@@ -229,27 +294,27 @@ kind_alloc(MNCL_DATA *arg)
             result->visible = 1;
             result->customrender = 0;
             /* Fill in the optional overrides */
-            v = mncl_data_lookup(arg, "dx");
+            v = field(arg, FIELD_DX);
             if (v && v->tag == MNCL_DATA_NUMBER) {
                 result->dx = (float)v->value.number;
             }
-            v = mncl_data_lookup(arg, "dy");
+            v = field(arg, FIELD_DY);
             if (v && v->tag == MNCL_DATA_NUMBER) {
                 result->dy = (float)v->value.number;
             }
-            v = mncl_data_lookup(arg, "frame");
+            v = field(arg, FIELD_FRAME);
             if (v && v->tag == MNCL_DATA_NUMBER) {
                 result->f = (float)v->value.number;
             }
-            v = mncl_data_lookup(arg, "frame-speed");
+            v = field(arg, FIELD_FRAME_SPEED);
             if (v && v->tag == MNCL_DATA_NUMBER) {
                 result->df = (float)v->value.number;
             }
-            v = mncl_data_lookup(arg, "depth");
+            v = field(arg, FIELD_DEPTH);
             if (v && v->tag == MNCL_DATA_NUMBER) {
                 result->depth = (float)v->value.number;
             }
-            v = mncl_data_lookup(arg, "sprite");
+            v = field(arg, FIELD_SPRITE);
             if (v && v->tag == MNCL_DATA_STRING) {
                 MNCL_SPRITE *s = mncl_sprite_resource(v->value.string);
                 if (!s) {
@@ -261,7 +326,7 @@ kind_alloc(MNCL_DATA *arg)
             trait_count = 1; /* Start with just the terminator */
             invisible = mncl_get_trait("invisible");
             customrender = mncl_get_trait("render");
-            v = mncl_data_lookup(arg, "traits");
+            v = field(arg, FIELD_TRAITS);
             if (v && v->tag == MNCL_DATA_ARRAY) {
                 int i;
                 for (i = 0; i < v->value.array.size; ++i) {
@@ -302,7 +367,7 @@ kind_alloc(MNCL_DATA *arg)
                 return NULL;
             }
             trait_count = 1; /* Start with just the terminator */
-            v = mncl_data_lookup(arg, "collisions");
+            v = field(arg, FIELD_COLLISIONS);
             if (v && v->tag == MNCL_DATA_ARRAY) {
                 int i;
                 for (i = 0; i < v->value.array.size; ++i) {
@@ -352,62 +417,262 @@ mncl_free_kind(void *obj) {
     }
 }
 
-static RES_CLASS raw = { { { NULL }, (MNCL_KV_DELETER)mncl_release_raw }, "raw", raw_alloc };
-static RES_CLASS spritesheet = { { { NULL }, (MNCL_KV_DELETER)mncl_free_spritesheet }, "spritesheet", spritesheet_alloc };
-static RES_CLASS sprite = { { { NULL }, (MNCL_KV_DELETER)mncl_free_sprite },  "sprite", sprite_alloc };
-static RES_CLASS font = { { { NULL }, free }, "font", font_alloc };
-static RES_CLASS sfx = { { { NULL }, (MNCL_KV_DELETER)mncl_free_sfx }, "sfx", sfx_alloc };
-static RES_CLASS music = { { { NULL }, free }, "music", music_alloc };
-static RES_CLASS data = { { { NULL }, (MNCL_KV_DELETER)mncl_free_data }, "data", data_alloc };
-static RES_CLASS kind = { { { NULL }, (MNCL_KV_DELETER)mncl_free_kind }, "kind", kind_alloc };
+static RES_CLASS raw = { MNCL_KV_INITIALIZER((MNCL_KV_DELETER)mncl_release_raw), "raw", raw_alloc, MNCL_KV_PUBLISHED_INITIALIZER };
+static RES_CLASS spritesheet = { MNCL_KV_INITIALIZER((MNCL_KV_DELETER)mncl_free_spritesheet), "spritesheet", spritesheet_alloc, MNCL_KV_PUBLISHED_INITIALIZER };
+static RES_CLASS sprite = { MNCL_KV_INITIALIZER((MNCL_KV_DELETER)mncl_free_sprite),  "sprite", sprite_alloc, MNCL_KV_PUBLISHED_INITIALIZER };
+static RES_CLASS font = { MNCL_KV_INITIALIZER(free), "font", font_alloc, MNCL_KV_PUBLISHED_INITIALIZER };
+static RES_CLASS sfx = { MNCL_KV_INITIALIZER((MNCL_KV_DELETER)mncl_free_sfx), "sfx", sfx_alloc, MNCL_KV_PUBLISHED_INITIALIZER };
+static RES_CLASS music = { MNCL_KV_INITIALIZER(free), "music", music_alloc, MNCL_KV_PUBLISHED_INITIALIZER };
+static RES_CLASS data = { MNCL_KV_INITIALIZER((MNCL_KV_DELETER)mncl_free_data), "data", data_alloc, MNCL_KV_PUBLISHED_INITIALIZER };
+static RES_CLASS kind = { MNCL_KV_INITIALIZER((MNCL_KV_DELETER)mncl_free_kind), "kind", kind_alloc, MNCL_KV_PUBLISHED_INITIALIZER };
 
 static RES_CLASS *resclasses[] = { &raw, &spritesheet, &sprite, &font, &sfx, &music, &data, &kind, NULL };
 
+typedef struct {
+    RES_CLASS *rc;
+    KEY_VALUE_PAIR *pairs;
+    unsigned int count;
+} RES_BATCH;
+
 static void
 alloc_resource_type(const char *key, void *value, void *user)
 {
-    RES_CLASS *rc = (RES_CLASS *)user;
+    RES_BATCH *batch = (RES_BATCH *)user;
+    RES_CLASS *rc = batch->rc;
     void *val = rc->alloc_fn((MNCL_DATA *)value);
     if (val) {
-        void *old_val = mncl_kv_find(&rc->values, key);
-        if (old_val) {
+        if (mncl_kv_find(&rc->values, key)) {
             printf("WARNING: overwriting %s resource %s\n", rc->type, key);
         }
-        if (!mncl_kv_insert(&rc->values, key, val)) {
-            printf("WARNING: Could not store %s resource %s\n", rc->type, key);
-            rc->values.deleter(val);
-        }
+        batch->pairs[batch->count].key = mncl_atom(key);
+        batch->pairs[batch->count].value = val;
+        ++batch->count;
     } else {
         printf ("WARNING: Could not handle %s resource %s\n", rc->type, key);
     }
 }
 
+/* Values that leave a class, whether unloaded or replaced by a later
+ * resmap, are taken out without being deleted. Only once the class
+ * has been republished without them are they retired through
+ * epoch.h, so that no reader can find them in a snapshot after they
+ * are gone. */
+typedef struct {
+    RES_CLASS *rc;
+    void **values;
+    unsigned int count;
+} RES_RETIRED;
+
+static void
+publish_resource_class(RES_CLASS *rc, RES_RETIRED *retired)
+{
+    unsigned int i;
+    if (!mncl_kv_publish(&rc->published, &rc->values)) {
+        printf("WARNING: Could not publish %s resources\n", rc->type);
+        if (retired->count) {
+            /* The old snapshot still holds the retired values, so it
+             * can't stay up */
+            mncl_kv_unpublish(&rc->published);
+        }
+    }
+    for (i = 0; i < retired->count; ++i) {
+        mncl_epoch_retire(retired->values[i], (MNCL_EPOCH_FN)rc->values.deleter);
+    }
+}
+
+static void
+replaced_resource_type(const char *key, void *value, void *user)
+{
+    RES_RETIRED *replaced = (RES_RETIRED *)user;
+    void *old = mncl_kv_find(&replaced->rc->values, key);
+    (void)value;
+    if (old) {
+        replaced->values[replaced->count++] = old;
+    }
+}
+
+/* Resmap sections arrive in key order, so each one is built into a
+ * map of its own in linear time, merged into the class and
+ * published. */
+static void
+alloc_resource_class(RES_CLASS *rc, MNCL_KV *section)
+{
+    RES_BATCH batch;
+    RES_RETIRED replaced;
+    MNCL_KV loaded = MNCL_KV_INITIALIZER(NULL);
+    MNCL_KV_DELETER deleter = rc->values.deleter;
+    unsigned int i;
+    int ok = 0;
+    batch.rc = rc;
+    batch.count = 0;
+    batch.pairs = (KEY_VALUE_PAIR *)malloc(mncl_kv_count(section) * sizeof(KEY_VALUE_PAIR) + 1);
+    replaced.rc = rc;
+    replaced.count = 0;
+    replaced.values = (void **)malloc(mncl_kv_count(section) * sizeof(void *) + 1);
+    if (!batch.pairs || !replaced.values) {
+        printf("WARNING: Could not store %s resources\n", rc->type);
+        free(batch.pairs);
+        free(replaced.values);
+        return;
+    }
+    mncl_kv_foreach(section, alloc_resource_type, &batch);
+    loaded.deleter = deleter;
+    if (mncl_kv_build(&loaded, batch.pairs, batch.count)) {
+        mncl_kv_foreach(&loaded, replaced_resource_type, &replaced);
+        rc->values.deleter = NULL;
+        ok = mncl_kv_merge(&rc->values, &loaded);
+        rc->values.deleter = deleter;
+    }
+    if (!ok) {
+        printf("WARNING: Could not store %s resources\n", rc->type);
+        replaced.count = 0;
+        if (loaded.count) {
+            mncl_kv_clear(&loaded);
+        } else {
+            for (i = 0; i < batch.count; ++i) {
+                deleter(batch.pairs[i].value);
+            }
+        }
+    }
+    free(batch.pairs);
+    publish_resource_class(rc, &replaced);
+    free(replaced.values);
+}
+
+static void
+remove_resource_type(const char *key, void *value, void *user)
+{
+    RES_RETIRED *unload = (RES_RETIRED *)user;
+    MNCL_KV *values = &unload->rc->values;
+    MNCL_KV_DELETER deleter = values->deleter;
+    void *val = mncl_kv_find(values, key);
+    (void)value;
+    if (val) {
+        values->deleter = NULL;
+        mncl_kv_delete(values, key);
+        values->deleter = deleter;
+        unload->values[unload->count++] = val;
+    }
+}
+
 static void
-free_resource_type (const char *key, void *value, void *user)
+retire_resource_type(const char *key, void *value, void *user)
 {
     RES_CLASS *rc = (RES_CLASS *)user;
-    mncl_kv_delete(&rc->values, key);
+    (void)key;
+    mncl_epoch_retire(value, (MNCL_EPOCH_FN)rc->values.deleter);
+}
+
+static void
+unload_resource_class(RES_CLASS *rc, MNCL_KV *section)
+{
+    RES_RETIRED unload;
+    unload.rc = rc;
+    unload.count = 0;
+    unload.values = (void **)malloc(mncl_kv_count(section) * sizeof(void *) + 1);
+    if (!unload.values) {
+        printf("WARNING: Could not unload %s resources\n", rc->type);
+        return;
+    }
+    mncl_kv_foreach(section, remove_resource_type, &unload);
+    publish_resource_class(rc, &unload);
+    free(unload.values);
+}
+
+/* A resource map is either JSON text, which is parsed as it arrives,
+ * or a binary document (see mncl_data_save_binary), which is
+ * collected and loaded whole. No JSON text starts with the 'M' of a
+ * binary one's header, so the first byte says which it is. */
+typedef struct {
+    MNCL_DATA_PARSER *parser;
+    char *image;
+    size_t size, capacity;
+    int binary;
+} RESMAP_READER;
+
+static int
+resmap_feed(const char *data, size_t size, void *user)
+{
+    RESMAP_READER *reader = (RESMAP_READER *)user;
+    if (!size) {
+        return 1;
+    }
+    if (!reader->parser && !reader->image) {
+        reader->binary = (data[0] == 'M');
+        if (!reader->binary) {
+            reader->parser = mncl_data_parser_new_arena(0);
+            if (!reader->parser) {
+                return 0;
+            }
+        }
+    }
+    if (!reader->binary) {
+        return mncl_data_parser_feed(reader->parser, data, size);
+    }
+    if (reader->size + size > reader->capacity) {
+        size_t capacity = reader->capacity ? reader->capacity : 4096;
+        char *grown;
+        while (capacity < reader->size + size) {
+            capacity *= 2;
+        }
+        grown = (char *)realloc(reader->image, capacity);
+        if (!grown) {
+            return 0;
+        }
+        reader->image = grown;
+        reader->capacity = capacity;
+    }
+    memcpy(reader->image + reader->size, data, size);
+    reader->size += size;
+    return 1;
+}
+
+/* Reads a resource map, parsing JSON text as it is read in so the
+ * text is never all in memory at once. Returns NULL (and clears
+ * *found) if it can't be read at all. */
+static MNCL_DATA *
+resmap_read(const char *path, int *found)
+{
+    MNCL_DATA *resmap;
+    RESMAP_READER reader = { NULL, NULL, 0, 0, 0 };
+    *found = mncl_stream_raw(path, resmap_feed, &reader);
+    if (reader.binary) {
+        resmap = mncl_data_load_binary(reader.image, reader.size);
+        free(reader.image);
+    } else {
+        if (!reader.parser) {
+            reader.parser = mncl_data_parser_new_arena(0);
+        }
+        resmap = reader.parser ? mncl_data_parser_finish(reader.parser) : NULL;
+    }
+    if (!*found) {
+        mncl_free_data(resmap);
+        return NULL;
+    }
+    return resmap;
 }
 
 void
 mncl_load_resmap(const char *path)
 {
-    MNCL_DATA *resmap = NULL;
-    MNCL_RAW *resmap_file = mncl_acquire_raw(path);
-    if (!resmap_file) {
+    int found;
+    MNCL_DATA *resmap = resmap_read(path, &found);
+    if (!found) {
         printf ("WARNING: Could not find resource map %s\n", path);
         return;
     }
-    resmap = mncl_parse_data((char *)resmap_file->data, resmap_file->size);
-    mncl_release_raw(resmap_file);
     if (resmap) {
         int i;
+        resmap_loading = resmap;
         for (i = 0; resclasses[i]; ++i) {
             MNCL_DATA *top = mncl_data_lookup(resmap, resclasses[i]->type);
             if (top && top->tag == MNCL_DATA_OBJECT) {
-                mncl_kv_foreach(top->value.object, alloc_resource_type, resclasses[i]);
+                /* Later classes may look these up, so each one is
+                 * published as soon as it is loaded */
+                alloc_resource_class(resclasses[i], top->value.object);
             }
         }
+        resmap_loading = NULL;
         mncl_free_data(resmap);
     }
 }
@@ -417,43 +682,36 @@ mncl_load_resmap(const char *path)
 void
 mncl_unload_resmap(const char *path)
 {
-    MNCL_DATA *resmap = NULL;
-    MNCL_RAW *resmap_file = mncl_acquire_raw(path);
-    if (!resmap_file) {
-        return;
-    }
-    resmap = mncl_parse_data((char *)resmap_file->data, resmap_file->size);
-    mncl_release_raw(resmap_file);
+    int found;
+    MNCL_DATA *resmap = resmap_read(path, &found);
     if (resmap) {
         int i;
         for (i = 0; resclasses[i]; ++i) {
             MNCL_DATA *top = mncl_data_lookup(resmap, resclasses[i]->type);
             if (top && top->tag == MNCL_DATA_OBJECT) {
-                mncl_kv_foreach(top->value.object, free_resource_type, resclasses[i]);
+                unload_resource_class(resclasses[i], top->value.object);
             }
         }
         mncl_free_data(resmap);
     }
 }
 
-static void
-delete_value (const char *key, void *val, void *user)
-{
-    (void)key;
-    if (val && user) {
-        MNCL_KV_DELETER deleter = (MNCL_KV_DELETER)user;
-        deleter(val);
-    }
-}
-
 void
 mncl_unload_all_resources(void)
 {
     int i;
     for (i = 0; resclasses[i]; ++i) {
-        mncl_kv_foreach(&resclasses[i]->values, delete_value, resclasses[i]->values.deleter);
-        tree_postorder(&(resclasses[i]->values.tree), (TREE_VISITOR)free);
-        resclasses[i]->values.tree.root = NULL;
+        RES_CLASS *rc = resclasses[i];
+        MNCL_KV_DELETER deleter = rc->values.deleter;
+        mncl_kv_unpublish(&rc->published);
+        mncl_kv_foreach(&rc->values, retire_resource_type, rc);
+        rc->values.deleter = NULL;
+        mncl_kv_clear(&rc->values);
+        rc->values.deleter = deleter;
+    }
+    for (i = 0; i < FIELD_COUNT; ++i) {
+        mncl_free_data_path(field_paths[i]);
+        field_paths[i] = NULL;
     }
     mncl_uninit_traits();
 }
@@ -463,49 +721,49 @@ mncl_unload_all_resources(void)
 MNCL_RAW *
 mncl_raw_resource(const char *resource)
 {
-    return (MNCL_RAW *)mncl_kv_find(&raw.values, resource);
+    return (MNCL_RAW *)mncl_kv_find_published(&raw.published, resource);
 }
 
 MNCL_SPRITESHEET *
 mncl_spritesheet_resource(const char *resource)
 {
-    return (MNCL_SPRITESHEET *)mncl_kv_find(&spritesheet.values, resource);
+    return (MNCL_SPRITESHEET *)mncl_kv_find_published(&spritesheet.published, resource);
 }
 
 MNCL_SPRITE *
 mncl_sprite_resource(const char *resource)
 {
-    return (MNCL_SPRITE *)mncl_kv_find(&sprite.values, resource);
+    return (MNCL_SPRITE *)mncl_kv_find_published(&sprite.published, resource);
 }
 
 MNCL_FONT *
 mncl_font_resource(const char *resource)
 {
-    return (MNCL_FONT *)mncl_kv_find(&font.values, resource);
+    return (MNCL_FONT *)mncl_kv_find_published(&font.published, resource);
 }
 
 MNCL_SFX *
 mncl_sfx_resource(const char *resource)
 {
-    return (MNCL_SFX *)mncl_kv_find(&sfx.values, resource);
+    return (MNCL_SFX *)mncl_kv_find_published(&sfx.published, resource);
 }
 
 MNCL_DATA *
 mncl_data_resource(const char *resource)
 {
-    return (MNCL_DATA *)mncl_kv_find(&data.values, resource);
+    return (MNCL_DATA *)mncl_kv_find_published(&data.published, resource);
 }
 
 MNCL_KIND *
 mncl_kind_resource(const char *resource)
 {
-    return (MNCL_KIND *)mncl_kv_find(&kind.values, resource);
+    return (MNCL_KIND *)mncl_kv_find_published(&kind.published, resource);
 }
 
 void
 mncl_play_music_resource(const char *resource, int fade_in_ms)
 {
-    char *musicval = (char *)mncl_kv_find(&music.values, resource);
+    char *musicval = (char *)mncl_kv_find_published(&music.published, resource);
     
     if (musicval) {
         mncl_play_music_file(musicval, fade_in_ms);
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "tree.h"
+#include "epoch.h"
 /**********************************************************************
  * tree.c - binary search trees implementation
  *
@@ -29,20 +30,218 @@ key_value_node_cmp(TREE_NODE *a, TREE_NODE *b)
     return strcmp(((KEY_VALUE_NODE *)a)->key, ((KEY_VALUE_NODE *)b)->key);
 }
 
-KEY_VALUE_NODE *
-key_value_node_alloc(const char *key, void *value)
+/* Node pools. Slabs start small, because most trees (like the ones
+ * inside parsed data objects) are small, and double until they hit
+ * a few pages' worth of nodes. */
+
+#define POOL_MIN_SLAB_NODES 4
+#define POOL_MAX_SLAB_BYTES 16384
+
+/* The slab header is padded out so the nodes after it are aligned as
+ * well as anything malloc would hand back. */
+typedef union {
+    TREE_POOL_SLAB slab;
+    double d;
+    void *p;
+    long l;
+} POOL_SLAB_HEADER;
+
+#define POOL_SLAB_NODES(slab) ((char *)(slab) + sizeof(POOL_SLAB_HEADER))
+
+void
+tree_pool_init(TREE_POOL *pool, size_t node_size)
+{
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->node_size = node_size;
+}
+
+void *
+tree_pool_alloc(TREE_POOL *pool)
 {
-    int size = strlen(key)+1;
-    KEY_VALUE_NODE *result = (KEY_VALUE_NODE *)malloc(sizeof(KEY_VALUE_NODE) + size);
+    TREE_POOL_SLAB *slab = pool->slabs;
+    /* Round up here rather than in init so that statically
+     * initialized pools work too */
+    size_t size = (pool->node_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (pool->free_list) {
+        void *result = pool->free_list;
+        pool->free_list = *(void **)result;
+        return result;
+    }
+    if (!slab || slab->used == slab->capacity) {
+        size_t capacity = slab ? slab->capacity * 2 : POOL_MIN_SLAB_NODES;
+        if (slab && capacity * size > POOL_MAX_SLAB_BYTES) {
+            capacity = slab->capacity > POOL_MAX_SLAB_BYTES / size ? slab->capacity : POOL_MAX_SLAB_BYTES / size;
+        }
+        slab = (TREE_POOL_SLAB *)malloc(sizeof(POOL_SLAB_HEADER) + capacity * size);
+        if (!slab) {
+            return NULL;
+        }
+        slab->capacity = capacity;
+        slab->used = 0;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+    }
+    return POOL_SLAB_NODES(slab) + size * slab->used++;
+}
+
+void
+tree_pool_free(TREE_POOL *pool, void *node)
+{
+    if (node) {
+        *(void **)node = pool->free_list;
+        pool->free_list = node;
+    }
+}
+
+void
+tree_pool_reset(TREE_POOL *pool)
+{
+    /* The newest slab is always the largest, so it's the one worth
+     * keeping */
+    TREE_POOL_SLAB *slab = pool->slabs;
+    if (!slab) {
+        return;
+    }
+    while (slab->next) {
+        TREE_POOL_SLAB *next = slab->next->next;
+        free(slab->next);
+        slab->next = next;
+    }
+    slab->used = 0;
+    pool->free_list = NULL;
+}
+
+void
+tree_pool_release(TREE_POOL *pool)
+{
+    while (pool->slabs) {
+        TREE_POOL_SLAB *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free_list = NULL;
+}
+
+static KEY_VALUE_NODE *
+key_value_node_alloc(MNCL_KV *kv, MNCL_ATOM *key, void *value)
+{
+    KEY_VALUE_NODE *result = (KEY_VALUE_NODE *)tree_pool_alloc(&kv->nodes);
     if (!result) {
         return NULL;
     }
     result->value = value;
-    strncpy(result->data, key, size);
-    result->key = &(result->data[0]);
+    result->key = key->name;
+    result->atom = key;
     return result;
 }
 
+/* Hash index maintenance. The index is linear-probed, and deletions
+ * shift later members of the probe run back rather than leaving
+ * tombstones, so an empty slot always means "not here". */
+
+static KEY_VALUE_NODE **
+kv_index_slot(MNCL_KV *kv, MNCL_ATOM *key)
+{
+    unsigned int mask = kv->index_size - 1;
+    unsigned int i = key->hash & mask;
+    while (kv->index[i] && kv->index[i]->atom != key) {
+        i = (i + 1) & mask;
+    }
+    return &kv->index[i];
+}
+
+/* Makes room in the index for count entries, rehashing into a single
+ * new table if the current one would end up more than half full. */
+static int
+kv_index_reserve(MNCL_KV *kv, unsigned int count)
+{
+    unsigned int i, old_size = kv->index_size;
+    KEY_VALUE_NODE **old_index = kv->index;
+    unsigned int new_size = old_size ? old_size : 8;
+    KEY_VALUE_NODE **new_index;
+    while (count * 2 > new_size) {
+        new_size *= 2;
+    }
+    if (new_size == old_size) {
+        return 1;
+    }
+    new_index = (KEY_VALUE_NODE **)calloc(new_size, sizeof(KEY_VALUE_NODE *));
+    if (!new_index) {
+        return 0;
+    }
+    kv->index = new_index;
+    kv->index_size = new_size;
+    for (i = 0; i < old_size; ++i) {
+        KEY_VALUE_NODE *n = old_index[i];
+        if (n) {
+            *kv_index_slot(kv, n->atom) = n;
+        }
+    }
+    free(old_index);
+    return 1;
+}
+
+static void
+kv_index_remove(MNCL_KV *kv, KEY_VALUE_NODE **slot)
+{
+    unsigned int mask = kv->index_size - 1;
+    unsigned int hole = slot - kv->index;
+    unsigned int i = hole;
+    while (1) {
+        unsigned int home;
+        i = (i + 1) & mask;
+        if (!kv->index[i]) {
+            break;
+        }
+        home = kv->index[i]->atom->hash & mask;
+        /* Move the entry back if the hole lies between its home slot
+         * and where it currently sits, cyclically speaking */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            kv->index[hole] = kv->index[i];
+            hole = i;
+        }
+    }
+    kv->index[hole] = NULL;
+}
+
+static KEY_VALUE_NODE *
+kv_lookup(MNCL_KV *kv, MNCL_ATOM *key)
+{
+    if (!kv->count || !key) {
+        return NULL;
+    }
+    return *kv_index_slot(kv, key);
+}
+
+/* Frozen maps */
+
+static KEY_VALUE_PAIR *
+kv_frozen_lookup(KV_FROZEN *f, MNCL_ATOM *key)
+{
+    unsigned int i = key->hash & f->mask;
+    while (f->slots[i]) {
+        KEY_VALUE_PAIR *pair = &f->pairs[f->slots[i] - 1];
+        if (pair->key == key) {
+            return pair;
+        }
+        i = (i + 1) & f->mask;
+    }
+    return NULL;
+}
+
+static void
+kv_frozen_foreach(KV_FROZEN *f, unsigned int first, unsigned int count, MNCL_KV_VALUE_FN fn, void *user)
+{
+    KEY_VALUE_PAIR *pair = &f->pairs[first];
+    while (count--) {
+        fn(pair->key->name, pair->value, user);
+        ++pair;
+    }
+}
+
+static int kv_thaw(MNCL_KV *kv);
+
 MNCL_KV *
 mncl_alloc_kv(MNCL_KV_DELETER deleter)
 {
@@ -51,85 +250,167 @@ mncl_alloc_kv(MNCL_KV_DELETER deleter)
         return NULL;
     }
     result->tree.root = NULL;
+    result->tree.flags = TREE_ORDER_STATISTICS;
     result->deleter = deleter;
+    tree_pool_init(&result->nodes, sizeof(KEY_VALUE_NODE));
+    result->index = NULL;
+    result->index_size = 0;
+    result->count = 0;
+    result->frozen = NULL;
     return result;
 }
 
+/* Throws away kv's nodes and index without touching the values. */
+static void
+kv_forget(MNCL_KV *kv)
+{
+    tree_pool_release(&kv->nodes);
+    kv->tree.root = NULL;
+    free(kv->index);
+    kv->index = NULL;
+    kv->index_size = 0;
+    kv->count = 0;
+    if (kv->frozen && !kv->frozen->borrowed) {
+        free(kv->frozen);
+    }
+    kv->frozen = NULL;
+}
+
 void
-mncl_free_kv(MNCL_KV *kv)
+mncl_kv_clear(MNCL_KV *kv)
 {
     if (!kv) {
         return;
     }
-    if (kv->deleter) {
+    if (kv->deleter && kv->frozen) {
+        unsigned int i;
+        for (i = 0; i < kv->count; ++i) {
+            kv->deleter(kv->frozen->pairs[i].value);
+        }
+    } else if (kv->deleter) {
         TREE_NODE *node = tree_minimum(&kv->tree);
         while (node) {
             kv->deleter(((KEY_VALUE_NODE *)node)->value);
             node = tree_next(node);
         }
     }
-    tree_postorder (&kv->tree, (TREE_VISITOR)free);
+    kv_forget(kv);
+}
+
+void
+mncl_free_kv(MNCL_KV *kv)
+{
+    if (!kv) {
+        return;
+    }
+    mncl_kv_clear(kv);
     free(kv);
 }
 
 int
-mncl_kv_insert(MNCL_KV *kv, const char *key, void *value)
+mncl_kv_insert_atom(MNCL_KV *kv, MNCL_ATOM *key, void *value)
 {
-    KEY_SEARCH_NODE seek;
     KEY_VALUE_NODE *result;
-    if (!kv) {
+    if (!kv || !key) {
+        return 0;
+    }
+    if (kv->frozen && !kv_thaw(kv)) {
         return 0;
     }
-    seek.key=key;
-    result = (KEY_VALUE_NODE *)tree_find(&kv->tree, (TREE_NODE *)&seek, key_value_node_cmp);
+    result = kv_lookup(kv, key);
     if (result) {
         if (kv->deleter) {
             kv->deleter(result->value);
         }
         result->value = value;
     } else {
-        result = key_value_node_alloc(key, value);
+        if (!kv_index_reserve(kv, kv->count + 1)) {
+            return 0;
+        }
+        result = key_value_node_alloc(kv, key, value);
         if (!result) {
             return 0;
         } else {
             tree_insert(&kv->tree, (TREE_NODE *)result, key_value_node_cmp);
+            *kv_index_slot(kv, key) = result;
+            ++kv->count;
         }
     }
     return 1;
 }
 
+int
+mncl_kv_insert(MNCL_KV *kv, const char *key, void *value)
+{
+    return mncl_kv_insert_atom(kv, mncl_atom(key), value);
+}
+
 void *
-mncl_kv_find(MNCL_KV *kv, const char *key)
+mncl_kv_find_atom(MNCL_KV *kv, MNCL_ATOM *key)
 {
-    KEY_SEARCH_NODE seek;
     KEY_VALUE_NODE *result;
     if (!kv) {
         return NULL;
     }
-    seek.key = key;
-    result = (KEY_VALUE_NODE *)tree_find(&kv->tree, (TREE_NODE *)&seek, key_value_node_cmp);
+    if (kv->frozen) {
+        KEY_VALUE_PAIR *pair = key ? kv_frozen_lookup(kv->frozen, key) : NULL;
+        return pair ? pair->value : NULL;
+    }
+    result = kv_lookup(kv, key);
     if (result) {
         return result->value;
     }
     return NULL;
 }
 
+void *
+mncl_kv_find(MNCL_KV *kv, const char *key)
+{
+    /* A string that was never interned can't be a key anywhere */
+    return mncl_kv_find_atom(kv, mncl_atom_find(key));
+}
+
+void *
+kv_find_atom_hinted(MNCL_KV *kv, MNCL_ATOM *key, unsigned int *hint)
+{
+    KV_FROZEN *f;
+    KEY_VALUE_PAIR *pair;
+    if (!kv || !kv->frozen || !key) {
+        return mncl_kv_find_atom(kv, key);
+    }
+    f = kv->frozen;
+    if (*hint < kv->count && f->pairs[*hint].key == key) {
+        return f->pairs[*hint].value;
+    }
+    pair = kv_frozen_lookup(f, key);
+    if (!pair) {
+        return NULL;
+    }
+    *hint = (unsigned int)(pair - f->pairs);
+    return pair->value;
+}
+
 void
 mncl_kv_delete(MNCL_KV *kv, const char *key)
 {
-    KEY_SEARCH_NODE seek;
-    KEY_VALUE_NODE *result;
-    if (!kv) {
+    MNCL_ATOM *atom = mncl_atom_find(key);
+    KEY_VALUE_NODE **slot, *result;
+    if (!kv || !kv->count || !atom) {
         return;
     }
-    seek.key = key;
-    result = (KEY_VALUE_NODE *)tree_find(&kv->tree, (TREE_NODE *)&seek, key_value_node_cmp);
+    if (kv->frozen && (!kv_frozen_lookup(kv->frozen, atom) || !kv_thaw(kv))) {
+        return;
+    }
+    slot = kv_index_slot(kv, atom);
+    result = *slot;
     if (result) {
         if (kv->deleter) {
             kv->deleter(result->value);
         }
+        kv_index_remove(kv, slot);
+        --kv->count;
         tree_delete(&kv->tree, (TREE_NODE *)result);
-        free(result);
+        tree_pool_free(&kv->nodes, result);
     }
 }
 
@@ -140,6 +421,10 @@ mncl_kv_foreach(MNCL_KV *kv, MNCL_KV_VALUE_FN fn, void *user)
     if (!kv) {
         return;
     }
+    if (kv->frozen) {
+        kv_frozen_foreach(kv->frozen, 0, kv->count, fn, user);
+        return;
+    }
     node = tree_minimum(&kv->tree);
     while (node) {
         KEY_VALUE_NODE *kvn = (KEY_VALUE_NODE *)node;
@@ -148,6 +433,449 @@ mncl_kv_foreach(MNCL_KV *kv, MNCL_KV_VALUE_FN fn, void *user)
     }
 }
 
+unsigned int
+mncl_kv_count(MNCL_KV *kv)
+{
+    return kv ? kv->count : 0;
+}
+
+void
+mncl_kv_foreach_range(MNCL_KV *kv, unsigned int first, unsigned int count, MNCL_KV_VALUE_FN fn, void *user)
+{
+    TREE_NODE *node;
+    if (!kv) {
+        return;
+    }
+    if (kv->frozen) {
+        if (first < kv->count) {
+            kv_frozen_foreach(kv->frozen, first, (count < kv->count - first) ? count : kv->count - first, fn, user);
+        }
+        return;
+    }
+    node = tree_select(&kv->tree, first);
+    while (node && count--) {
+        KEY_VALUE_NODE *kvn = (KEY_VALUE_NODE *)node;
+        fn(kvn->key, kvn->value, user);
+        node = tree_next(node);
+    }
+}
+
+/* Bulk construction and merging */
+
+static int
+kv_pair_cmp(const KEY_VALUE_PAIR *a, const KEY_VALUE_PAIR *b)
+{
+    return (a->key == b->key) ? 0 : strcmp(a->key->name, b->key->name);
+}
+
+/* A plain top-down merge sort, since duplicate keys need stability.
+ * The sorted result ends up in pairs; scratch must be as large. */
+static void
+kv_sort_pairs(KEY_VALUE_PAIR *pairs, KEY_VALUE_PAIR *scratch, unsigned int n)
+{
+    unsigned int i, j, k, mid = n / 2;
+    if (n < 2) {
+        return;
+    }
+    kv_sort_pairs(pairs, scratch, mid);
+    kv_sort_pairs(pairs + mid, scratch, n - mid);
+    if (kv_pair_cmp(&pairs[mid - 1], &pairs[mid]) <= 0) {
+        return;
+    }
+    memcpy(scratch, pairs, mid * sizeof(KEY_VALUE_PAIR));
+    i = 0; j = mid; k = 0;
+    while (i < mid && j < n) {
+        if (kv_pair_cmp(&pairs[j], &scratch[i]) < 0) {
+            pairs[k++] = pairs[j++];
+        } else {
+            pairs[k++] = scratch[i++];
+        }
+    }
+    while (i < mid) {
+        pairs[k++] = scratch[i++];
+    }
+}
+
+int
+mncl_kv_build(MNCL_KV *kv, KEY_VALUE_PAIR *pairs, unsigned int n)
+{
+    unsigned int i, unique;
+    int sorted = 1;
+    TREE_NODE **nodes;
+    if (!kv || kv->count) {
+        return 0;
+    }
+    if (!n) {
+        return 1;
+    }
+    for (i = 1; i < n; ++i) {
+        if (kv_pair_cmp(&pairs[i - 1], &pairs[i]) >= 0) {
+            sorted = 0;
+            break;
+        }
+    }
+    /* The node array doubles as merge sort scratch space */
+    i = sorted ? n : (n * sizeof(KEY_VALUE_PAIR) + sizeof(TREE_NODE *) - 1) / sizeof(TREE_NODE *);
+    nodes = (TREE_NODE **)malloc(i * sizeof(TREE_NODE *));
+    if (!nodes || !kv_index_reserve(kv, n)) {
+        free(nodes);
+        return 0;
+    }
+    if (!sorted) {
+        kv_sort_pairs(pairs, (KEY_VALUE_PAIR *)nodes, n);
+    }
+    unique = 0;
+    for (i = 0; i < n; ++i) {
+        KEY_VALUE_NODE *node;
+        if (i + 1 < n && pairs[i].key == pairs[i + 1].key) {
+            continue;
+        }
+        node = key_value_node_alloc(kv, pairs[i].key, pairs[i].value);
+        if (!node) {
+            free(nodes);
+            kv_forget(kv);
+            return 0;
+        }
+        nodes[unique++] = (TREE_NODE *)node;
+        *kv_index_slot(kv, node->atom) = node;
+    }
+    /* Only now that nothing can fail, drop the shadowed duplicates */
+    if (kv->deleter && unique < n) {
+        for (i = 0; i + 1 < n; ++i) {
+            if (pairs[i].key == pairs[i + 1].key) {
+                kv->deleter(pairs[i].value);
+            }
+        }
+    }
+    tree_build_sorted(&kv->tree, nodes, unique);
+    kv->count = unique;
+    free(nodes);
+    return 1;
+}
+
+MNCL_KV *
+mncl_kv_from_sorted(MNCL_KV_DELETER deleter, const char **keys, void **values, unsigned int n)
+{
+    unsigned int i;
+    MNCL_KV *result = mncl_alloc_kv(deleter);
+    KEY_VALUE_PAIR *pairs = (KEY_VALUE_PAIR *)malloc((n ? n : 1) * sizeof(KEY_VALUE_PAIR));
+    if (!result || !pairs) {
+        free(result);
+        free(pairs);
+        return NULL;
+    }
+    for (i = 0; i < n; ++i) {
+        pairs[i].key = mncl_atom(keys[i]);
+        pairs[i].value = values[i];
+        if (!pairs[i].key) {
+            break;
+        }
+    }
+    if (i < n || !mncl_kv_build(result, pairs, n)) {
+        free(result);
+        result = NULL;
+    }
+    free(pairs);
+    return result;
+}
+
+int
+mncl_kv_merge(MNCL_KV *dest, MNCL_KV *src)
+{
+    unsigned int i, added, dcount, scount;
+    TREE_NODE *node, **merged, **fresh;
+    if (!dest || !src) {
+        return 0;
+    }
+    if ((dest->frozen && !kv_thaw(dest)) || (src->frozen && !kv_thaw(src))) {
+        return 0;
+    }
+    dcount = dest->count;
+    scount = src->count;
+    if (!scount) {
+        return 1;
+    }
+    merged = (TREE_NODE **)malloc((dcount + 2 * scount) * sizeof(TREE_NODE *));
+    if (!merged || !kv_index_reserve(dest, dcount + scount)) {
+        free(merged);
+        return 0;
+    }
+    /* First allocate everything, so that failure leaves both maps as
+     * they were. Keys already in dest need no new node. */
+    fresh = merged + dcount + scount;
+    for (i = 0, node = tree_minimum(&src->tree); node; ++i, node = tree_next(node)) {
+        KEY_VALUE_NODE *kvn = (KEY_VALUE_NODE *)node;
+        if (kv_lookup(dest, kvn->atom)) {
+            fresh[i] = NULL;
+        } else {
+            fresh[i] = (TREE_NODE *)key_value_node_alloc(dest, kvn->atom, kvn->value);
+            if (!fresh[i]) {
+                while (i--) {
+                    if (fresh[i]) {
+                        tree_pool_free(&dest->nodes, fresh[i]);
+                    }
+                }
+                free(merged);
+                return 0;
+            }
+        }
+    }
+    added = 0;
+    for (i = 0, node = tree_minimum(&src->tree); node; ++i, node = tree_next(node)) {
+        KEY_VALUE_NODE *kvn = (KEY_VALUE_NODE *)node;
+        if (fresh[i]) {
+            *kv_index_slot(dest, kvn->atom) = (KEY_VALUE_NODE *)fresh[i];
+            fresh[added++] = fresh[i];
+        } else {
+            KEY_VALUE_NODE *old = kv_lookup(dest, kvn->atom);
+            if (dest->deleter) {
+                dest->deleter(old->value);
+            }
+            old->value = kvn->value;
+        }
+    }
+    /* A handful of new keys are cheaper to insert one by one than to
+     * relink the whole tree around. */
+    if (added * 8 < dcount) {
+        for (i = 0; i < added; ++i) {
+            tree_insert(&dest->tree, fresh[i], key_value_node_cmp);
+        }
+    } else {
+        unsigned int j = 0, k = 0;
+        node = tree_minimum(&dest->tree);
+        while (node || j < added) {
+            if (node && (j == added || key_value_node_cmp(node, fresh[j]) < 0)) {
+                merged[k++] = node;
+                node = tree_next(node);
+            } else {
+                merged[k++] = fresh[j++];
+            }
+        }
+        tree_build_sorted(&dest->tree, merged, k);
+    }
+    dest->count = dcount + added;
+    free(merged);
+    kv_forget(src);
+    return 1;
+}
+
+/* Freezing and thawing */
+
+static unsigned int
+kv_frozen_slots(unsigned int n)
+{
+    unsigned int slots = 8;
+    while (n * 2 > slots) {
+        slots *= 2;
+    }
+    return slots;
+}
+
+size_t
+kv_frozen_size(unsigned int n)
+{
+    return sizeof(KV_FROZEN) + n * sizeof(KEY_VALUE_PAIR) + kv_frozen_slots(n) * sizeof(unsigned int);
+}
+
+/* Lays out a frozen block for n pairs, with an empty index */
+static void
+kv_frozen_init(KV_FROZEN *f, unsigned int n, unsigned int borrowed)
+{
+    unsigned int slots = kv_frozen_slots(n);
+    f->mask = slots - 1;
+    f->borrowed = borrowed;
+    f->slots = (unsigned int *)&f->pairs[n];
+    memset(f->slots, 0, slots * sizeof(unsigned int));
+}
+
+static KV_FROZEN *
+kv_frozen_alloc(unsigned int n)
+{
+    KV_FROZEN *f = (KV_FROZEN *)malloc(kv_frozen_size(n));
+    if (f) {
+        kv_frozen_init(f, n, 0);
+    }
+    return f;
+}
+
+/* Indexes the first n pairs of f */
+static void
+kv_frozen_index(KV_FROZEN *f, unsigned int n)
+{
+    unsigned int i;
+    for (i = 0; i < n; ++i) {
+        unsigned int slot = f->pairs[i].key->hash & f->mask;
+        while (f->slots[slot]) {
+            slot = (slot + 1) & f->mask;
+        }
+        f->slots[slot] = i + 1;
+    }
+}
+
+/* Fills f with kv's pairs in order, and indexes them */
+static void
+kv_frozen_fill(KV_FROZEN *f, MNCL_KV *kv)
+{
+    unsigned int i;
+    if (kv->frozen) {
+        memcpy(f->pairs, kv->frozen->pairs, kv->count * sizeof(KEY_VALUE_PAIR));
+    } else {
+        TREE_NODE *node;
+        for (i = 0, node = tree_minimum(&kv->tree); node; ++i, node = tree_next(node)) {
+            f->pairs[i].key = ((KEY_VALUE_NODE *)node)->atom;
+            f->pairs[i].value = ((KEY_VALUE_NODE *)node)->value;
+        }
+    }
+    kv_frozen_index(f, kv->count);
+}
+
+int
+mncl_kv_freeze(MNCL_KV *kv)
+{
+    unsigned int n;
+    KV_FROZEN *f;
+    if (!kv) {
+        return 0;
+    }
+    n = kv->count;
+    if (kv->frozen || !n) {
+        return 1;
+    }
+    f = kv_frozen_alloc(n);
+    if (!f) {
+        return 0;
+    }
+    kv_frozen_fill(f, kv);
+    kv_forget(kv);
+    kv->frozen = f;
+    kv->count = n;
+    return 1;
+}
+
+/* Turns a frozen map back into a tree, in linear time since the
+ * pairs are already in order. On failure the map stays frozen. */
+static int
+kv_thaw(MNCL_KV *kv)
+{
+    KV_FROZEN *f = kv->frozen;
+    unsigned int n = kv->count;
+    kv->frozen = NULL;
+    kv->count = 0;
+    if (!mncl_kv_build(kv, f->pairs, n)) {
+        kv->frozen = f;
+        kv->count = n;
+        return 0;
+    }
+    if (!f->borrowed) {
+        free(f);
+    }
+    return 1;
+}
+
+void
+mncl_kv_init_frozen(MNCL_KV *kv, void *block, MNCL_KV_DELETER deleter, KEY_VALUE_PAIR *pairs, unsigned int n)
+{
+    KV_FROZEN *f = (KV_FROZEN *)block;
+    unsigned int i, unique = 0;
+    kv->tree.root = NULL;
+    kv->tree.flags = TREE_ORDER_STATISTICS;
+    kv->deleter = deleter;
+    tree_pool_init(&kv->nodes, sizeof(KEY_VALUE_NODE));
+    kv->index = NULL;
+    kv->index_size = 0;
+    kv->count = 0;
+    kv->frozen = NULL;
+    if (!n) {
+        return;
+    }
+    kv_frozen_init(f, n, 1);
+    /* The block's pair array is sort scratch until it's filled */
+    kv_sort_pairs(pairs, f->pairs, n);
+    for (i = 0; i < n; ++i) {
+        if (i + 1 < n && pairs[i].key == pairs[i + 1].key) {
+            if (deleter) {
+                deleter(pairs[i].value);
+            }
+            continue;
+        }
+        f->pairs[unique++] = pairs[i];
+    }
+    kv_frozen_index(f, unique);
+    kv->frozen = f;
+    kv->count = unique;
+}
+
+/* Published snapshots */
+
+/* Looks a key up by its characters alone, for readers that mustn't
+ * touch the atom table. */
+static KEY_VALUE_PAIR *
+kv_frozen_lookup_name(KV_FROZEN *f, const char *key)
+{
+    unsigned int hash = atom_hash(key, NULL);
+    unsigned int i = hash & f->mask;
+    while (f->slots[i]) {
+        KEY_VALUE_PAIR *pair = &f->pairs[f->slots[i] - 1];
+        if (pair->key->hash == hash && !strcmp(pair->key->name, key)) {
+            return pair;
+        }
+        i = (i + 1) & f->mask;
+    }
+    return NULL;
+}
+
+static void
+kv_snapshot_free(void *snapshot)
+{
+    mncl_free_kv((MNCL_KV *)snapshot);
+}
+
+int
+mncl_kv_publish(MNCL_KV_PUBLISHED *pub, MNCL_KV *kv)
+{
+    MNCL_KV *snapshot = mncl_alloc_kv(NULL), *old;
+    KV_FROZEN *f = kv_frozen_alloc(kv->count);
+    if (!snapshot || !f) {
+        free(snapshot);
+        free(f);
+        return 0;
+    }
+    kv_frozen_fill(f, kv);
+    snapshot->frozen = f;
+    snapshot->count = kv->count;
+    old = __atomic_exchange_n(&pub->current, snapshot, __ATOMIC_SEQ_CST);
+    if (old) {
+        mncl_epoch_retire(old, kv_snapshot_free);
+    }
+    return 1;
+}
+
+void *
+mncl_kv_find_published(MNCL_KV_PUBLISHED *pub, const char *key)
+{
+    void *result = NULL;
+    MNCL_KV *snapshot;
+    mncl_epoch_enter();
+    snapshot = __atomic_load_n(&pub->current, __ATOMIC_SEQ_CST);
+    if (snapshot) {
+        KEY_VALUE_PAIR *pair = kv_frozen_lookup_name(snapshot->frozen, key);
+        if (pair) {
+            result = pair->value;
+        }
+    }
+    mncl_epoch_exit();
+    return result;
+}
+
+void
+mncl_kv_unpublish(MNCL_KV_PUBLISHED *pub)
+{
+    MNCL_KV *old = __atomic_exchange_n(&pub->current, NULL, __ATOMIC_SEQ_CST);
+    if (old) {
+        mncl_epoch_retire(old, kv_snapshot_free);
+    }
+}
+
 TREE_NODE *
 tree_minimum(TREE *t)
 {
@@ -214,14 +942,77 @@ tree_prev(TREE_NODE *n)
     return NULL;
 }
 
+unsigned int
+tree_size(TREE *t)
+{
+    return t->root ? t->root->size : 0;
+}
+
+TREE_NODE *
+tree_select(TREE *t, unsigned int k)
+{
+    TREE_NODE *n = t->root;
+    while (n) {
+        unsigned int left_size = n->left ? n->left->size : 0;
+        if (k < left_size) {
+            n = n->left;
+        } else if (k == left_size) {
+            break;
+        } else {
+            k -= left_size + 1;
+            n = n->right;
+        }
+    }
+    return n;
+}
+
+unsigned int
+tree_rank(TREE *t, TREE_NODE *n)
+{
+    unsigned int result = n->left ? n->left->size : 0;
+    (void)t;
+    while (n->parent) {
+        if (n == n->parent->right) {
+            result += (n->parent->left ? n->parent->left->size : 0) + 1;
+        }
+        n = n->parent;
+    }
+    return result;
+}
+
+/* Subtree sizes for order-statistic trees. Removing a node from the
+ * tree shrinks every subtree on the path from its parent to the
+ * root. */
+static void
+shrink_ancestors(TREE *t, TREE_NODE *n)
+{
+    if (t->flags & TREE_ORDER_STATISTICS) {
+        for (n = n->parent; n; n = n->parent) {
+            --n->size;
+        }
+    }
+}
+
+static void
+update_size(TREE *t, TREE_NODE *n)
+{
+    if (t->flags & TREE_ORDER_STATISTICS) {
+        n->size = (n->left ? n->left->size : 0) + (n->right ? n->right->size : 0) + 1;
+    }
+}
+
 TREE_NODE *
 tree_insert_unbalanced(TREE *t, TREE_NODE *i, TREE_CMP cmp)
 {
     TREE_NODE **parent_ptr = &t->root;
     TREE_NODE *n = t->root;
     TREE_NODE *p = NULL;
+    int counted = t->flags & TREE_ORDER_STATISTICS;
     while (n) {
         int c = cmp(i, n);
+        if (counted) {
+            ++n->size;
+        }
         p = n;
         if (c < 0) {
             parent_ptr = &n->left;
@@ -235,6 +1026,7 @@ tree_insert_unbalanced(TREE *t, TREE_NODE *i, TREE_CMP cmp)
     i->left = NULL;
     i->right = NULL;
     i->parent = p;
+    i->size = 1;
     return i;
 }
 
@@ -264,6 +1056,7 @@ tree_delete_unbalanced(TREE *t, TREE_NODE *n)
         return;
     }
     splice_out = (n->left && n->right) ? tree_next(n) : n;
+    shrink_ancestors(t, splice_out);
     orphan = splice_out->left ? splice_out->left : splice_out->right;
     if (orphan) {
         orphan->parent = splice_out->parent;
@@ -286,6 +1079,7 @@ tree_delete_unbalanced(TREE *t, TREE_NODE *n)
         splice_out->parent = n->parent;
         splice_out->left = n->left;
         splice_out->right = n->right;
+        splice_out->size = n->size;
         if (n->left) {
             n->left->parent = splice_out;
         }
@@ -355,6 +1149,39 @@ tree_postorder(TREE *t, TREE_VISITOR visitor)
 #define RB_RED   0
 #define RB_BLACK 1
 
+/* Links nodes[0..n-1] into a subtree under parent. Middle-out splits
+ * keep every level full except possibly the one at red_depth. */
+static TREE_NODE *
+build_sorted_aux(TREE_NODE **nodes, unsigned int n, TREE_NODE *parent, int depth, int red_depth)
+{
+    unsigned int mid = n / 2;
+    TREE_NODE *result;
+    if (!n) {
+        return NULL;
+    }
+    result = nodes[mid];
+    result->parent = parent;
+    result->color = (depth == red_depth) ? RB_RED : RB_BLACK;
+    result->size = n;
+    result->left = build_sorted_aux(nodes, mid, result, depth + 1, red_depth);
+    result->right = build_sorted_aux(nodes + mid + 1, n - mid - 1, result, depth + 1, red_depth);
+    return result;
+}
+
+void
+tree_build_sorted(TREE *t, TREE_NODE **nodes, unsigned int n)
+{
+    int red_depth = 0;
+    unsigned int m;
+    for (m = n; m > 1; m >>= 1) {
+        ++red_depth;
+    }
+    t->root = build_sorted_aux(nodes, n, NULL, 0, red_depth);
+    if (t->root) {
+        t->root->color = RB_BLACK;
+    }
+}
+
 static void
 left_rotate(TREE *t, TREE_NODE *n)
 {
@@ -378,6 +1205,8 @@ left_rotate(TREE *t, TREE_NODE *n)
     }
     o->left = n;
     n->parent = o;
+    update_size(t, n);
+    update_size(t, o);
 }
 
 static void
@@ -403,6 +1232,8 @@ right_rotate(TREE *t, TREE_NODE *n)
     }
     o->right = n;
     n->parent = o;
+    update_size(t, n);
+    update_size(t, o);
 }
 
 TREE_NODE *
@@ -464,6 +1295,7 @@ tree_delete(TREE *t, TREE_NODE *n)
         return;
     }
     splice_out = (n->left && n->right) ? tree_next(n) : n;
+    shrink_ancestors(t, splice_out);
     orphan = splice_out->left ? splice_out->left : splice_out->right;
     orphan_parent = splice_out->parent;
     if (orphan) {
@@ -491,6 +1323,7 @@ tree_delete(TREE *t, TREE_NODE *n)
         splice_out->left = n->left;
         splice_out->right = n->right;
         splice_out->color = n->color;
+        splice_out->size = n->size;
         if (orphan_parent == n) {
             orphan_parent = splice_out;
         }
@@ -2,6 +2,7 @@
 #define TREE_H_
 
 #include "monocle.h"
+#include "atom.h"
 
 /**********************************************************************
  * tree.h - binary search trees
@@ -22,35 +23,89 @@
 typedef struct tree_node {
     struct tree_node *parent, *left, *right;
     char color;
+    unsigned int size;
 } TREE_NODE;
 
 /**********************************************************************
  * A generic tree pointer. This actually doesn't care what kind of
  * tree it is.
+ *
+ * If flags includes TREE_ORDER_STATISTICS, every node's size field is
+ * kept equal to the number of nodes in its subtree, as in Chapter 14
+ * of CLRS. This costs a little extra work on insert and delete and
+ * makes tree_select and tree_rank (below) available. Set the flag
+ * while the tree is empty and never clear it.
  **********************************************************************/
 typedef struct tree_core {
     struct tree_node *root;
+    int flags;
 } TREE;
 
+#define TREE_ORDER_STATISTICS 1
+
+/**********************************************************************
+ * Node pools. Trees that churn through lots of nodes of a single type
+ * can carve them out of a TREE_POOL instead of calling malloc and
+ * free for each one. A pool hands out nodes of one size from a chain
+ * of slabs, each twice as large as the last (up to a limit), and
+ * recycles freed nodes through a free list.
+ *
+ * Since a pool owns all of its nodes' memory, throwing away a whole
+ * tree no longer requires visiting it: where you would have written
+ *
+ *    tree_postorder(t, (TREE_VISITOR)free);
+ *
+ * you may instead call tree_pool_reset() (which keeps the largest
+ * slab around for reuse) or tree_pool_release() (which returns
+ * everything to the system). Either way, it's on you to set t->root
+ * to NULL afterwards.
+ *
+ * Node sizes are rounded up to a multiple of the pointer size, so
+ * every node is suitably aligned for the TREE_NODE at its head.
+ **********************************************************************/
+typedef struct tree_pool_slab {
+    struct tree_pool_slab *next;
+    size_t capacity, used;
+} TREE_POOL_SLAB;
+
+typedef struct tree_pool {
+    TREE_POOL_SLAB *slabs;
+    void *free_list;
+    size_t node_size;
+} TREE_POOL;
+
+#define TREE_POOL_INITIALIZER(type) { NULL, NULL, sizeof(type) }
+
+void tree_pool_init(TREE_POOL *pool, size_t node_size);
+void *tree_pool_alloc(TREE_POOL *pool);
+void tree_pool_free(TREE_POOL *pool, void *node);
+void tree_pool_reset(TREE_POOL *pool);
+void tree_pool_release(TREE_POOL *pool);
+
 /**********************************************************************
  * Monocle itself exposes a subset of tree functionality as key-value
  * maps. These use the structures above, but also package cleanup
  * routines. Those routines are defined in monocle.h, not here.
  *
- * MNCL_KV maps key strings to value objects . The key is held within
- * the "data" array, and the client provides a deleter for the value
+ * MNCL_KV maps key strings to value objects. The key is an atom (see
+ * atom.h), and the client provides a deleter for the value
  * pointers. If those values are, say, compile-time constant strings,
  * there is no deleter. KEY_SEARCH_NODE is a "superclass" of
  * KEY_VALUE_NODE that can be stack-allocated for calls to tree_find,
  * below. The key_value_node_cmp function is suitable for use as a
  * TREE_CMP parameter, also below.
+ *
+ * The tree keeps the keys in order for mncl_kv_foreach, but lookups
+ * go through a separate open-addressed hash index of node pointers,
+ * hashed by the atom's cached hash. Since atoms are unique, probing
+ * that index only ever compares pointers.
  **********************************************************************/
 
 typedef struct {
     TREE_NODE header;
     const char *key;
     void *value;
-    char data[0];
+    MNCL_ATOM *atom;
 } KEY_VALUE_NODE;
 
 typedef struct {
@@ -58,14 +113,101 @@ typedef struct {
     const char *key;
 } KEY_SEARCH_NODE;
 
+/* A loose key and value, for building maps in bulk */
+typedef struct {
+    MNCL_ATOM *key;
+    void *value;
+} KEY_VALUE_PAIR;
+
 int key_value_node_cmp(TREE_NODE *a, TREE_NODE *b);
-KEY_VALUE_NODE *key_value_node_alloc(const char *key, void *value);
+
+/* A frozen map (see mncl_kv_freeze) keeps its pairs in one block
+ * instead of in tree nodes: a dense array of pairs in key order,
+ * followed by a compact open-addressed index holding 1 + the position
+ * of each pair (0 marks an empty slot), probed just like the main
+ * hash index. That is 24 bytes or so per key rather than 80. */
+typedef struct {
+    unsigned int mask;
+    unsigned int borrowed; /* Nonzero if the map doesn't own the block */
+    unsigned int *slots;
+    KEY_VALUE_PAIR pairs[0];
+} KV_FROZEN;
 
 struct struct_MNCL_KV {
     TREE tree;
     MNCL_KV_DELETER deleter;
+    TREE_POOL nodes;
+    /* Hash index. The size is zero or a power of two, and is kept at
+     * least twice the count so that misses terminate quickly. */
+    KEY_VALUE_NODE **index;
+    unsigned int index_size, count;
+    /* Non-NULL if the map is frozen, in which case the tree, pool and
+     * index are all empty. */
+    KV_FROZEN *frozen;
 };
 
+/* Statically allocated maps (like the resource classes) may be set up
+ * with this initializer instead of going through mncl_alloc_kv. */
+#define MNCL_KV_INITIALIZER(deleter) { { NULL, TREE_ORDER_STATISTICS }, (deleter), TREE_POOL_INITIALIZER(KEY_VALUE_NODE), NULL, 0, 0, NULL }
+
+/* Deletes every value and node in kv, leaving it empty but usable. */
+void mncl_kv_clear(MNCL_KV *kv);
+
+/* Fills the empty map kv from n key-value pairs in one go. Input that
+ * is already sorted by key is detected and built in linear time;
+ * anything else is stable-sorted first. Duplicate keys behave as they
+ * would under repeated inserts: the last value wins and the others
+ * are handed to the deleter. The pairs array is scrambled in the
+ * process. Returns 0, leaving kv empty and the values untouched, if
+ * memory runs out. */
+int mncl_kv_build(MNCL_KV *kv, KEY_VALUE_PAIR *pairs, unsigned int n);
+
+/* Sets kv up as a frozen map of n pairs without allocating anything:
+ * the MNCL_KV itself and the kv_frozen_size(n) bytes at block are
+ * both the caller's, and may come from an arena. Duplicates are
+ * handled as in mncl_kv_build. The map never frees the block, but
+ * kv still needs mncl_kv_clear if it is ever modified, since that
+ * thaws it into ordinary heap nodes. */
+size_t kv_frozen_size(unsigned int n);
+void mncl_kv_init_frozen(MNCL_KV *kv, void *block, MNCL_KV_DELETER deleter, KEY_VALUE_PAIR *pairs, unsigned int n);
+
+/* Looks key up as mncl_kv_find_atom does. If kv is frozen, the pair
+ * at position *hint is checked first, and *hint is left at wherever
+ * the key turned up. Maps with the same keys keep their pairs in the
+ * same order, so one hint serves a run of similar maps (the frames of
+ * a sprite, say), and most lookups never touch the index. */
+void *kv_find_atom_hinted(MNCL_KV *kv, MNCL_ATOM *key, unsigned int *hint);
+
+/**********************************************************************
+ * Published snapshots. A map that one thread modifies and others only
+ * read may be published: mncl_kv_publish makes a frozen copy of it
+ * (sharing the values, and with no deleter) and atomically swaps that
+ * in as the current snapshot, and mncl_kv_find_published looks keys
+ * up in whatever snapshot is current, from any thread and without
+ * locking. Snapshots that get replaced are reclaimed through
+ * epoch.h once no reader can still be looking at them.
+ *
+ * So that readers never wait on the atom table's lock, they hash the
+ * key string themselves and compare the atoms' characters rather
+ * than interning anything.
+ *
+ * Publishing, and unpublishing (which retires the current snapshot
+ * and leaves none), are for the writer thread only. mncl_kv_publish
+ * returns 0, leaving the old snapshot in place, if memory runs out.
+ * Snapshots keep no values alive, so a value taken out of the map
+ * must not be freed until the map has been republished without it;
+ * hand it to mncl_epoch_retire after that instead.
+ **********************************************************************/
+typedef struct {
+    MNCL_KV *current;
+} MNCL_KV_PUBLISHED;
+
+#define MNCL_KV_PUBLISHED_INITIALIZER { NULL }
+
+int mncl_kv_publish(MNCL_KV_PUBLISHED *pub, MNCL_KV *kv);
+void *mncl_kv_find_published(MNCL_KV_PUBLISHED *pub, const char *key);
+void mncl_kv_unpublish(MNCL_KV_PUBLISHED *pub);
+
 /**********************************************************************
  * Insert or find elements in the tree. Insert does not require unique
  * keys, but will maintain "stability" - that is, items that are
@@ -110,6 +252,27 @@ TREE_NODE *tree_maximum(TREE *t);
 TREE_NODE *tree_next(TREE_NODE *n);
 TREE_NODE *tree_prev(TREE_NODE *n);
 
+/**********************************************************************
+ * Order statistics, for trees with TREE_ORDER_STATISTICS set. Ranks
+ * count from zero, so tree_select(t, 0) is tree_minimum(t).
+ * tree_select returns NULL if k is not less than the size of the
+ * tree. All three are O(lg n).
+ **********************************************************************/
+unsigned int tree_size(TREE *t);
+TREE_NODE *tree_select(TREE *t, unsigned int k);
+unsigned int tree_rank(TREE *t, TREE_NODE *n);
+
+/**********************************************************************
+ * Bulk construction. Given an array of n nodes that are already in
+ * order, tree_build_sorted links them into a valid, perfectly
+ * balanced red-black tree in O(n) time, without a single comparison
+ * or rotation. Every level but the deepest is full; the deepest is
+ * colored red and the rest black. Sizes are filled in whether or not
+ * TREE_ORDER_STATISTICS is set. Whatever t held before is forgotten,
+ * so it should be empty.
+ **********************************************************************/
+void tree_build_sorted(TREE *t, TREE_NODE **nodes, unsigned int n);
+
 /**********************************************************************
  * Traversal functions. you hand them a tree and a visitor function,
  * that visitor function is called in preorder, inorder, or postorder,